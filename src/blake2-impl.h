@@ -130,6 +130,20 @@ static inline uint64_t rotr64( const uint64_t w, const unsigned c )
   return ( w >> c ) | ( w << ( 64 - c ) );
 }
 
+/* The BLAKE2b compression function.  blake2b_update() and blake2b_final()
+ * use the fastest of these that the CPU supports; they all give exactly the
+ * same result as the portable blake2b_compress_ref().  This needs blake2.h
+ * and config.h to have been included first. */
+typedef int blake2b_compress_fn( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] );
+blake2b_compress_fn blake2b_compress_ref;
+#ifdef HAVE_X86_SIMD
+blake2b_compress_fn blake2b_compress_sse41;
+blake2b_compress_fn blake2b_compress_avx2;
+
+/* Unkeyed BLAKE2b of 4 messages of the same length at once. */
+int blake2b_x4_avx2( uint8_t *const out[4], const void *const in[4], uint8_t outlen, uint64_t inlen );
+#endif
+
 /* prevents compiler optimizing out memset() */
 static inline void secure_zero_memory( void *v, size_t n )
 {
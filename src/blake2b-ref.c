@@ -220,7 +220,7 @@ int blake2b_init_key( blake2b_state *S, const uint8_t outlen, const void *key, c
   return 0;
 }
 
-static int blake2b_compress( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
+int blake2b_compress_ref( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
 {
   uint64_t m[16];
   uint64_t v[16];
@@ -283,6 +283,27 @@ static int blake2b_compress( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCK
   return 0;
 }
 
+static int blake2b_compress_select( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] );
+
+static blake2b_compress_fn *blake2b_compress = blake2b_compress_select;
+
+/* Pick the implementation on first use. Several threads might do this at
+ * once, but they will all store the same value. */
+static int blake2b_compress_select( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
+{
+  blake2b_compress_fn *impl = blake2b_compress_ref;
+
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "avx2" ) )
+    impl = blake2b_compress_avx2;
+  else if( __builtin_cpu_supports( "sse4.1" ) )
+    impl = blake2b_compress_sse41;
+#endif
+  blake2b_compress = impl;
+  return impl( S, block );
+}
+
 /* inlen now in bytes */
 int blake2b_update( blake2b_state *S, const uint8_t *in, uint64_t inlen )
 {
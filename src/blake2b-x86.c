@@ -0,0 +1,380 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * blake2b-x86 -- SSE4.1 and AVX2 versions of the BLAKE2b compression
+ * function, and AVX2 BLAKE2b of four messages at once
+ *
+ * based on the BLAKE2 reference source code package, written in 2012 by
+ * Samuel Neves <sneves@dei.uc.pt> and dedicated to the public domain.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The compression functions compute exactly what blake2b_compress_ref()
+ * does, which stays the reference.  The 4x4 state matrix is held a row at
+ * a time: in one 256-bit register for AVX2, or split over two 128-bit
+ * registers for SSE4.1.  G is then applied to all four columns at once,
+ * the rows are rotated so that the diagonals line up as columns, G is
+ * applied again, and the rows are rotated back.  The round is bound by
+ * latency rather than throughput, so rows a, c and d are rotated rather
+ * than b: b is the last row G writes and the first one it reads, and
+ * rotating it would put the shuffle on the critical path.  The diagonals
+ * then come out starting at lane 1, and the message words are loaded to
+ * match.
+ *
+ * The message words for each round are gathered from m[] with the sigma
+ * indices known at compile time, since the rounds are fully unrolled.
+ *
+ * blake2b_x4_avx2() gets around the latency bound when there are several
+ * messages of the same length to hash, such as the blocks of a signature,
+ * by putting one message in each 64-bit lane.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_X86_SIMD
+
+#include <string.h>
+#include <immintrin.h>
+
+#include "blake2.h"
+#include "blake2-impl.h"
+
+static const uint64_t blake2b_IV[8] =
+{
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+  0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+  0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t blake2b_sigma[12][16] =
+{
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 } ,
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 } ,
+  { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 } ,
+  {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 } ,
+  {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 } ,
+  {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 } ,
+  { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 } ,
+  { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 } ,
+  {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 } ,
+  { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13 , 0 } ,
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 } ,
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+/* message word J of round R */
+#define M(r, j) m[blake2b_sigma[r][j]]
+
+
+/* SSE4.1: each row is split into a low (l) and high (h) half. */
+
+#define ROTR32_128(x) _mm_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24_128(x) _mm_shuffle_epi8((x), r24)
+#define ROTR16_128(x) _mm_shuffle_epi8((x), r16)
+#define ROTR63_128(x) _mm_xor_si128(_mm_srli_epi64((x), 63), _mm_add_epi64((x), (x)))
+
+#define G_128(ml, mh, rot1, rot2) {                                     \
+    al = _mm_add_epi64(_mm_add_epi64(al, bl), ml);                      \
+    ah = _mm_add_epi64(_mm_add_epi64(ah, bh), mh);                      \
+    dl = rot1(_mm_xor_si128(dl, al));                                   \
+    dh = rot1(_mm_xor_si128(dh, ah));                                   \
+    cl = _mm_add_epi64(cl, dl);                                         \
+    ch = _mm_add_epi64(ch, dh);                                         \
+    bl = rot2(_mm_xor_si128(bl, cl));                                   \
+    bh = rot2(_mm_xor_si128(bh, ch));                                   \
+}
+
+#define ROUND_128(r) {                                                  \
+    __m128i t0, t1;                                                     \
+    G_128(_mm_set_epi64x(M(r, 2), M(r, 0)),                             \
+          _mm_set_epi64x(M(r, 6), M(r, 4)), ROTR32_128, ROTR24_128);    \
+    G_128(_mm_set_epi64x(M(r, 3), M(r, 1)),                             \
+          _mm_set_epi64x(M(r, 7), M(r, 5)), ROTR16_128, ROTR63_128);    \
+    /* diagonalize, leaving b alone since it is the last one ready */   \
+    t0 = _mm_alignr_epi8(al, ah, 8);                                    \
+    t1 = _mm_alignr_epi8(ah, al, 8);                                    \
+    al = t0; ah = t1;                                                   \
+    t0 = _mm_alignr_epi8(ch, cl, 8);                                    \
+    t1 = _mm_alignr_epi8(cl, ch, 8);                                    \
+    cl = t0; ch = t1;                                                   \
+    t0 = dl; dl = dh; dh = t0;                                          \
+    G_128(_mm_set_epi64x(M(r, 8), M(r, 14)),                            \
+          _mm_set_epi64x(M(r, 12), M(r, 10)), ROTR32_128, ROTR24_128);  \
+    G_128(_mm_set_epi64x(M(r, 9), M(r, 15)),                            \
+          _mm_set_epi64x(M(r, 13), M(r, 11)), ROTR16_128, ROTR63_128);  \
+    /* undiagonalize */                                                 \
+    t0 = _mm_alignr_epi8(ah, al, 8);                                    \
+    t1 = _mm_alignr_epi8(al, ah, 8);                                    \
+    al = t0; ah = t1;                                                   \
+    t0 = _mm_alignr_epi8(cl, ch, 8);                                    \
+    t1 = _mm_alignr_epi8(ch, cl, 8);                                    \
+    cl = t0; ch = t1;                                                   \
+    t0 = dl; dl = dh; dh = t0;                                          \
+}
+
+__attribute__((target("sse4.1")))
+int blake2b_compress_sse41( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
+{
+    const __m128i r16 = _mm_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1,
+                                      10, 11, 12, 13, 14, 15, 8, 9);
+    const __m128i r24 = _mm_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2,
+                                      11, 12, 13, 14, 15, 8, 9, 10);
+    uint64_t m[16];
+    __m128i al, ah, bl, bh, cl, ch, dl, dh;
+    __m128i h0, h1, h2, h3;
+
+    memcpy(m, block, sizeof m);
+
+    al = h0 = _mm_loadu_si128((const __m128i *) &S->h[0]);
+    ah = h1 = _mm_loadu_si128((const __m128i *) &S->h[2]);
+    bl = h2 = _mm_loadu_si128((const __m128i *) &S->h[4]);
+    bh = h3 = _mm_loadu_si128((const __m128i *) &S->h[6]);
+    cl = _mm_loadu_si128((const __m128i *) &blake2b_IV[0]);
+    ch = _mm_loadu_si128((const __m128i *) &blake2b_IV[2]);
+    dl = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &blake2b_IV[4]),
+                       _mm_loadu_si128((const __m128i *) &S->t[0]));
+    dh = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &blake2b_IV[6]),
+                       _mm_loadu_si128((const __m128i *) &S->f[0]));
+
+    ROUND_128(0);
+    ROUND_128(1);
+    ROUND_128(2);
+    ROUND_128(3);
+    ROUND_128(4);
+    ROUND_128(5);
+    ROUND_128(6);
+    ROUND_128(7);
+    ROUND_128(8);
+    ROUND_128(9);
+    ROUND_128(10);
+    ROUND_128(11);
+
+    _mm_storeu_si128((__m128i *) &S->h[0], _mm_xor_si128(h0, _mm_xor_si128(al, cl)));
+    _mm_storeu_si128((__m128i *) &S->h[2], _mm_xor_si128(h1, _mm_xor_si128(ah, ch)));
+    _mm_storeu_si128((__m128i *) &S->h[4], _mm_xor_si128(h2, _mm_xor_si128(bl, dl)));
+    _mm_storeu_si128((__m128i *) &S->h[6], _mm_xor_si128(h3, _mm_xor_si128(bh, dh)));
+    return 0;
+}
+
+
+/* AVX2: each row is in a single register. */
+
+#define ROTR32_256(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24_256(x) _mm256_shuffle_epi8((x), r24)
+#define ROTR16_256(x) _mm256_shuffle_epi8((x), r16)
+#define ROTR63_256(x) _mm256_xor_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+
+#define G_256(mv, rot1, rot2) {                                         \
+    a = _mm256_add_epi64(_mm256_add_epi64(a, b), mv);                   \
+    d = rot1(_mm256_xor_si256(d, a));                                   \
+    c = _mm256_add_epi64(c, d);                                         \
+    b = rot2(_mm256_xor_si256(b, c));                                   \
+}
+
+#define ROUND_256(r) {                                                  \
+    G_256(_mm256_setr_epi64x(M(r, 0), M(r, 2), M(r, 4), M(r, 6)),       \
+          ROTR32_256, ROTR24_256);                                      \
+    G_256(_mm256_setr_epi64x(M(r, 1), M(r, 3), M(r, 5), M(r, 7)),       \
+          ROTR16_256, ROTR63_256);                                      \
+    /* diagonalize, leaving b alone since it is the last one ready */   \
+    a = _mm256_permute4x64_epi64(a, _MM_SHUFFLE(2, 1, 0, 3));           \
+    c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(0, 3, 2, 1));           \
+    d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(1, 0, 3, 2));           \
+    G_256(_mm256_setr_epi64x(M(r, 14), M(r, 8), M(r, 10), M(r, 12)),    \
+          ROTR32_256, ROTR24_256);                                      \
+    G_256(_mm256_setr_epi64x(M(r, 15), M(r, 9), M(r, 11), M(r, 13)),    \
+          ROTR16_256, ROTR63_256);                                      \
+    /* undiagonalize */                                                 \
+    a = _mm256_permute4x64_epi64(a, _MM_SHUFFLE(0, 3, 2, 1));           \
+    c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(2, 1, 0, 3));           \
+    d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(1, 0, 3, 2));           \
+}
+
+__attribute__((target("avx2")))
+int blake2b_compress_avx2( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] )
+{
+    const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1,
+                                         10, 11, 12, 13, 14, 15, 8, 9,
+                                         2, 3, 4, 5, 6, 7, 0, 1,
+                                         10, 11, 12, 13, 14, 15, 8, 9);
+    const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2,
+                                         11, 12, 13, 14, 15, 8, 9, 10,
+                                         3, 4, 5, 6, 7, 0, 1, 2,
+                                         11, 12, 13, 14, 15, 8, 9, 10);
+    uint64_t m[16];
+    __m256i a, b, c, d, h0, h1;
+
+    memcpy(m, block, sizeof m);
+
+    a = h0 = _mm256_loadu_si256((const __m256i *) &S->h[0]);
+    b = h1 = _mm256_loadu_si256((const __m256i *) &S->h[4]);
+    c = _mm256_loadu_si256((const __m256i *) &blake2b_IV[0]);
+    d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &blake2b_IV[4]),
+                         _mm256_setr_epi64x(S->t[0], S->t[1], S->f[0], S->f[1]));
+
+    ROUND_256(0);
+    ROUND_256(1);
+    ROUND_256(2);
+    ROUND_256(3);
+    ROUND_256(4);
+    ROUND_256(5);
+    ROUND_256(6);
+    ROUND_256(7);
+    ROUND_256(8);
+    ROUND_256(9);
+    ROUND_256(10);
+    ROUND_256(11);
+
+    _mm256_storeu_si256((__m256i *) &S->h[0], _mm256_xor_si256(h0, _mm256_xor_si256(a, c)));
+    _mm256_storeu_si256((__m256i *) &S->h[4], _mm256_xor_si256(h1, _mm256_xor_si256(b, d)));
+    return 0;
+}
+
+
+
+/* AVX2, four messages at once: each of v[0..15] holds that word of the
+ * state for all four, so G works on whole registers with no shuffling
+ * between rows. */
+
+#define G_X4(r, i, a, b, c, d) {                                        \
+    v[a] = _mm256_add_epi64(_mm256_add_epi64(v[a], v[b]), m[blake2b_sigma[r][2*i+0]]); \
+    v[d] = ROTR32_256(_mm256_xor_si256(v[d], v[a]));                    \
+    v[c] = _mm256_add_epi64(v[c], v[d]);                                \
+    v[b] = ROTR24_256(_mm256_xor_si256(v[b], v[c]));                    \
+    v[a] = _mm256_add_epi64(_mm256_add_epi64(v[a], v[b]), m[blake2b_sigma[r][2*i+1]]); \
+    v[d] = ROTR16_256(_mm256_xor_si256(v[d], v[a]));                    \
+    v[c] = _mm256_add_epi64(v[c], v[d]);                                \
+    v[b] = ROTR63_256(_mm256_xor_si256(v[b], v[c]));                    \
+}
+
+#define ROUND_X4(r) {                                                   \
+    G_X4(r, 0, 0, 4,  8, 12);                                           \
+    G_X4(r, 1, 1, 5,  9, 13);                                           \
+    G_X4(r, 2, 2, 6, 10, 14);                                           \
+    G_X4(r, 3, 3, 7, 11, 15);                                           \
+    G_X4(r, 4, 0, 5, 10, 15);                                           \
+    G_X4(r, 5, 1, 6, 11, 12);                                           \
+    G_X4(r, 6, 2, 7,  8, 13);                                           \
+    G_X4(r, 7, 3, 4,  9, 14);                                           \
+}
+
+__attribute__((target("avx2")))
+static void blake2b_x4_block( __m256i h[8], const uint8_t *const p[4],
+                              uint64_t t, uint64_t f )
+{
+    const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1,
+                                         10, 11, 12, 13, 14, 15, 8, 9,
+                                         2, 3, 4, 5, 6, 7, 0, 1,
+                                         10, 11, 12, 13, 14, 15, 8, 9);
+    const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2,
+                                         11, 12, 13, 14, 15, 8, 9, 10,
+                                         3, 4, 5, 6, 7, 0, 1, 2,
+                                         11, 12, 13, 14, 15, 8, 9, 10);
+    __m256i m[16], v[16];
+    int i;
+
+    /* transpose so that m[i] holds word i of each message */
+    for (i = 0; i < 16; i += 4) {
+        __m256i r0 = _mm256_loadu_si256((const __m256i *) (p[0] + 8 * i));
+        __m256i r1 = _mm256_loadu_si256((const __m256i *) (p[1] + 8 * i));
+        __m256i r2 = _mm256_loadu_si256((const __m256i *) (p[2] + 8 * i));
+        __m256i r3 = _mm256_loadu_si256((const __m256i *) (p[3] + 8 * i));
+        __m256i t0 = _mm256_unpacklo_epi64(r0, r1);
+        __m256i t1 = _mm256_unpackhi_epi64(r0, r1);
+        __m256i t2 = _mm256_unpacklo_epi64(r2, r3);
+        __m256i t3 = _mm256_unpackhi_epi64(r2, r3);
+
+        m[i + 0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+        m[i + 1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+        m[i + 2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+        m[i + 3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+    }
+
+    for (i = 0; i < 8; i++) {
+        v[i] = h[i];
+        v[i + 8] = _mm256_set1_epi64x(blake2b_IV[i]);
+    }
+    v[12] = _mm256_xor_si256(v[12], _mm256_set1_epi64x(t));
+    v[14] = _mm256_xor_si256(v[14], _mm256_set1_epi64x(f));
+
+    ROUND_X4(0);
+    ROUND_X4(1);
+    ROUND_X4(2);
+    ROUND_X4(3);
+    ROUND_X4(4);
+    ROUND_X4(5);
+    ROUND_X4(6);
+    ROUND_X4(7);
+    ROUND_X4(8);
+    ROUND_X4(9);
+    ROUND_X4(10);
+    ROUND_X4(11);
+
+    for (i = 0; i < 8; i++)
+        h[i] = _mm256_xor_si256(h[i], _mm256_xor_si256(v[i], v[i + 8]));
+}
+
+/*
+ * Unkeyed BLAKE2b of 4 messages of INLEN bytes each, with the same result
+ * as blake2b() on each of them.  Messages shorter than 2^64 bytes only
+ * ever use the low word of the counter.
+ */
+__attribute__((target("avx2")))
+int blake2b_x4_avx2( uint8_t *const out[4], const void *const in[4],
+                     uint8_t outlen, uint64_t inlen )
+{
+    uint8_t pad[4][BLAKE2B_BLOCKBYTES];
+    uint64_t sums[8][4];
+    const uint8_t *p[4];
+    __m256i h[8];
+    uint64_t pos, last;
+    int i, j;
+
+    if ( !outlen || outlen > BLAKE2B_OUTBYTES ) return -1;
+
+    for (i = 0; i < 8; i++)
+        h[i] = _mm256_set1_epi64x(blake2b_IV[i]);
+    /* digest length, no key, fanout and depth 1 */
+    h[0] = _mm256_xor_si256(h[0], _mm256_set1_epi64x(0x01010000 | outlen));
+
+    /* every block but the last, which may be partial or even empty */
+    last = inlen ? (inlen - 1) / BLAKE2B_BLOCKBYTES * BLAKE2B_BLOCKBYTES : 0;
+    for (pos = 0; pos < last; pos += BLAKE2B_BLOCKBYTES) {
+        for (i = 0; i < 4; i++)
+            p[i] = (const uint8_t *) in[i] + pos;
+        blake2b_x4_block(h, p, pos + BLAKE2B_BLOCKBYTES, 0);
+    }
+    for (i = 0; i < 4; i++) {
+        memset(pad[i], 0, BLAKE2B_BLOCKBYTES);
+        memcpy(pad[i], (const uint8_t *) in[i] + last, inlen - last);
+        p[i] = pad[i];
+    }
+    blake2b_x4_block(h, p, inlen, ~0ULL);
+
+    for (j = 0; j < 8; j++)
+        _mm256_storeu_si256((__m256i *) sums[j], h[j]);
+    for (i = 0; i < 4; i++) {
+        uint8_t buffer[BLAKE2B_OUTBYTES];
+
+        for (j = 0; j < 8; j++)
+            memcpy(buffer + 8 * j, &sums[j][i], 8);
+        memcpy(out[i], buffer, outlen);
+    }
+    return 0;
+}
+
+#endif /* HAVE_X86_SIMD */
@@ -40,6 +40,19 @@
 
 #include "config.h"
 #include <sys/types.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#define RS_USE_MMAP 1
+#endif
 
 #include <assert.h>
 #include <stdlib.h>
@@ -56,8 +69,10 @@
 /* use fseeko instead of fseek for long file support if we have it */
 #ifdef HAVE_FSEEKO
 #define fseek fseeko
+#define ftell ftello
 #elif defined HAVE_FSEEKO64
 #define fseek fseeko64
+#define ftell ftello64
 #endif
 
 /**
@@ -65,13 +80,33 @@
  */
 int rs_inbuflen = 16000, rs_outbuflen = 16000;
 
+/**
+ * Whether to map regular input files into memory.
+ */
+int rs_map_input = 1;
+
 
 struct rs_filebuf {
         FILE *f;
+        int             fd;
         char            *buf;
         size_t          buf_len;
 };
 
+/**
+ * A whole file mapped into memory.  \p pos is where the file position
+ * was when it was mapped, which is where input taken from the map
+ * starts.
+ */
+struct rs_filemap {
+        FILE            *f;
+        int             fd;
+        char            *map;
+        size_t          len;
+        size_t          pos;
+        int             input;  /* given to a job as its input */
+};
+
 
 rs_filebuf_t *rs_filebuf_new(FILE *f, size_t buf_len)
 {
@@ -225,3 +260,375 @@ rs_result rs_file_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
         return RS_DONE;
     }
 }
+
+
+/*
+ * Map the whole of the regular file open on \p fd, whose position is
+ * \p pos.
+ */
+static rs_filemap_t *rs_filemap_map(int fd, rs_long_t pos)
+{
+#ifdef RS_USE_MMAP
+    rs_filemap_t        *fm;
+    struct stat         st;
+    void                *map;
+
+    if (!rs_map_input
+        || fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0
+        || (rs_long_t) (size_t) st.st_size != st.st_size)
+        return NULL;
+    if (pos < 0 || pos > st.st_size)
+        return NULL;
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        rs_trace("couldn't map fd%d: %s", fd, strerror(errno));
+        return NULL;
+    }
+    rs_trace("mapped " PRINTF_FORMAT_U64 " bytes of fd%d",
+             PRINTF_CAST_U64(st.st_size), fd);
+
+    fm = rs_alloc_struct(rs_filemap_t);
+    fm->fd = fd;
+    fm->map = (char *) map;
+    fm->len = (size_t) st.st_size;
+    fm->pos = (size_t) pos;
+    return fm;
+#else
+    return NULL;
+#endif
+}
+
+
+/**
+ * Map the whole of a regular file into memory, so that it can be read
+ * without copying it through a buffer.
+ *
+ * \return NULL if ::rs_map_input is not set, \p f is not a regular
+ * file, it is empty or too big, or it can't be mapped; the caller should
+ * then read it through stdio.
+ */
+rs_filemap_t *rs_filemap_new(FILE *f)
+{
+    rs_filemap_t        *fm;
+
+    if ((fm = rs_filemap_map(fileno(f), ftell(f))))
+        fm->f = f;
+    return fm;
+}
+
+
+/**
+ * Like rs_filemap_new(), but for a file descriptor.
+ */
+rs_filemap_t *rs_filemap_new_fd(int fd)
+{
+#ifdef HAVE_UNISTD_H
+    return rs_filemap_map(fd, lseek(fd, 0, SEEK_CUR));
+#else
+    return NULL;
+#endif
+}
+
+
+/**
+ * Unmap the file.  If it was a job's input, leave its file position at
+ * the end as if it had been read through; the position of a basis is
+ * not changed, so that its descriptor can be shared.
+ */
+void rs_filemap_free(rs_filemap_t *fm)
+{
+#ifdef RS_USE_MMAP
+    munmap(fm->map, fm->len);
+#endif
+    if (fm->input) {
+        if (fm->f)
+            fseek(fm->f, 0, SEEK_END);
+#ifdef HAVE_UNISTD_H
+        else
+            lseek(fm->fd, 0, SEEK_END);
+#endif
+    }
+    free(fm);
+}
+
+
+/**
+ * Give the job all of the mapped file from where the file position was
+ * as its input, in one go.
+ */
+rs_result rs_inmapbuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
+{
+    rs_filemap_t        *fm = (rs_filemap_t *) opaque;
+
+    if (buf->eof_in)
+        return RS_DONE;
+
+    buf->next_in = fm->map + fm->pos;
+    buf->avail_in = fm->len - fm->pos;
+    buf->eof_in = 1;
+    fm->input = 1;
+
+    job->stats.in_bytes += buf->avail_in;
+
+    return RS_DONE;
+}
+
+
+/**
+ * Copy callback reading the basis from a mapped file: it just points
+ * at the data in the map.
+ */
+rs_result rs_filemap_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
+{
+    rs_filemap_t        *fm = (rs_filemap_t *) arg;
+
+    if (pos < 0 || (rs_long_t) fm->len <= pos) {
+        rs_error("unexpected eof on fd%d", fm->fd);
+        return RS_INPUT_ENDED;
+    }
+    if (*len > fm->len - (size_t) pos)
+        *len = fm->len - (size_t) pos;
+    *buf = fm->map + pos;
+    return RS_DONE;
+}
+
+
+#ifdef HAVE_UNISTD_H
+
+rs_filebuf_t *rs_fdbuf_new(int fd, size_t buf_len)
+{
+    rs_filebuf_t *pf = rs_filebuf_new(NULL, buf_len);
+
+    pf->fd = fd;
+
+    return pf;
+}
+
+
+/*
+ * Like rs_infilebuf_fill(), but with read() from a file descriptor.
+ */
+rs_result rs_infdbuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
+{
+    ssize_t             len;
+    rs_filebuf_t        *fb = (rs_filebuf_t *) opaque;
+
+    if (buf->eof_in || buf->avail_in)
+        return RS_DONE;
+
+    do {
+        len = read(fb->fd, fb->buf, fb->buf_len);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) {
+        rs_error("error filling buf from fd%d: %s", fb->fd, strerror(errno));
+        return RS_IO_ERROR;
+    } else if (len == 0) {
+        rs_trace("seen end of file on input");
+        buf->eof_in = 1;
+        return RS_DONE;
+    }
+    buf->avail_in = len;
+    buf->next_in = fb->buf;
+
+    job->stats.in_bytes += len;
+
+    return RS_DONE;
+}
+
+
+/*
+ * Like rs_outfilebuf_drain(), but with write() to a file descriptor.
+ */
+rs_result rs_outfdbuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
+{
+    rs_filebuf_t        *fb = (rs_filebuf_t *) opaque;
+    char                *p = fb->buf;
+    ssize_t             len;
+
+    if (buf->next_out == NULL) {
+        assert(buf->avail_out == 0);
+        buf->next_out = fb->buf;
+        buf->avail_out = fb->buf_len;
+        return RS_DONE;
+    }
+
+    assert(buf->next_out >= fb->buf);
+    assert(buf->next_out <= fb->buf + fb->buf_len);
+
+    while (p < buf->next_out) {
+        len = write(fb->fd, p, buf->next_out - p);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            rs_error("error draining buf to fd%d: %s", fb->fd,
+                     strerror(errno));
+            return RS_IO_ERROR;
+        }
+        p += len;
+        job->stats.out_bytes += len;
+    }
+    buf->next_out = fb->buf;
+    buf->avail_out = fb->buf_len;
+
+    return RS_DONE;
+}
+
+
+/**
+ * Write out what is in the output buffer, then have the kernel copy
+ * \p *len bytes at \p pos in \p in_fd straight after it in the output
+ * file, without passing through the buffer.  On filesystems that can
+ * share extents between files this doesn't copy the data at all.
+ *
+ * On return \p *len is how much was copied, which is less if \p in_fd
+ * ended first.
+ *
+ * \return RS_UNIMPLEMENTED if the kernel can't copy between these files,
+ * and the rest should be copied through the buffer as usual.
+ */
+rs_result rs_outfdbuf_copy_fd(rs_job_t *job, rs_buffers_t *buf, void *opaque,
+                              int in_fd, rs_long_t pos, rs_long_t *len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    rs_filebuf_t        *fb = (rs_filebuf_t *) opaque;
+    loff_t              off = pos;
+    rs_long_t           done = 0;
+    ssize_t             got;
+    rs_result           result;
+
+    if ((result = rs_outfdbuf_drain(job, buf, fb)) != RS_DONE)
+        return result;
+
+    while (done < *len) {
+        got = copy_file_range(in_fd, &off, fb->fd, NULL, *len - done, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0) {
+            *len = done;
+            if (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                || errno == EBADF || errno == EOPNOTSUPP) {
+                rs_trace("can't copy from fd%d to fd%d in the kernel: %s",
+                         in_fd, fb->fd, strerror(errno));
+                return RS_UNIMPLEMENTED;
+            }
+            rs_error("error copying from fd%d to fd%d: %s", in_fd, fb->fd,
+                     strerror(errno));
+            return RS_IO_ERROR;
+        }
+        if (got == 0)
+            break;
+        done += got;
+        job->stats.out_bytes += got;
+    }
+    *len = done;
+    return RS_DONE;
+#else
+    *len = 0;
+    return RS_UNIMPLEMENTED;
+#endif
+}
+
+
+/**
+ * ::rs_copy_cb that reads from a file descriptor with pread(), so it
+ * doesn't move the file position and one descriptor can be shared by
+ * several jobs.  \p arg points to an int holding the descriptor.
+ */
+rs_result rs_fd_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
+{
+    int         fd = *(int *) arg;
+    ssize_t     got;
+
+    do {
+#ifdef HAVE_PREAD
+        got = pread(fd, *buf, *len, pos);
+#else
+        if (lseek(fd, pos, SEEK_SET) < 0) {
+            rs_error("seek failed on fd%d: %s", fd, strerror(errno));
+            return RS_IO_ERROR;
+        }
+        got = read(fd, *buf, *len);
+#endif
+    } while (got < 0 && errno == EINTR);
+    if (got < 0) {
+        rs_error("read error on fd%d: %s", fd, strerror(errno));
+        return RS_IO_ERROR;
+    } else if (got == 0) {
+        rs_error("unexpected eof on fd%d", fd);
+        return RS_INPUT_ENDED;
+    }
+    *len = got;
+    return RS_DONE;
+}
+
+
+rs_result rs_fd_copy_batch_cb(void *arg, rs_copy_extent_t *extents, int count)
+{
+    rs_result   result;
+    size_t      got, len;
+    void        *p;
+    int         i;
+
+    for (i = 0; i < count; i++)
+        if (!extents[i].done)
+            rs_fd_prefetch_cb(arg, extents[i].pos, extents[i].len);
+    for (i = 0; i < count; i++) {
+        if (extents[i].done)
+            continue;
+        for (got = 0; got < extents[i].len; got += len) {
+            len = extents[i].len - got;
+            p = (rs_byte_t *) extents[i].buf + got;
+            result = rs_fd_copy_cb(arg, extents[i].pos + got, &len, &p);
+            if (result != RS_DONE)
+                return result;
+        }
+        extents[i].done = 1;
+    }
+    return RS_DONE;
+}
+
+#else /* HAVE_UNISTD_H */
+
+rs_result rs_fd_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
+{
+    rs_error("built without file descriptor IO");
+    return RS_UNIMPLEMENTED;
+}
+
+rs_result rs_fd_copy_batch_cb(void *arg, rs_copy_extent_t *extents, int count)
+{
+    rs_error("built without file descriptor IO");
+    return RS_UNIMPLEMENTED;
+}
+
+#endif /* HAVE_UNISTD_H */
+
+
+void rs_fd_prefetch_cb(void *arg, rs_long_t pos, rs_long_t len)
+{
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise(*(int *) arg, pos, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+
+/**
+ * ::rs_prefetch_cb for a mapped basis file, to have the pages read in.
+ */
+void rs_filemap_prefetch_cb(void *arg, rs_long_t pos, rs_long_t len)
+{
+#if defined RS_USE_MMAP && defined HAVE_MADVISE
+    rs_filemap_t        *fm = (rs_filemap_t *) arg;
+    static long         page;
+    rs_long_t           start;
+
+    if (!page && (page = sysconf(_SC_PAGESIZE)) <= 0)
+        page = 4096;
+    if (pos >= (rs_long_t) fm->len)
+        return;
+    if (len > (rs_long_t) fm->len - pos)
+        len = fm->len - pos;
+    start = pos - pos % page;
+    madvise(fm->map + start, (size_t) (pos + len - start), MADV_WILLNEED);
+#endif
+}
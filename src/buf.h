@@ -28,3 +28,26 @@ void rs_filebuf_free(rs_filebuf_t *fb);
 rs_result rs_infilebuf_fill(rs_job_t *, rs_buffers_t *buf, void *fb);
 
 rs_result rs_outfilebuf_drain(rs_job_t *, rs_buffers_t *, void *fb);
+
+rs_filebuf_t *rs_fdbuf_new(int fd, size_t buf_len);
+
+rs_result rs_infdbuf_fill(rs_job_t *, rs_buffers_t *buf, void *fb);
+
+rs_result rs_outfdbuf_drain(rs_job_t *, rs_buffers_t *, void *fb);
+
+rs_result rs_outfdbuf_copy_fd(rs_job_t *, rs_buffers_t *, void *fb,
+                              int in_fd, rs_long_t pos, rs_long_t *len);
+
+typedef struct rs_filemap rs_filemap_t;
+
+rs_filemap_t *rs_filemap_new(FILE *f);
+
+rs_filemap_t *rs_filemap_new_fd(int fd);
+
+void rs_filemap_free(rs_filemap_t *fm);
+
+rs_result rs_inmapbuf_fill(rs_job_t *, rs_buffers_t *buf, void *fm);
+
+rs_result rs_filemap_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf);
+
+void rs_filemap_prefetch_cb(void *arg, rs_long_t pos, rs_long_t len);
@@ -29,7 +29,10 @@
 
 #include "librsync.h"
 #include "checksum.h"
+#include "rollsum.h"
+#include "mdfour.h"
 #include "blake2.h"
+#include "blake2-impl.h"
 
 
 /* This can possibly be used to restart the checksum system in the
@@ -39,26 +42,19 @@ int checksum_seed = 0;
 
 /*
  * A simple 32 bit checksum that can be updated from either end
- * (inspired by Mark Adler's Adler-32 checksum)
+ * (inspired by Mark Adler's Adler-32 checksum).
+ *
+ * This is the same sum that rollsum.c maintains while rolling, so use
+ * its RollsumUpdate(), which picks a vectorized implementation when
+ * the CPU has one.
  */
 unsigned int rs_calc_weak_sum(void const *p, int len)
 {
-        int i;
-        unsigned        s1, s2;
-        unsigned char const    *buf = (unsigned char const *) p;
-
-        s1 = s2 = 0;
-        for (i = 0; i < (len - 4); i += 4) {
-                s2 += 4 * (s1 + buf[i]) + 3 * buf[i + 1] +
-                        2 * buf[i + 2] + buf[i + 3] + 10 * RS_CHAR_OFFSET;
-                s1 += (buf[i + 0] + buf[i + 1] + buf[i + 2] + buf[i + 3] +
-                       4 * RS_CHAR_OFFSET);
-        }
-        for (; i < len; i++) {
-                s1 += (buf[i] + RS_CHAR_OFFSET);
-                s2 += s1;
-        }
-        return (s1 & 0xffff) + (s2 << 16);
+        Rollsum sum;
+
+        RollsumInit(&sum);
+        RollsumUpdate(&sum, (unsigned char const *) p, len);
+        return RollsumDigest(&sum);
 }
 
 
@@ -87,3 +83,87 @@ void rs_calc_blake2_sum(void const *buf, size_t len, rs_strong_sum_t *sum)
     blake2b_update(&ctx, (const uint8_t *)buf, len);
     blake2b_final(&ctx, (uint8_t *)sum, RS_MAX_STRONG_SUM_LENGTH);
 }
+
+
+/*
+ * Calculate the strong sums of N consecutive blocks of BLOCK_LEN bytes
+ * starting at BUF.  These give the same sums as calling rs_calc_md4_sum()
+ * or rs_calc_blake2_sum() on each block, but where the CPU allows they
+ * hash several blocks at once, one in each SIMD lane.
+ */
+void rs_calc_md4_sums(void const *buf, size_t block_len, int n,
+                      rs_strong_sum_t *sums)
+{
+    unsigned char const *p = (unsigned char const *) buf;
+    int i = 0;
+
+#ifdef HAVE_X86_SIMD
+    void const *in[RS_MAX_SUM_LANES];
+    unsigned char *out[RS_MAX_SUM_LANES];
+    int j;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        for (; n - i >= 8; i += 8) {
+            for (j = 0; j < 8; j++) {
+                in[j] = p + (i + j) * block_len;
+                out[j] = sums[i + j];
+            }
+            rs_mdfour_x8_avx2(out, in, block_len);
+        }
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        for (; n - i >= 4; i += 4) {
+            for (j = 0; j < 4; j++) {
+                in[j] = p + (i + j) * block_len;
+                out[j] = sums[i + j];
+            }
+            rs_mdfour_x4_sse2(out, in, block_len);
+        }
+    }
+#endif
+    for (; i < n; i++)
+        rs_calc_md4_sum(p + i * block_len, block_len, &sums[i]);
+}
+
+void rs_calc_blake2_sums(void const *buf, size_t block_len, int n,
+                         rs_strong_sum_t *sums)
+{
+    unsigned char const *p = (unsigned char const *) buf;
+    int i = 0;
+
+#ifdef HAVE_X86_SIMD
+    void const *in[4];
+    uint8_t *out[4];
+    int j;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        for (; n - i >= 4; i += 4) {
+            for (j = 0; j < 4; j++) {
+                in[j] = p + (i + j) * block_len;
+                out[j] = sums[i + j];
+            }
+            blake2b_x4_avx2(out, in, RS_MAX_STRONG_SUM_LENGTH, block_len);
+        }
+    }
+#endif
+    for (; i < n; i++)
+        rs_calc_blake2_sum(p + i * block_len, block_len, &sums[i]);
+}
+
+
+/*
+ * The checksum kernels are picked for this CPU the first time they are
+ * used.  Threaded jobs call this before starting their workers, so that
+ * the workers don't race to do it.
+ */
+void rs_pick_sum_kernels(void)
+{
+    unsigned char buf[RS_MAX_SUM_LANES + 1] = { 0 };
+    rs_strong_sum_t sums[RS_MAX_SUM_LANES + 1];
+
+    rs_calc_weak_sum(buf, sizeof buf);
+    rs_calc_md4_sums(buf, 1, RS_MAX_SUM_LANES + 1, sums);
+    rs_calc_blake2_sums(buf, 1, RS_MAX_SUM_LANES + 1, sums);
+}
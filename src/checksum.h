@@ -19,12 +19,23 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
 rs_weak_sum_t rs_calc_weak_sum(void const *buf1, int len);
 
 void rs_calc_md4_sum(void const *buf, size_t buf_len, rs_strong_sum_t *);
 void rs_calc_blake2_sum(void const *buf, size_t buf_len, rs_strong_sum_t *);
 
-/* We should make this something other than zero to improve the
- * checksum algorithm: tridge suggests a prime number. */
-#define RS_CHAR_OFFSET 31
+/* Most blocks that rs_calc_md4_sums() and rs_calc_blake2_sums() hash side
+ * by side. */
+#define RS_MAX_SUM_LANES 8
+
+void rs_calc_md4_sums(void const *buf, size_t block_len, int n,
+                      rs_strong_sum_t *sums);
+void rs_calc_blake2_sums(void const *buf, size_t block_len, int n,
+                         rs_strong_sum_t *sums);
+
+void rs_pick_sum_kernels(void);
 
+#endif /* _CHECKSUM_H_ */
@@ -0,0 +1,170 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+/**
+ * \file cmdscan.c Scan the commands of a delta file.
+ *
+ * Some ways of applying a delta need to know what is in all of it
+ * before they start: in-place patching needs what the COPY commands
+ * read, and threaded patching needs where each command's output goes.
+ * This reads just the commands from a file descriptor, with a small
+ * buffer, and leaves the caller to seek over any literal data.
+ *
+ * It doesn't check the commands make sense; the callers fall back to or
+ * go on to a patch job, which does.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+
+#include "librsync.h"
+#include "util.h"
+#include "command.h"
+#include "prototab.h"
+#include "cmdscan.h"
+
+#ifdef HAVE_UNISTD_H
+
+struct rs_cmdscan {
+    int                 fd;
+    rs_long_t           pos;            /* file offset of buf[next] */
+    rs_byte_t           buf[4096];
+    size_t              next, end;
+    int                 failed;
+};
+
+
+rs_cmdscan_t *rs_cmdscan_new(int fd)
+{
+    rs_cmdscan_t        *sc = rs_alloc_struct(rs_cmdscan_t);
+
+    sc->fd = fd;
+    if ((sc->pos = lseek(fd, 0, SEEK_CUR)) < 0)
+        sc->failed = 1;
+    return sc;
+}
+
+
+void rs_cmdscan_free(rs_cmdscan_t *sc)
+{
+    free(sc);
+}
+
+
+/* The next byte, or -1 at the end of the file or on an error. */
+static int rs_cmdscan_getc(rs_cmdscan_t *sc)
+{
+    ssize_t             n;
+
+    if (sc->failed)
+        return -1;
+    if (sc->next == sc->end) {
+        do
+            n = read(sc->fd, sc->buf, sizeof sc->buf);
+        while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            sc->failed = n < 0;
+            return -1;
+        }
+        sc->next = 0;
+        sc->end = n;
+    }
+    sc->pos++;
+    return sc->buf[sc->next++];
+}
+
+
+/** Read the magic number at the start of the delta; returns 0 if it's
+ * not all there. */
+int rs_cmdscan_magic(rs_cmdscan_t *sc, int *magic)
+{
+    int                 i, c;
+
+    for (*magic = 0, i = 0; i < 4; i++) {
+        if ((c = rs_cmdscan_getc(sc)) < 0)
+            return 0;
+        *magic = *magic << 8 | c;
+    }
+    return 1;
+}
+
+
+/**
+ * Read the next command and its parameters.  Returns 0 at the end of the
+ * file, or if it ends part way through the command.  The data of a
+ * LITERAL command is next, and should be skipped with rs_cmdscan_skip().
+ */
+int rs_cmdscan_next(rs_cmdscan_t *sc, rs_prototab_ent_t const **cmd,
+                    rs_long_t param[2])
+{
+    int                 c, i, j, len;
+
+    if ((c = rs_cmdscan_getc(sc)) < 0)
+        return 0;
+    *cmd = &rs_prototab[c];
+    param[0] = (*cmd)->immediate;
+    param[1] = 0;
+    for (i = 0; i < 2; i++) {
+        if (!(len = i ? (*cmd)->len_2 : (*cmd)->len_1))
+            continue;
+        for (param[i] = 0, j = 0; j < len; j++) {
+            if ((c = rs_cmdscan_getc(sc)) < 0)
+                return 0;
+            param[i] = param[i] << 8 | c;
+        }
+    }
+    return 1;
+}
+
+
+/** The file offset of the next byte of the delta. */
+rs_long_t rs_cmdscan_tell(rs_cmdscan_t *sc)
+{
+    return sc->pos;
+}
+
+
+void rs_cmdscan_skip(rs_cmdscan_t *sc, rs_long_t len)
+{
+    sc->pos += len;
+    if (len <= (rs_long_t) (sc->end - sc->next)) {
+        sc->next += len;
+        return;
+    }
+    len -= sc->end - sc->next;
+    sc->next = sc->end;
+    if (lseek(sc->fd, len, SEEK_CUR) < 0)
+        sc->failed = 1;
+}
+
+
+/** Whether reading or seeking the delta failed, rather than it ending. */
+int rs_cmdscan_failed(rs_cmdscan_t *sc)
+{
+    return sc->failed;
+}
+
+#endif /* HAVE_UNISTD_H */
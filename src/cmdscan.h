@@ -0,0 +1,38 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _CMDSCAN_H_
+#define _CMDSCAN_H_
+
+/** \private
+ * Reads the commands of a delta file from a descriptor, seeking over
+ * literal data rather than reading it.
+ */
+typedef struct rs_cmdscan rs_cmdscan_t;
+
+rs_cmdscan_t *rs_cmdscan_new(int fd);
+void rs_cmdscan_free(rs_cmdscan_t *sc);
+int rs_cmdscan_magic(rs_cmdscan_t *sc, int *magic);
+int rs_cmdscan_next(rs_cmdscan_t *sc, struct rs_prototab_ent const **cmd,
+                    rs_long_t param[2]);
+rs_long_t rs_cmdscan_tell(rs_cmdscan_t *sc);
+void rs_cmdscan_skip(rs_cmdscan_t *sc, rs_long_t len);
+int rs_cmdscan_failed(rs_cmdscan_t *sc);
+
+#endif /* _CMDSCAN_H_ */
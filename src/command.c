@@ -36,6 +36,8 @@ struct rs_op_kind_name const rs_op_kind_names[] = {
     {"LITERAL",   RS_KIND_LITERAL },
     {"SIGNATURE", RS_KIND_SIGNATURE },
     {"CHECKSUM",  RS_KIND_CHECKSUM },
+    {"WINDOW",    RS_KIND_WINDOW },
+    {"SELFCOPY",  RS_KIND_SELFCOPY },
     {"INVALID",   RS_KIND_INVALID },
     {NULL,        0 }
 };
@@ -39,6 +39,8 @@ enum rs_op_kind {
     RS_KIND_SIGNATURE,
     RS_KIND_COPY,
     RS_KIND_CHECKSUM,
+    RS_KIND_WINDOW,             /* how much output SELFCOPY can reach */
+    RS_KIND_SELFCOPY,           /* copy from the output so far */
     RS_KIND_RESERVED,           /* for future expansion */
 
     /* This one should never occur in file streams.  It's an
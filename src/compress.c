@@ -0,0 +1,401 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+/**
+ * \file compress.c Compression of literal data in deltas.
+ *
+ * In a compressed delta, the data of each LITERAL command is compressed,
+ * and its length is the compressed length.  The compressed data of each
+ * command ends on a flush, so that the patch can write out all of its data
+ * before it reads the next command.
+ *
+ * zlib deltas use raw deflate, flushed with Z_SYNC_FLUSH.  In primed zlib
+ * deltas, the data that each COPY command stands for is also put into the
+ * deflate history, without being sent, before the next literal is
+ * compressed: the patch has the same data in hand once it has done the
+ * COPY, so it can do the same to its inflate history.  Literal data next
+ * to matched data then compresses against it.  Only the last 32kB of the
+ * copied data can be reached, so that is all that is kept.  bzip2 can't
+ * flush to a byte boundary in the middle of a stream, so in bzip2 deltas
+ * the data of each command is a whole bzip2 stream of its own, which costs
+ * rather more for each command.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+#ifdef HAVE_BZLIB_H
+#include <bzlib.h>
+#endif
+
+#include "librsync.h"
+#include "trace.h"
+#include "util.h"
+#include "compress.h"
+
+struct rs_compress {
+    rs_magic_number     format;
+    int                 decompress;
+    int                 level;
+#ifdef HAVE_ZLIB_H
+    z_stream            z;
+#endif
+#ifdef HAVE_BZLIB_H
+    bz_stream           bz;
+#endif
+    rs_byte_t           *buf;           /* compressed output */
+    size_t              buf_size;
+    rs_byte_t           *hist;          /* copied data for primed zlib */
+    size_t              hist_len;
+};
+
+/* How much copied data is kept for the zlib history: the deflate window,
+ * with as much again as room to append to it. */
+#define RS_HIST_WINDOW  (1 << 15)
+#define RS_HIST_SIZE    (2 * RS_HIST_WINDOW)
+
+
+#ifdef HAVE_BZLIB_H
+/* Start a new bzip2 stream. */
+static int rs_bzip2_init(rs_compress_t *c)
+{
+    int ret;
+
+    memset(&c->bz, 0, sizeof c->bz);
+    if (c->decompress)
+        ret = BZ2_bzDecompressInit(&c->bz, 0, 0);
+    else
+        ret = BZ2_bzCompressInit(&c->bz, c->level, 0, 0);
+    if (ret != BZ_OK)
+        rs_error("couldn't start bzip2: %d", ret);
+    return ret;
+}
+
+
+static void rs_bzip2_end(rs_compress_t *c)
+{
+    if (c->decompress)
+        BZ2_bzDecompressEnd(&c->bz);
+    else
+        BZ2_bzCompressEnd(&c->bz);
+}
+#endif
+
+
+/**
+ * Start compressing, or if \p decompress is set decompressing, literal
+ * data in the delta format \p format, which is one of the compressed
+ * delta magic numbers.
+ *
+ * \p level is the zlib compression level, or the bzip2 block size in
+ * 100kB; 0 or anything out of range means the default.
+ *
+ * \return RS_UNIMPLEMENTED if the library was built without the
+ * compression that \p format asks for.
+ */
+rs_result rs_compress_new(rs_magic_number format, int level, int decompress,
+                          rs_compress_t **compress)
+{
+    rs_compress_t *c = rs_alloc_struct(rs_compress_t);
+#ifdef HAVE_ZLIB_H
+    int ret;
+#endif
+
+    c->format = format;
+    c->decompress = decompress;
+
+    switch (format) {
+#ifdef HAVE_ZLIB_H
+    case RS_DELTA_ZLIB_PRIMED_MAGIC:
+    case RS_DELTA_ZLIB_MAGIC:
+        if (level < 1 || level > 9)
+            level = Z_DEFAULT_COMPRESSION;
+        if (decompress)
+            ret = inflateInit2(&c->z, -MAX_WBITS);
+        else
+            ret = deflateInit2(&c->z, level, Z_DEFLATED, -MAX_WBITS, 8,
+                               Z_DEFAULT_STRATEGY);
+        if (ret != Z_OK) {
+            rs_error("couldn't start zlib: %d", ret);
+            free(c);
+            return RS_MEM_ERROR;
+        }
+        if (format == RS_DELTA_ZLIB_PRIMED_MAGIC)
+            c->hist = rs_alloc(RS_HIST_SIZE, "compression history");
+        break;
+#endif
+#ifdef HAVE_BZLIB_H
+    case RS_DELTA_BZIP2_MAGIC:
+        if (level < 1 || level > 9)
+            level = 9;
+        c->level = level;
+        if (rs_bzip2_init(c) != BZ_OK) {
+            free(c);
+            return RS_MEM_ERROR;
+        }
+        break;
+#endif
+    default:
+        rs_error("delta format %#x is not supported by this build",
+                 (unsigned) format);
+        free(c);
+        return RS_UNIMPLEMENTED;
+    }
+
+    *compress = c;
+    return RS_DONE;
+}
+
+
+void rs_compress_free(rs_compress_t *c)
+{
+    switch (c->format) {
+#ifdef HAVE_ZLIB_H
+    case RS_DELTA_ZLIB_MAGIC:
+    case RS_DELTA_ZLIB_PRIMED_MAGIC:
+        if (c->decompress)
+            inflateEnd(&c->z);
+        else
+            deflateEnd(&c->z);
+        break;
+#endif
+#ifdef HAVE_BZLIB_H
+    case RS_DELTA_BZIP2_MAGIC:
+        rs_bzip2_end(c);
+        break;
+#endif
+    default:
+        break;
+    }
+    free(c->buf);
+    free(c->hist);
+    free(c);
+}
+
+
+/**
+ * Note that \p len bytes of data at \p buf were sent by a COPY command.
+ * Unless the format is primed with copied data, this does nothing.
+ */
+void rs_compress_history(rs_compress_t *c, void const *buf, size_t len)
+{
+    size_t keep;
+
+    if (!c->hist)
+        return;
+    if (len >= RS_HIST_WINDOW) {
+        buf = (rs_byte_t const *) buf + len - RS_HIST_WINDOW;
+        len = RS_HIST_WINDOW;
+    }
+    if (c->hist_len + len > RS_HIST_SIZE) {
+        keep = RS_HIST_WINDOW - len;
+        memmove(c->hist, c->hist + c->hist_len - keep, keep);
+        c->hist_len = keep;
+    }
+    memcpy(c->hist + c->hist_len, buf, len);
+    c->hist_len += len;
+}
+
+
+#ifdef HAVE_ZLIB_H
+/*
+ * Put the copied data noted since the last literal into the zlib history.
+ * Both sides do this at the start of a literal, after the flush that
+ * ended the last one.
+ */
+static rs_result rs_zlib_prime(rs_compress_t *c)
+{
+    int ret;
+
+    if (!c->hist_len)
+        return RS_DONE;
+    if (c->decompress)
+        ret = inflateSetDictionary(&c->z, c->hist, c->hist_len);
+    else
+        ret = deflateSetDictionary(&c->z, c->hist, c->hist_len);
+    c->hist_len = 0;
+    if (ret != Z_OK) {
+        rs_error("couldn't prime zlib with copied data: %d", ret);
+        return RS_INTERNAL_ERROR;
+    }
+    return RS_DONE;
+}
+#endif
+
+
+/*
+ * Make room for at least another \p len bytes after the first \p used of
+ * the output buffer.
+ */
+static void rs_compress_grow(rs_compress_t *c, size_t used, size_t len)
+{
+    size_t size = c->buf_size ? c->buf_size : 1024;
+
+    while (size - used < len)
+        size *= 2;
+    if (size != c->buf_size) {
+        c->buf = realloc(c->buf, size);
+        if (!c->buf)
+            rs_fatal("couldn't allocate compressed literal buffer");
+        c->buf_size = size;
+    }
+}
+
+
+/**
+ * Compress \p in_len bytes of literal data from \p in, and flush them.
+ *
+ * \p *out is set to the compressed data, which stays there until the
+ * next call.
+ */
+rs_result rs_compress_literal(rs_compress_t *c, void const *in, size_t in_len,
+                              rs_byte_t const **out, size_t *out_len)
+{
+    size_t used = 0;
+#if defined(HAVE_ZLIB_H) || defined(HAVE_BZLIB_H)
+    int ret;
+#endif
+
+    assert(!c->decompress);
+    rs_compress_grow(c, 0, in_len / 2 + 64);
+
+    switch (c->format) {
+#ifdef HAVE_ZLIB_H
+    case RS_DELTA_ZLIB_MAGIC:
+    case RS_DELTA_ZLIB_PRIMED_MAGIC:
+        if (rs_zlib_prime(c) != RS_DONE)
+            return RS_INTERNAL_ERROR;
+        c->z.next_in = (Bytef *) in;
+        c->z.avail_in = in_len;
+        do {
+            if (used == c->buf_size)
+                rs_compress_grow(c, used, c->buf_size);
+            c->z.next_out = c->buf + used;
+            c->z.avail_out = c->buf_size - used;
+            ret = deflate(&c->z, Z_SYNC_FLUSH);
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                rs_error("zlib compression failed: %d", ret);
+                return RS_INTERNAL_ERROR;
+            }
+            used = c->buf_size - c->z.avail_out;
+        } while (!c->z.avail_out);
+        break;
+#endif
+#ifdef HAVE_BZLIB_H
+    case RS_DELTA_BZIP2_MAGIC:
+        c->bz.next_in = (char *) in;
+        c->bz.avail_in = in_len;
+        do {
+            if (used == c->buf_size)
+                rs_compress_grow(c, used, c->buf_size);
+            c->bz.next_out = (char *) c->buf + used;
+            c->bz.avail_out = c->buf_size - used;
+            ret = BZ2_bzCompress(&c->bz, BZ_FINISH);
+            if (ret != BZ_FINISH_OK && ret != BZ_STREAM_END) {
+                rs_error("bzip2 compression failed: %d", ret);
+                return RS_INTERNAL_ERROR;
+            }
+            used = c->buf_size - c->bz.avail_out;
+        } while (ret != BZ_STREAM_END);
+        rs_bzip2_end(c);
+        if (rs_bzip2_init(c) != BZ_OK)
+            return RS_MEM_ERROR;
+        break;
+#endif
+    default:
+        return RS_UNIMPLEMENTED;
+    }
+
+    rs_trace("compressed %ld bytes of literal data to %ld",
+             (long) in_len, (long) used);
+    *out = c->buf;
+    *out_len = used;
+    return RS_DONE;
+}
+
+
+/**
+ * Decompress as much as possible of the \p *in_len bytes at \p in into
+ * the \p *out_len bytes of room at \p out.  Both lengths are updated to
+ * how much was used.
+ *
+ * Once all the compressed data of a command has gone in, all of its
+ * literal data has come out when there is room left over.
+ */
+rs_result rs_decompress_literal(rs_compress_t *c, void const *in,
+                                size_t *in_len, void *out, size_t *out_len)
+{
+#if defined(HAVE_ZLIB_H) || defined(HAVE_BZLIB_H)
+    int ret;
+#endif
+
+    assert(c->decompress);
+
+    switch (c->format) {
+#ifdef HAVE_ZLIB_H
+    case RS_DELTA_ZLIB_MAGIC:
+    case RS_DELTA_ZLIB_PRIMED_MAGIC:
+        if (rs_zlib_prime(c) != RS_DONE)
+            return RS_CORRUPT;
+        c->z.next_in = (Bytef *) in;
+        c->z.avail_in = *in_len;
+        c->z.next_out = out;
+        c->z.avail_out = *out_len;
+        ret = inflate(&c->z, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            rs_error("corrupt zlib literal data: %d", ret);
+            return RS_CORRUPT;
+        }
+        *in_len -= c->z.avail_in;
+        *out_len -= c->z.avail_out;
+        break;
+#endif
+#ifdef HAVE_BZLIB_H
+    case RS_DELTA_BZIP2_MAGIC:
+        c->bz.next_in = (char *) in;
+        c->bz.avail_in = *in_len;
+        c->bz.next_out = out;
+        c->bz.avail_out = *out_len;
+        ret = BZ2_bzDecompress(&c->bz);
+        if (ret != BZ_OK && ret != BZ_STREAM_END) {
+            rs_error("corrupt bzip2 literal data: %d", ret);
+            return RS_CORRUPT;
+        }
+        *in_len -= c->bz.avail_in;
+        *out_len -= c->bz.avail_out;
+        if (ret == BZ_STREAM_END) {
+            /* the next command starts a new stream */
+            rs_bzip2_end(c);
+            if (rs_bzip2_init(c) != BZ_OK)
+                return RS_MEM_ERROR;
+        }
+        break;
+#endif
+    default:
+        return RS_UNIMPLEMENTED;
+    }
+
+    return RS_DONE;
+}
@@ -0,0 +1,40 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+/** \private
+ * Compression of the literal data in a delta, or its decompression while
+ * patching.
+ */
+typedef struct rs_compress rs_compress_t;
+
+rs_result rs_compress_new(rs_magic_number format, int level, int decompress,
+                          rs_compress_t **compress);
+void rs_compress_free(rs_compress_t *compress);
+void rs_compress_history(rs_compress_t *compress, void const *buf, size_t len);
+rs_result rs_compress_literal(rs_compress_t *compress,
+                              void const *in, size_t in_len,
+                              rs_byte_t const **out, size_t *out_len);
+rs_result rs_decompress_literal(rs_compress_t *compress,
+                                void const *in, size_t *in_len,
+                                void *out, size_t *out_len);
+
+#endif /* _COMPRESS_H_ */
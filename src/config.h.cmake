@@ -24,6 +24,9 @@
 /* Define to 1 if you have the <bzlib.h> header file.  */
 #cmakedefine HAVE_BZLIB_H 1
 
+/* Define to 1 if you have the `copy_file_range' function. */
+#cmakedefine HAVE_COPY_FILE_RANGE 1
+
 /* Define to 1 if you have the <dlfcn.h> header file. */
 #cmakedefine HAVE_DLFCN_H 1
 
@@ -48,6 +51,9 @@
 /* Define to 1 if you have the `z' library (-lz). */
 #cmakedefine HAVE_LIBZ ${ZLIB_FOUND}
 
+/* Define to 1 if you have the `madvise' function. */
+#cmakedefine HAVE_MADVISE 1
+
 /* Define to 1 if you have the <malloc.h> header file. */
 #cmakedefine HAVE_MALLOC_H 1
 
@@ -57,15 +63,27 @@
 /* Define to 1 if you have the `memmove' function. */
 #cmakedefine HAVE_MEMMOVE 1
 
+/* Define to 1 if you have the `mmap' function. */
+#cmakedefine HAVE_MMAP 1
+
 /* Define to 1 if you have the <memory.h> header file. */
 #cmakedefine HAVE_MEMORY_H 1
 
 /* Define to 1 if you have the `memset' function. */
 #cmakedefine HAVE_MEMSET 1
 
+/* Define to 1 if you have the `posix_fadvise' function. */
+#cmakedefine HAVE_POSIX_FADVISE 1
+
+/* Define to 1 if you have the `pread' function. */
+#cmakedefine HAVE_PREAD 1
+
 /* GNU extension of saving argv[0] to program_invocation_short_name */
 #cmakedefine HAVE_PROGRAM_INVOCATION_NAME
 
+/* Define to 1 if POSIX threads are available. */
+#cmakedefine HAVE_PTHREAD 1
+
 /* Define to 1 if you have the `snprintf' function. */
 #cmakedefine HAVE_SNPRINTF 1
 
@@ -90,6 +108,9 @@
 /* Define to 1 if you have the <sys/file.h> header file. */
 #cmakedefine HAVE_SYS_FILE_H 1
 
+/* Define to 1 if you have the <sys/mman.h> header file. */
+#cmakedefine HAVE_SYS_MMAN_H 1
+
 /* Define to 1 if you have the <sys/stat.h> header file. */
 #cmakedefine HAVE_SYS_STAT_H 1
 
@@ -108,6 +129,10 @@
 /* Define to 1 if you have the <zlib.h> header file. */
 #cmakedefine HAVE_ZLIB_H 1
 
+/* Define to 1 if the compiler can build SSE2/SSSE3/AVX2 code selected at
+   runtime with `__builtin_cpu_supports'. */
+#cmakedefine HAVE_X86_SIMD 1
+
 /* Define to 1 if you have the `_snprintf' function. */
 #cmakedefine HAVE__SNPRINTF 1
 
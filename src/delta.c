@@ -67,6 +67,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "librsync.h"
 #include "emit.h"
@@ -78,6 +79,9 @@
 #include "search.h"
 #include "types.h"
 #include "rollsum.h"
+#include "checksum.h"
+#include "workers.h"
+#include "compress.h"
 
 const int RS_MD4_SUM_LENGTH = 16;
 const int RS_BLAKE2_SUM_LENGTH = 32;
@@ -122,16 +126,48 @@ const int RS_BLAKE2_SUM_LENGTH = 32;
 /* used by rdiff, but now redundant */
 int rs_roll_paranoia = 0;
 
+/* What rs_findmatch() found. */
+#define RS_MATCH_BASIS  1
+#define RS_MATCH_SELF   2
+
+/**
+ * State of a delta that may copy from its own output.
+ *
+ * The new file is indexed block by block as it leaves the scoop, at the
+ * block size of the signature, into a signature of its own.  A block of
+ * the new file found in there rather than in the basis is sent as a
+ * SELFCOPY, which the patch does from the output it has already written.
+ * A SELFCOPY reaches back at most the window, which the patch keeps in
+ * memory.
+ * \private
+ */
+struct rs_delta_self {
+    rs_signature_t      *sig;           /* blocks of the new file so far */
+    rs_long_t           window;
+    rs_long_t           pos;            /* offset of scoop_next */
+    rs_long_t           indexed;        /* offset indexed up to */
+    rs_byte_t           *block;         /* start of the next block */
+    size_t              block_fill;
+    int                 matching;       /* the last match is a SELFCOPY */
+};
+
 static rs_result rs_delta_s_scan(rs_job_t *job);
 static rs_result rs_delta_s_flush(rs_job_t *job);
 static rs_result rs_delta_s_end(rs_job_t *job);
-void rs_getinput(rs_job_t *job);
+static rs_result rs_getinput(rs_job_t *job);
 static inline int rs_findmatch(rs_job_t *job, rs_long_t *match_pos, size_t *match_len);
-static inline rs_result rs_appendmatch(rs_job_t *job, rs_long_t match_pos, size_t match_len);
+static int rs_findselfmatch(rs_job_t *job, int hint, rs_long_t *match_pos,
+                            size_t match_len);
+static inline int rs_movematch(rs_job_t *job, rs_long_t match_pos);
+static size_t rs_extendmatch(rs_job_t *job);
+static size_t rs_extendback(rs_job_t *job, rs_long_t match_pos);
+static inline rs_result rs_appendmatch(rs_job_t *job, int self, rs_long_t match_pos, size_t match_len);
 static inline rs_result rs_appendmiss(rs_job_t *job, size_t miss_len);
 static inline rs_result rs_appendflush(rs_job_t *job);
 static inline rs_result rs_processmatch(rs_job_t *job);
 static inline rs_result rs_processmiss(rs_job_t *job);
+static rs_result rs_emit_literal(rs_job_t *job, void const *buf, size_t len);
+static void rs_delta_self_index(rs_job_t *job, size_t upto);
 
 /**
  * \brief Get a block of data if possible, and see if it matches.
@@ -141,22 +177,29 @@ static inline rs_result rs_processmiss(rs_job_t *job);
 static rs_result rs_delta_s_scan(rs_job_t *job)
 {
     rs_long_t      match_pos;
-    size_t         match_len;
+    size_t         match_len, end;
+    int            found;
     rs_result      result;
     Rollsum        test;
 
     rs_job_check(job);
-    /* read the input into the scoop */
-    rs_getinput(job);
     /* output any pending output from the tube */
     result=rs_tube_catchup(job);
-    /* while output is not blocked and there is a block of data */
+    /* while output is not blocked and there is a block of data, getting
+     * more input when it runs out */
     while ((result==RS_DONE) &&
-           ((job->scoop_pos + job->block_len) < job->scoop_avail)) {
+           ((job->scoop_pos + job->block_len) < job->scoop_avail
+            || ((result=rs_getinput(job))==RS_DONE
+                && (job->scoop_pos + job->block_len) < job->scoop_avail))) {
         /* check if this block matches */
-        if (rs_findmatch(job,&match_pos,&match_len)) {
+        if ((found = rs_findmatch(job,&match_pos,&match_len))) {
             /* append the match and reset the weak_sum */
-            result=rs_appendmatch(job,match_pos,match_len);
+            result=rs_appendmatch(job,found==RS_MATCH_SELF,match_pos,match_len);
+            RollsumInit(&job->weak_sum);
+        } else if ((match_len = rs_extendmatch(job))) {
+            /* the last match carries on past its block, so extend it
+             * and start looking again after it */
+            result=rs_appendmatch(job,0,job->basis_pos+job->basis_len,match_len);
             RollsumInit(&job->weak_sum);
         } else {
             /* rotate the weak_sum and append the miss byte */
@@ -173,6 +216,17 @@ static rs_result rs_delta_s_scan(rs_job_t *job)
                              (int)RollsumDigest(&test));
                 }
                 
+            } else if (result==RS_DONE && !job->delta_self) {
+                /* go on through the rest of a run of misses without
+                 * searching, up to where rs_appendmiss() would flush or
+                 * the input runs out */
+                end = job->scoop_avail - job->block_len;
+                if (end > (size_t) rs_outbuflen)
+                    end = rs_outbuflen;
+                if (end > job->scoop_pos)
+                    job->scoop_pos += rs_search_miss_run(job->signature,
+                        &job->weak_sum, job->scoop_next + job->scoop_pos,
+                        job->block_len, end - job->scoop_pos);
             }
         }
     }
@@ -182,10 +236,14 @@ static rs_result rs_delta_s_scan(rs_job_t *job)
         if (job->stream->eof_in) {
             job->statefn=rs_delta_s_flush;
             return RS_RUNNING;
-        } else {
-            /* we are blocked waiting for more data */
-            return RS_BLOCKED;
         }
+        /* the input is only borrowed until we return, so send any miss
+         * now rather than keeping it all in the scoop */
+        if (job->scoop_borrowed && !job->basis_len && job->scoop_pos)
+            result=rs_processmiss(job);
+        /* we are blocked waiting for more data */
+        if (result==RS_DONE)
+            return RS_BLOCKED;
     }
     return result;
 }
@@ -195,19 +253,25 @@ static rs_result rs_delta_s_flush(rs_job_t *job)
 {
     rs_long_t      match_pos;
     size_t         match_len;
+    int            found;
     rs_result      result;
 
     rs_job_check(job);
-    /* read the input into the scoop */
-    rs_getinput(job);
+    /* read any remaining input into the scoop */
+    if (job->scoop_avail < rs_scoop_total_avail(job))
+        rs_scoop_input(job, rs_scoop_total_avail(job));
     /* output any pending output */
     result=rs_tube_catchup(job);
     /* while output is not blocked and there is any remaining data */
     while ((result==RS_DONE) && (job->scoop_pos < job->scoop_avail)) {
         /* check if this block matches */
-        if (rs_findmatch(job,&match_pos,&match_len)) {
+        if ((found = rs_findmatch(job,&match_pos,&match_len))) {
             /* append the match and reset the weak_sum */
-            result=rs_appendmatch(job,match_pos,match_len);
+            result=rs_appendmatch(job,found==RS_MATCH_SELF,match_pos,match_len);
+            RollsumInit(&job->weak_sum);
+        } else if ((match_len = rs_extendmatch(job))) {
+            /* the last match carries on past its block */
+            result=rs_appendmatch(job,0,job->basis_pos+job->basis_len,match_len);
             RollsumInit(&job->weak_sum);
         } else {
             /* rollout from weak_sum and append the miss byte */
@@ -235,13 +299,32 @@ static rs_result rs_delta_s_end(rs_job_t *job)
 }
 
 
-void rs_getinput(rs_job_t *job) {
-    size_t len;
-    
-    len=rs_scoop_total_avail(job);
-    if (job->scoop_avail < len) {
-        rs_scoop_input(job,len);
+/**
+ * Get more input for scanning, without copying it if possible.
+ *
+ * When the scoop is empty, the input buffer is scanned where it is.
+ * Otherwise just enough input is copied into the scoop to scan what is
+ * left there, and once that has been flushed out the scoop goes on in
+ * the input buffer from the same place. */
+static rs_result rs_getinput(rs_job_t *job)
+{
+    rs_result result;
+
+    if (!job->stream->avail_in)
+        return RS_DONE;
+    if (job->scoop_mirror && job->scoop_next < job->scoop_mirror
+        && job->scoop_next + job->scoop_pos >= job->scoop_mirror
+        && !job->basis_len) {
+        /* the miss runs into the copied input, so it has to go first */
+        if ((result=rs_processmiss(job)) != RS_DONE)
+            return result;
     }
+    if (!job->scoop_avail
+        || (job->scoop_mirror && job->scoop_next >= job->scoop_mirror))
+        rs_scoop_borrow(job);
+    else
+        rs_scoop_mirror(job, job->scoop_avail + job->block_len + 1);
+    return RS_DONE;
 }
 
         
@@ -250,12 +333,24 @@ void rs_getinput(rs_job_t *job) {
  * Note that this will calculate weak_sum if required. It will also
  * determine the match_len.
  *
- * Note that this routine could be modified to do xdelta style matches that
- * would extend matches past block boundaries by matching backwards and
- * forwards beyond the block boundaries. Extending backwards would require
- * decrementing scoop_pos as appropriate.
+ * Matches are only found here on whole blocks; if the job can read the
+ * basis, rs_extendmatch() and rs_extendback() extend them xdelta style
+ * past the block boundaries.
+ *
+ * Returns RS_MATCH_BASIS or RS_MATCH_SELF for a match in the basis or in
+ * the new file so far, or 0 if there is none.  The kind of match that
+ * would carry on from the last one is looked for first.
  */
 inline int rs_findmatch(rs_job_t *job, rs_long_t *match_pos, size_t *match_len) {
+    rs_long_t next_pos = job->basis_pos + job->basis_len;
+    int hint = -1;
+    int self = job->delta_self && job->delta_self->matching;
+
+    /* if the last data was a match, the basis block following it is
+     * the most likely one to match next */
+    if (job->basis_len && (next_pos % job->block_len) == 0) {
+        hint = next_pos / job->block_len;
+    }
     /* calculate the weak_sum if we don't have one */
     if (job->weak_sum.count == 0) {
         /* set match_len to min(block_len, scan_avail) */
@@ -270,31 +365,191 @@ inline int rs_findmatch(rs_job_t *job, rs_long_t *match_pos, size_t *match_len)
         /* set the match_len to the weak_sum count */
         *match_len=job->weak_sum.count;
     }
+    if (self && rs_findselfmatch(job, hint, match_pos, *match_len))
+        return RS_MATCH_SELF;
+    if (rs_search_for_block(RollsumDigest(&job->weak_sum),
+                            job->scoop_next+job->scoop_pos,
+                            *match_len,
+                            job->signature,
+                            &job->stats,
+                            self ? -1 : hint,
+                            match_pos))
+        return RS_MATCH_BASIS;
+    if (!self && job->delta_self
+        && rs_findselfmatch(job, -1, match_pos, *match_len))
+        return RS_MATCH_SELF;
+    return 0;
+}
+
+
+/**
+ * Look for the block at scoop_pos in the new file so far, within the
+ * window back from scoop_pos. */
+static int rs_findselfmatch(rs_job_t *job, int hint, rs_long_t *match_pos,
+                            size_t match_len)
+{
+    struct rs_delta_self *s = job->delta_self;
+
+    /* only whole blocks are indexed */
+    if (match_len != (size_t) job->block_len)
+        return 0;
+    rs_delta_self_index(job, job->scoop_pos);
+    if (!s->sig->count)
+        return 0;
     return rs_search_for_block(RollsumDigest(&job->weak_sum),
                                job->scoop_next+job->scoop_pos,
-                               *match_len,
-                               job->signature,
-                               &job->stats,
-                               match_pos);
+                               match_len, s->sig, &job->stats, hint,
+                               match_pos)
+        && s->pos + (rs_long_t) job->scoop_pos - *match_pos <= s->window;
+}
+
+
+/**
+ * Check if the previous match can be moved to an identical copy of it in
+ * the basis that ends where match_pos starts, so that the two can be joined
+ * into a single COPY.
+ *
+ * This happens when the basis has duplicate blocks: the search picks one
+ * of them when the run starts, and only the block matched after it shows
+ * which copy it would have been better to use.  Going forward, the search
+ * already prefers the block that continues the run. */
+static inline int rs_movematch(rs_job_t *job, rs_long_t match_pos)
+{
+    rs_long_t n = job->basis_len / job->block_len;
+
+    if (job->basis_len % job->block_len || match_pos < job->basis_len)
+        return 0;
+    return rs_search_runs_equal(job->signature,
+                                job->basis_pos / job->block_len,
+                                match_pos / job->block_len - n, (int) n);
+}
+
+
+/* How much of the basis to read at a time when extending matches. */
+#define RS_EXTEND_CHUNK 1024
+
+/**
+ * Count how many bytes of the new file at scoop_pos are the same as the
+ * basis after the last match, if that is what the scan just came to and
+ * the job can read the basis.
+ *
+ * The last block of the basis may be short, and the signature doesn't
+ * say how short, so matches that reach into it aren't extended.  That
+ * way the basis is never read past its end. */
+static size_t rs_extendmatch(rs_job_t *job)
+{
+    rs_byte_t buf[RS_EXTEND_CHUNK];
+    rs_byte_t const *new_data;
+    rs_long_t pos;
+    size_t avail, ext = 0, len, i;
+    void *p;
+
+    pos = job->basis_pos + job->basis_len;
+    if (!job->copy_cb || !job->basis_len
+        || (job->delta_self && job->delta_self->matching)
+        || pos >= (rs_long_t) (job->signature->count - 1) * job->block_len)
+        return 0;
+    new_data = job->scoop_next + job->scoop_pos;
+    avail = job->scoop_avail - job->scoop_pos;
+    while (ext < avail) {
+        len = avail - ext;
+        if (len > sizeof buf)
+            len = sizeof buf;
+        p = buf;
+        if (job->copy_cb(job->copy_arg, pos + ext, &len, &p) != RS_DONE)
+            break;
+        for (i = 0; i < len && ((rs_byte_t *) p)[i] == new_data[ext + i]; i++)
+            ;
+        ext += i;
+        if (i < len || !len)
+            break;
+    }
+    if (ext) {
+        rs_trace("extended match at " PRINTF_FORMAT_U64 " forward by %ld bytes",
+                 PRINTF_CAST_U64(job->basis_pos), (long) ext);
+    }
+    return ext;
+}
+
+
+/**
+ * Count how many bytes at the end of the miss before scoop_pos are the
+ * same as the basis before match_pos, if the job can read the basis. */
+static size_t rs_extendback(rs_job_t *job, rs_long_t match_pos)
+{
+    rs_byte_t buf[RS_EXTEND_CHUNK];
+    rs_byte_t const *p;
+    size_t max, ext = 0, len, got, i;
+    void *q;
+
+    if (!job->copy_cb)
+        return 0;
+    max = job->scoop_pos;
+    if ((rs_long_t) max > match_pos)
+        max = (size_t) match_pos;
+    while (ext < max) {
+        len = max - ext;
+        if (len > sizeof buf)
+            len = sizeof buf;
+        got = len;
+        q = buf;
+        if (job->copy_cb(job->copy_arg, match_pos - ext - len, &got, &q)
+            != RS_DONE || got != len)
+            break;
+        p = job->scoop_next + job->scoop_pos - ext - len;
+        for (i = len; i > 0 && ((rs_byte_t *) q)[i - 1] == p[i - 1]; i--)
+            ;
+        ext += len - i;
+        if (i)
+            break;
+    }
+    if (ext) {
+        rs_trace("extended match at " PRINTF_FORMAT_U64 " back by %ld bytes",
+                 PRINTF_CAST_U64(match_pos), (long) ext);
+    }
+    return ext;
 }
 
 
 /**
  * Append a match at match_pos of length match_len to the delta, extending
- * a previous match if possible, or flushing any previous miss/match. */
-inline rs_result rs_appendmatch(rs_job_t *job, rs_long_t match_pos, size_t match_len)
+ * a previous match if possible, or flushing any previous miss/match.  If
+ * self is set, the match is in the output so far rather than the basis. */
+inline rs_result rs_appendmatch(rs_job_t *job, int self, rs_long_t match_pos, size_t match_len)
 {
     rs_result result=RS_DONE;
+    int last_self = job->delta_self && job->delta_self->matching;
     
-    /* if last was a match that can be extended, extend it */
-    if (job->basis_len && (job->basis_pos + job->basis_len) == match_pos) {
+    /* if last was a match of the same kind that can be extended, extend it */
+    if (job->basis_len && last_self == self
+        && (job->basis_pos + job->basis_len) == match_pos) {
         job->basis_len+=match_len;
+    } else if (job->basis_len && !self && !last_self
+               && rs_movematch(job, match_pos)) {
+        /* else if an identical copy of it can be extended, use that */
+        rs_trace("moved match of " PRINTF_FORMAT_U64 " bytes from "
+                 PRINTF_FORMAT_U64 " to " PRINTF_FORMAT_U64,
+                 PRINTF_CAST_U64(job->basis_len),
+                 PRINTF_CAST_U64(job->basis_pos),
+                 PRINTF_CAST_U64(match_pos - job->basis_len));
+        job->basis_pos = match_pos - job->basis_len;
+        job->basis_len += match_len;
     } else {
-        /* else appendflush the last value */
+        /* else take what the match can be extended back over out of the
+         * last miss */
+        if (!job->basis_len && job->scoop_pos && !self) {
+            size_t ext = rs_extendback(job, match_pos);
+            job->scoop_pos -= ext;
+            match_pos -= ext;
+            match_len += ext;
+        }
+        /* appendflush the last value */
         result=rs_appendflush(job);
         /* make this the new match value */
         job->basis_pos=match_pos;
         job->basis_len=match_len;
+        if (job->delta_self)
+            job->delta_self->matching=self;
     }
     /* increment scoop_pos to point at next unscanned data */
     job->scoop_pos+=match_len;
@@ -337,13 +592,15 @@ inline rs_result rs_appendflush(rs_job_t *job)
         rs_trace("matched " PRINTF_FORMAT_U64 " bytes at " PRINTF_FORMAT_U64 "!",
                  PRINTF_CAST_U64(job->basis_len),
                  PRINTF_CAST_U64(job->basis_pos));
-        rs_emit_copy_cmd(job, job->basis_pos, job->basis_len);
+        if (job->delta_self && job->delta_self->matching)
+            rs_emit_selfcopy_cmd(job, job->basis_pos, job->basis_len);
+        else
+            rs_emit_copy_cmd(job, job->basis_pos, job->basis_len);
         job->basis_len=0;
         return rs_processmatch(job);
     /* else if last is a miss, emit and process it*/
     } else if (job->scoop_pos) {
         rs_trace("got %ld bytes of literal data", (long) job->scoop_pos);
-        rs_emit_literal_cmd(job, job->scoop_pos);
         return rs_processmiss(job);
     }
     /* otherwise, nothing to flush so we are done */
@@ -357,12 +614,18 @@ inline rs_result rs_appendflush(rs_job_t *job)
  * or RS_BLOCKED if it gets blocked. After it completes scoop_pos is reset
  * to still point at the next unscanned data.
  *
- * This function currently just removes data from the scoop and adjusts
- * scoop_pos appropriately. In the future this could be used for something
- * like context compressing of miss data. Note that it also calls
+ * This function removes data from the scoop and adjusts scoop_pos
+ * appropriately, first handing it to the literal compressor as history if
+ * the delta format is primed with matched data. Note that it also calls
  * rs_tube_catchup to output any pending output. */
 inline rs_result rs_processmatch(rs_job_t *job)
 {
+    if (job->delta_self) {
+        rs_delta_self_index(job, job->scoop_pos);
+        job->delta_self->pos += job->scoop_pos;
+    }
+    if (job->compress)
+        rs_compress_history(job->compress, job->scoop_next, job->scoop_pos);
     job->scoop_avail-=job->scoop_pos;
     job->scoop_next+=job->scoop_pos;
     job->scoop_pos=0;
@@ -371,9 +634,10 @@ inline rs_result rs_processmatch(rs_job_t *job)
     
 /**
  * The scoop contains miss data at scoop_next of length scoop_pos. This
- * function processes that miss data, returning RS_DONE if it completes, or
- * RS_BLOCKED if it gets blocked. After it completes scoop_pos is reset to
- * still point at the next unscanned data.
+ * function emits a literal command for that miss data and processes it,
+ * returning RS_DONE if it completes, or RS_BLOCKED if it gets blocked.
+ * After it completes scoop_pos is reset to still point at the next
+ * unscanned data.
  *
  * This function uses rs_tube_copy to queue copying from the scoop into
  * output. and uses rs_tube_catchup to do the copying. This automaticly
@@ -381,16 +645,123 @@ inline rs_result rs_processmatch(rs_job_t *job)
  * is blocked, scoop_pos does not point at legit data, so scanning can also
  * not proceed.
  *
- * In the future this could do compression of miss data before outputing
- * it. */
+ * If the delta format compresses literal data, the miss data is
+ * compressed into a buffer that is sent instead, and removed from the
+ * scoop straight away. */
 inline rs_result rs_processmiss(rs_job_t *job)
 {
+    rs_result result;
+
+    if (job->delta_self) {
+        rs_delta_self_index(job, job->scoop_pos);
+        job->delta_self->pos += job->scoop_pos;
+    }
+
+    if (job->compress) {
+        result = rs_emit_literal(job, job->scoop_next, job->scoop_pos);
+        if (result != RS_DONE)
+            return result;
+        job->scoop_avail-=job->scoop_pos;
+        job->scoop_next+=job->scoop_pos;
+        job->scoop_pos=0;
+        return rs_tube_catchup(job);
+    }
+    rs_emit_literal_cmd(job, job->scoop_pos);
     rs_tube_copy(job, job->scoop_pos);
     job->scoop_pos=0;
     return rs_tube_catchup(job);
 }
 
 
+/**
+ * Emit a literal command for \p len bytes of data at \p buf, and queue
+ * the data to be sent after it, compressing it first if the delta format
+ * says so.  The data must stay where it is until the tube is idle. */
+static rs_result rs_emit_literal(rs_job_t *job, void const *buf, size_t len)
+{
+    rs_byte_t const *out;
+    size_t out_len;
+    rs_result result;
+
+    if (job->compress) {
+        result = rs_compress_literal(job->compress, buf, len, &out, &out_len);
+        if (result != RS_DONE)
+            return result;
+        buf = out;
+        len = out_len;
+    }
+    rs_emit_literal_cmd(job, (int) len);
+    rs_tube_copy_buf(job, buf, len);
+    return RS_DONE;
+}
+
+
+/**
+ * Add the block of the new file at \p block to the index of the output
+ * so far, so that later data can be sent as a SELFCOPY of it.  Running
+ * out of memory here is fatal.
+ */
+static void rs_delta_self_add(rs_job_t *job, rs_byte_t const *block)
+{
+    struct rs_delta_self *s = job->delta_self;
+    rs_signature_t *sig = s->sig;
+    rs_strong_sum_t strong_sum;
+
+    if (sig->count == sig->size
+        && rs_sumset_reserve(sig, sig->size ? 2 * sig->size : 1024)
+        != RS_DONE)
+        rs_fatal("couldn't grow the index of the new file");
+    sig->weak_sums[sig->count] = rs_calc_weak_sum(block, sig->block_len);
+    if (sig->magic == RS_BLAKE2_SIG_MAGIC)
+        rs_calc_blake2_sum(block, sig->block_len, &strong_sum);
+    else
+        rs_calc_md4_sum(block, sig->block_len, &strong_sum);
+    memcpy(rs_sig_strong_sum(sig, sig->count), strong_sum,
+           sig->strong_sum_len);
+    sig->count++;
+    if (rs_search_add_blocks(sig, 1) != RS_DONE)
+        rs_fatal("couldn't grow the index of the new file");
+}
+
+
+/**
+ * Index the blocks of the new file that are complete up to \p upto bytes
+ * past scoop_next.  The data before scoop_pos will be out before anything
+ * that is found after it, so it can all be indexed, even while it is
+ * still an unfinished miss.
+ */
+static void rs_delta_self_index(rs_job_t *job, size_t upto)
+{
+    struct rs_delta_self *s = job->delta_self;
+    size_t block_len = job->block_len, from, len, n;
+    rs_byte_t const *p;
+
+    from = (size_t) (s->indexed - s->pos);
+    if (upto <= from)
+        return;
+    p = job->scoop_next + from;
+    len = upto - from;
+    s->indexed += len;
+    if (s->block_fill) {
+        n = block_len - s->block_fill;
+        if (n > len)
+            n = len;
+        memcpy(s->block + s->block_fill, p, n);
+        s->block_fill += n;
+        p += n;
+        len -= n;
+        if (s->block_fill < block_len)
+            return;
+        rs_delta_self_add(job, s->block);
+        s->block_fill = 0;
+    }
+    for (; len >= block_len; p += block_len, len -= block_len)
+        rs_delta_self_add(job, p);
+    memcpy(s->block, p, len);
+    s->block_fill = len;
+}
+
+
 /**
  * \brief State function that does a slack delta containing only
  * literal data to recreate the input.
@@ -400,7 +771,16 @@ static rs_result rs_delta_s_slack(rs_job_t *job)
     rs_buffers_t * const stream = job->stream;
     size_t avail = stream->avail_in;
 
-    if (avail) {
+    rs_result result;
+
+    if (avail && job->compress) {
+        rs_trace("emit compressed slack delta for " PRINTF_FORMAT_U64
+                 " available bytes", PRINTF_CAST_U64(avail));
+        result = rs_emit_literal(job, stream->next_in, avail);
+        stream->next_in += avail;
+        stream->avail_in -= avail;
+        return result == RS_DONE ? RS_RUNNING : result;
+    } else if (avail) {
         rs_trace("emit slack delta for " PRINTF_FORMAT_U64
                  " available bytes", PRINTF_CAST_U64(avail));
         rs_emit_literal_cmd(job, avail);
@@ -417,19 +797,505 @@ static rs_result rs_delta_s_slack(rs_job_t *job)
 }
 
 
+/*
+ * Threaded delta generation.
+ *
+ * The new file is read in batches, each split into segments that the
+ * workers scan at the same time, against the same signature.  Each
+ * segment is scanned just like rs_delta_s_scan() would, into a list of
+ * commands, looking past its end into the next one so that blocks that
+ * straddle the seam are still matched.  The scan of a segment can stop
+ * up to a block past its end, so the next segment's commands are trimmed
+ * to start there when the lists are merged; a COPY cut short at the
+ * front still copies the right data.  Whatever is left at the end of a
+ * batch without a whole block after it is carried over to the front of
+ * the next one, as the serial scan would have kept it in the scoop.
+ *
+ * While the workers scan one batch, the job sends the commands of the
+ * batch before it and fills the other buffer with input.
+ */
+
+/* Roughly how much of the input to hand to each thread at a time, and
+ * how many segments to split that into.  Segments are a few blocks long
+ * at least, but there are fewer of them when blocks are big, so that a
+ * batch takes no more than RS_DELTA_THREAD_MAX_BYTES per thread unless
+ * a block is bigger than that. */
+#define RS_DELTA_THREAD_BYTES     (1 << 20)
+#define RS_DELTA_THREAD_MAX_BYTES (4 << 20)
+#define RS_DELTA_THREAD_TASKS     4
+
+/* Most threads to scan a delta with; more wouldn't be any faster. */
+#define RS_DELTA_MAX_THREADS      64
+
+/** \private
+ * A command found by scanning: a COPY of \p len bytes from \p pos in the
+ * basis, or \p len bytes of literal data if \p pos is -1.
+ */
+typedef struct rs_delta_cmd {
+    rs_long_t           pos;
+    rs_long_t           len;
+} rs_delta_cmd_t;
+
+/** \private
+ * A list of commands, covering consecutive parts of the new file.
+ */
+typedef struct rs_delta_cmds {
+    rs_delta_cmd_t      *cmd;
+    int                 count, alloc;
+} rs_delta_cmds_t;
+
+/** \private
+ * A segment of a batch, scanned by one task.
+ */
+typedef struct rs_delta_seg {
+    size_t              start;          /* first position to look for a
+                                         * match at */
+    size_t              end;            /* positions from here on are
+                                         * left to the next segment */
+    int                 flush;          /* this is the end of the input */
+    rs_delta_cmds_t     cmds;
+    rs_long_t           basis_pos, basis_len; /* the COPY being built */
+    size_t              miss_pos;       /* start of the literal being
+                                         * built, if not a COPY */
+    rs_stats_t          stats;
+} rs_delta_seg_t;
+
+/** \private
+ * A batch of the new file, and what was found in it.
+ */
+typedef struct rs_delta_batch {
+    struct rs_delta_threads *threads;
+    rs_byte_t           *buf;           /* room for a block carried over,
+                                         * then for the new input */
+    rs_byte_t           *data;          /* what is scanned: the carry,
+                                         * then the new input */
+    size_t              fill;           /* bytes of new input */
+    size_t              len;            /* bytes at data */
+    int                 complete;       /* filled up, or the input ended */
+    int                 final;          /* the input ended */
+    int                 nsegs;
+    rs_delta_seg_t      *segs;
+    rs_delta_cmds_t     cmds;           /* merged commands of all segments */
+    size_t              carry;          /* bytes at the end left unscanned */
+} rs_delta_batch_t;
+
+/** \private
+ * State of threaded delta generation.
+ */
+struct rs_delta_threads {
+    rs_workers_t        *workers;
+    rs_signature_t const *sig;
+    size_t              block_len;
+    int                 nthreads;
+    size_t              seg_len;
+    size_t              batch_len;
+    int                 max_segs;
+    rs_delta_batch_t    batch[2];
+    rs_delta_batch_t    *filling, *scanning, *sending;
+    int                 send_cmd;       /* next command to send */
+    size_t              send_pos;       /* its offset in the batch */
+};
+
+
+static void rs_delta_cmds_add(rs_delta_cmds_t *cmds, rs_long_t pos,
+                              rs_long_t len)
+{
+    rs_delta_cmd_t *last = cmds->count ? &cmds->cmd[cmds->count - 1] : NULL;
+
+    /* join the new command on to the last one if it continues it */
+    if (last && last->pos == -1 && pos == -1) {
+        last->len += len;
+        return;
+    }
+    if (last && last->pos != -1 && last->pos + last->len == pos) {
+        last->len += len;
+        return;
+    }
+    if (cmds->count == cmds->alloc) {
+        cmds->alloc = cmds->alloc ? 2 * cmds->alloc : 64;
+        cmds->cmd = realloc(cmds->cmd, cmds->alloc * sizeof *cmds->cmd);
+        if (!cmds->cmd)
+            rs_fatal("couldn't allocate delta commands");
+    }
+    cmds->cmd[cmds->count].pos = pos;
+    cmds->cmd[cmds->count].len = len;
+    cmds->count++;
+}
+
+
+/*
+ * Add whatever the segment has been building up to position \p pos to its
+ * commands.
+ */
+static void rs_delta_seg_flush(rs_delta_seg_t *seg, size_t pos)
+{
+    if (seg->basis_len) {
+        rs_delta_cmds_add(&seg->cmds, seg->basis_pos, seg->basis_len);
+        seg->basis_len = 0;
+    } else if (pos > seg->miss_pos) {
+        rs_delta_cmds_add(&seg->cmds, -1, pos - seg->miss_pos);
+    }
+    seg->miss_pos = pos;
+}
+
+
+/*
+ * Add a match at \p pos in the segment, the same way as rs_appendmatch().
+ */
+static void rs_delta_seg_match(rs_delta_seg_t *seg, rs_signature_t const *sig,
+                               size_t pos, rs_long_t match_pos,
+                               size_t match_len)
+{
+    rs_long_t n = seg->basis_len / sig->block_len;
+
+    if (seg->basis_len && seg->basis_pos + seg->basis_len == match_pos) {
+        seg->basis_len += match_len;
+    } else if (seg->basis_len && seg->basis_len % sig->block_len == 0
+               && match_pos >= seg->basis_len
+               && rs_search_runs_equal(sig, seg->basis_pos / sig->block_len,
+                                       match_pos / sig->block_len - n, (int) n)) {
+        seg->basis_pos = match_pos - seg->basis_len;
+        seg->basis_len += match_len;
+    } else {
+        rs_delta_seg_flush(seg, pos);
+        seg->basis_pos = match_pos;
+        seg->basis_len = match_len;
+    }
+    seg->miss_pos = pos + match_len;
+}
+
+
+/**
+ * Scan segment \p i of a batch.  Runs on a worker thread.
+ * \private
+ */
+static void rs_delta_scan_task(void *arg, int i)
+{
+    rs_delta_batch_t    *batch = (rs_delta_batch_t *) arg;
+    rs_delta_seg_t      *seg = &batch->segs[i];
+    rs_signature_t const *sig = batch->threads->sig;
+    rs_byte_t const     *data = batch->data;
+    size_t              block_len = batch->threads->block_len;
+    size_t              pos = seg->start;
+    size_t              match_len, end;
+    rs_long_t           match_pos, next_pos;
+    int                 hint;
+    Rollsum             sum;
+
+    seg->cmds.count = 0;
+    seg->basis_len = 0;
+    seg->miss_pos = pos;
+    RollsumInit(&sum);
+    while (pos < seg->end || (seg->flush && pos < batch->len)) {
+        next_pos = seg->basis_pos + seg->basis_len;
+        hint = -1;
+        if (seg->basis_len && next_pos % block_len == 0)
+            hint = next_pos / block_len;
+        if (sum.count == 0) {
+            match_len = batch->len - pos;
+            if (match_len > block_len)
+                match_len = block_len;
+            RollsumUpdate(&sum, data + pos, match_len);
+        } else {
+            match_len = sum.count;
+        }
+        if (rs_search_for_block(RollsumDigest(&sum), data + pos, match_len,
+                                sig, &seg->stats, hint, &match_pos)) {
+            rs_delta_seg_match(seg, sig, pos, match_pos, match_len);
+            pos += match_len;
+            RollsumInit(&sum);
+        } else {
+            if (pos + block_len < batch->len) {
+                RollsumRotate(&sum, data[pos], data[pos + block_len]);
+            } else {
+                RollsumRollout(&sum, data[pos]);
+            }
+            if (seg->basis_len)
+                rs_delta_seg_flush(seg, pos);
+            pos++;
+            /* and on through the rest of a run of misses */
+            end = seg->flush ? batch->len : seg->end;
+            if (end + block_len > batch->len)
+                end = batch->len > block_len ? batch->len - block_len : 0;
+            if (sum.count == block_len && pos < end)
+                pos += rs_search_miss_run(sig, &sum, data + pos, block_len,
+                                          end - pos);
+        }
+    }
+    rs_delta_seg_flush(seg, pos);
+}
+
+
+/*
+ * Split a batch into segments and start the workers scanning them.
+ */
+static void rs_delta_start_scan(struct rs_delta_threads *t,
+                                rs_delta_batch_t *batch)
+{
+    size_t scan_end, pos;
+    int i;
+
+    /* positions with a byte after their block, as rs_delta_s_scan() */
+    scan_end = batch->len > t->block_len ? batch->len - t->block_len : 0;
+    batch->nsegs = (int) ((scan_end + t->seg_len - 1) / t->seg_len);
+    if (!batch->nsegs)
+        batch->nsegs = 1;
+    for (i = 0, pos = 0; i < batch->nsegs; i++) {
+        batch->segs[i].start = pos;
+        pos += t->seg_len;
+        batch->segs[i].end = pos < scan_end ? pos : scan_end;
+        batch->segs[i].flush = 0;
+        pos = batch->segs[i].end;
+    }
+    batch->segs[batch->nsegs - 1].flush = batch->final;
+
+    rs_trace("scanning " PRINTF_FORMAT_U64 " bytes in %d segments",
+             PRINTF_CAST_U64(batch->len), batch->nsegs);
+    rs_workers_start(t->workers, rs_delta_scan_task, batch, batch->nsegs);
+}
+
+
+/*
+ * Wait for the workers to scan a batch, and join the commands of its
+ * segments into one list, leaving out what each segment's scan overlaps
+ * with the one before.
+ */
+static void rs_delta_finish_scan(rs_job_t *job, rs_delta_batch_t *batch)
+{
+    size_t pos = 0, off;
+    rs_long_t skip;
+    rs_delta_seg_t *seg;
+    rs_delta_cmd_t *c;
+    int i, j;
+
+    rs_workers_wait(job->delta_threads->workers);
+
+    batch->cmds.count = 0;
+    for (i = 0; i < batch->nsegs; i++) {
+        seg = &batch->segs[i];
+        off = seg->start;
+        for (j = 0; j < seg->cmds.count; j++) {
+            c = &seg->cmds.cmd[j];
+            off += c->len;
+            if (off <= pos)
+                continue;
+            skip = pos > off - c->len ? pos - (off - c->len) : 0;
+            rs_delta_cmds_add(&batch->cmds, c->pos == -1 ? -1 : c->pos + skip,
+                              c->len - skip);
+            pos = off;
+        }
+        job->stats.false_matches += seg->stats.false_matches;
+        seg->stats.false_matches = 0;
+    }
+    assert(pos <= batch->len);
+    batch->carry = batch->len - pos;
+}
+
+
+/*
+ * Send the next command of the batch that has been scanned, joining
+ * COPY commands that carry on from one batch to the next.
+ */
+static rs_result rs_delta_send_cmd(rs_job_t *job, rs_delta_batch_t *batch)
+{
+    struct rs_delta_threads *t = job->delta_threads;
+    rs_delta_cmd_t *c = &batch->cmds.cmd[t->send_cmd++];
+
+    if (c->pos != -1 && job->compress)
+        rs_compress_history(job->compress, batch->data + t->send_pos, c->len);
+    if (c->pos != -1 && job->basis_len
+        && job->basis_pos + job->basis_len == c->pos) {
+        job->basis_len += c->len;
+    } else {
+        if (job->basis_len) {
+            rs_emit_copy_cmd(job, job->basis_pos, job->basis_len);
+            job->basis_len = 0;
+        }
+        if (c->pos == -1) {
+            t->send_pos += c->len;
+            return rs_emit_literal(job, batch->data + t->send_pos - c->len,
+                                   c->len);
+        }
+        job->basis_pos = c->pos;
+        job->basis_len = c->len;
+    }
+    t->send_pos += c->len;
+    return RS_DONE;
+}
+
+
+/**
+ * Make the batches no bigger than they need to be for the \p len bytes
+ * of input that are left, when the whole input is known from the start.
+ * \private
+ */
+static void rs_delta_threads_fit(struct rs_delta_threads *t, size_t len)
+{
+    size_t per_thread = (len + t->nthreads - 1) / t->nthreads;
+
+    if (len >= t->batch_len)
+        return;
+    t->batch_len = len;
+    if (per_thread < 4 * t->block_len)
+        per_thread = 4 * t->block_len;
+    if (t->seg_len > per_thread)
+        t->seg_len = per_thread;
+    t->max_segs = (int) ((t->batch_len + t->seg_len - 1) / t->seg_len) + 1;
+    rs_trace("input is only " PRINTF_FORMAT_U64 " bytes, so scanning "
+             PRINTF_FORMAT_U64 " bytes per segment",
+             PRINTF_CAST_U64(len), PRINTF_CAST_U64(t->seg_len));
+}
+
+
+/**
+ * Allocate the buffer and segments of a batch, when it is first filled,
+ * so that a small input doesn't allocate batches it never uses.
+ * \private
+ */
+static void rs_delta_batch_alloc(rs_job_t *job, rs_delta_batch_t *batch)
+{
+    struct rs_delta_threads *t = job->delta_threads;
+
+    if (batch->buf)
+        return;
+    if (batch == &t->batch[0] && rs_job_input_is_ending(job))
+        rs_delta_threads_fit(t, rs_scoop_total_avail(job));
+    batch->buf = rs_alloc(t->block_len + t->batch_len, "delta batch");
+    batch->segs = rs_alloc_struct0(t->max_segs * sizeof(rs_delta_seg_t),
+                                   "delta segments");
+}
+
+
+/**
+ * State of threaded delta generation.  Each call does one step: sends a
+ * command from the batch that has been scanned, hands a complete batch
+ * to the workers, or copies more input into the batch being filled.
+ * \private
+ */
+static rs_result rs_delta_s_threads(rs_job_t *job)
+{
+    struct rs_delta_threads *t = job->delta_threads;
+    rs_delta_batch_t    *batch, *prev;
+    rs_result           result;
+    size_t              len;
+    void                *p;
+
+    if ((batch = t->sending)) {
+        if (t->send_cmd < batch->cmds.count) {
+            result = rs_delta_send_cmd(job, batch);
+            return result == RS_DONE ? RS_RUNNING : result;
+        }
+        t->sending = NULL;
+        if (batch->final) {
+            if (job->basis_len)
+                rs_emit_copy_cmd(job, job->basis_pos, job->basis_len);
+            job->basis_len = 0;
+            job->statefn = rs_delta_s_end;
+        }
+        batch->fill = batch->complete = 0;
+        return RS_RUNNING;
+    }
+
+    if (!t->filling) {
+        /* the input has ended; send what the workers found in the rest */
+        rs_delta_finish_scan(job, t->scanning);
+        t->sending = t->scanning;
+        t->scanning = NULL;
+        t->send_cmd = 0;
+        t->send_pos = 0;
+        return RS_RUNNING;
+    }
+
+    batch = t->filling;
+    if (batch->complete) {
+        /* wait for the previous batch, then start on this one with
+         * whatever it left over in front */
+        batch->data = batch->buf + t->block_len;
+        if ((prev = t->scanning)) {
+            rs_delta_finish_scan(job, prev);
+            batch->data -= prev->carry;
+            memcpy(batch->data, prev->data + prev->len - prev->carry,
+                   prev->carry);
+            t->sending = prev;
+            t->send_cmd = 0;
+            t->send_pos = 0;
+        }
+        batch->len = batch->buf + t->block_len + batch->fill - batch->data;
+        rs_delta_start_scan(t, batch);
+        t->scanning = batch;
+        if (batch->final)
+            t->filling = NULL;
+        else
+            t->filling = batch == &t->batch[0] ? &t->batch[1] : &t->batch[0];
+        return RS_RUNNING;
+    }
+
+    /* take whatever input is available, up to a full batch, but use up
+     * anything in the scoop first so that it doesn't grow */
+    len = job->scoop_avail ? job->scoop_avail : rs_scoop_total_avail(job);
+    if (!len) {
+        result = rs_scoop_readahead(job, 1, &p);
+        if (result == RS_INPUT_ENDED) {
+            rs_delta_batch_alloc(job, batch);
+            batch->complete = batch->final = 1;
+            return RS_RUNNING;
+        }
+        return result;
+    }
+    rs_delta_batch_alloc(job, batch);
+    if (len > t->batch_len - batch->fill)
+        len = t->batch_len - batch->fill;
+    result = rs_scoop_read(job, len, &p);
+    if (result != RS_DONE)
+        return result;
+    memcpy(batch->buf + t->block_len + batch->fill, p, len);
+    batch->fill += len;
+    if (batch->fill == t->batch_len) {
+        batch->complete = 1;
+        /* don't start another batch only to find the input has ended */
+        batch->final = rs_job_input_is_ending(job)
+            && !rs_scoop_total_avail(job);
+    }
+    return RS_RUNNING;
+}
+
+
+/**
+ * Free the state of threaded delta generation, after waiting for the
+ * workers to finish whatever they were doing.
+ */
+void rs_delta_threads_free(struct rs_delta_threads *t)
+{
+    int i, j;
+
+    rs_workers_free(t->workers);
+    for (i = 0; i < 2; i++) {
+        for (j = 0; t->batch[i].segs && j < t->max_segs; j++)
+            free(t->batch[i].segs[j].cmds.cmd);
+        free(t->batch[i].segs);
+        free(t->batch[i].cmds.cmd);
+        free(t->batch[i].buf);
+    }
+    free(t);
+}
+
+
 /**
  * State function for writing out the header of the encoding job.
  */
 static rs_result rs_delta_s_header(rs_job_t *job)
 {
     rs_emit_delta_header(job);
+    if (job->delta_self)
+        rs_emit_window_cmd(job, job->delta_self->window);
 
     if (job->block_len) {
         if (!job->signature) {
             rs_error("no signature is loaded into the job");
             return RS_PARAM_ERROR;
         }
-        job->statefn = rs_delta_s_scan;
+        job->statefn = job->delta_threads ? rs_delta_s_threads
+            : rs_delta_s_scan;
     } else {
         rs_trace("block length is zero for this delta; "
                  "therefore using slack deltas");
@@ -442,14 +1308,17 @@ static rs_result rs_delta_s_header(rs_job_t *job)
 
 rs_job_t *rs_delta_begin(rs_signature_t *sig)
 {
-    /* Caller must have called rs_build_hash_table() by now */
-    if (!sig->tag_table)
-        rs_fatal("Must call rs_build_hash_table() prior to calling rs_delta_begin()");
+    /* A loadsig job indexes the signature as it goes, so this is only
+     * reached with a signature that wasn't loaded. */
+    if (!sig->hashtable)
+        rs_fatal("Signature must be loaded with rs_loadsig_begin(), or "
+                 "indexed with rs_build_hash_table(), before rs_delta_begin()");
 
     rs_job_t *job;
 
     job = rs_job_new("delta", rs_delta_s_header);
     job->signature = sig;
+    job->magic = RS_DELTA_MAGIC;
 
     RollsumInit(&job->weak_sum);
 
@@ -477,3 +1346,116 @@ rs_job_t *rs_delta_begin(rs_signature_t *sig)
 
     return job;
 }
+
+
+rs_result rs_delta_set_format(rs_job_t *job, rs_magic_number format,
+                              int level)
+{
+    rs_result result = RS_DONE;
+
+    if (job->compress) {
+        rs_compress_free(job->compress);
+        job->compress = NULL;
+    }
+    if (format != RS_DELTA_MAGIC)
+        result = rs_compress_new(format, level, 0, &job->compress);
+    job->magic = result == RS_DONE ? format : RS_DELTA_MAGIC;
+    return result;
+}
+
+
+rs_result rs_delta_set_self_copy(rs_job_t *job, rs_long_t window)
+{
+    struct rs_delta_self *s;
+
+    if (window <= 0 || window > RS_MAX_SELF_WINDOW) {
+        rs_error("unreasonable self copy window " PRINTF_FORMAT_U64,
+                 PRINTF_CAST_U64(window));
+        return RS_PARAM_ERROR;
+    }
+    if (job->delta_threads) {
+        rs_trace("self copies need the new file scanned in order, "
+                 "so not using threads");
+        rs_delta_threads_free(job->delta_threads);
+        job->delta_threads = NULL;
+    }
+    if (!(s = job->delta_self)) {
+        s = job->delta_self = rs_alloc_struct(struct rs_delta_self);
+        s->sig = rs_alloc_struct(rs_signature_t);
+        s->sig->block_len = job->block_len;
+        s->sig->strong_sum_len = job->strong_sum_len;
+        s->sig->magic = job->signature->magic;
+        s->block = rs_alloc(job->block_len ? job->block_len : 1,
+                            "self copy block");
+    }
+    s->window = window;
+    return RS_DONE;
+}
+
+
+void rs_delta_self_free(struct rs_delta_self *s)
+{
+    rs_free_sumset(s->sig);
+    free(s->block);
+    free(s);
+}
+
+
+rs_job_t *rs_delta_begin_basis(rs_signature_t *sig, rs_copy_cb *copy_cb,
+                               void *copy_arg)
+{
+    rs_job_t *job;
+
+    if ((job = rs_delta_begin(sig))) {
+        job->copy_cb = copy_cb;
+        job->copy_arg = copy_arg;
+    }
+    return job;
+}
+
+
+rs_job_t *rs_delta_begin_threads(rs_signature_t *sig, int threads)
+{
+    rs_job_t *job;
+    rs_workers_t *workers;
+    struct rs_delta_threads *t;
+    size_t tasks;
+    int i;
+
+    job = rs_delta_begin(sig);
+    if (!job || !job->block_len || threads < 2)
+        return job;
+    if (threads > RS_DELTA_MAX_THREADS)
+        threads = RS_DELTA_MAX_THREADS;
+    rs_pick_sum_kernels();
+    if (!(workers = rs_workers_new(threads)))
+        return job;
+
+    t = rs_alloc_struct(struct rs_delta_threads);
+    t->workers = workers;
+    t->sig = sig;
+    t->block_len = job->block_len;
+    t->nthreads = threads;
+    t->seg_len = RS_DELTA_THREAD_BYTES / RS_DELTA_THREAD_TASKS;
+    if (t->seg_len < 4 * t->block_len)
+        t->seg_len = 4 * t->block_len;
+    if (t->seg_len > RS_DELTA_THREAD_MAX_BYTES)
+        t->seg_len = t->block_len > RS_DELTA_THREAD_MAX_BYTES ?
+            t->block_len : RS_DELTA_THREAD_MAX_BYTES;
+    tasks = RS_DELTA_THREAD_MAX_BYTES / t->seg_len;
+    if (tasks > RS_DELTA_THREAD_TASKS)
+        tasks = RS_DELTA_THREAD_TASKS;
+    if (tasks < 1)
+        tasks = 1;
+    t->batch_len = t->seg_len * tasks * threads;
+    /* the carry can make one more segment */
+    t->max_segs = (int) tasks * threads + 1;
+    for (i = 0; i < 2; i++)
+        t->batch[i].threads = t;
+    t->filling = &t->batch[0];
+    job->delta_threads = t;
+    rs_trace("generating delta with %d threads, " PRINTF_FORMAT_U64
+             " bytes per batch", threads, PRINTF_CAST_U64(t->batch_len));
+
+    return job;
+}
@@ -52,8 +52,8 @@
 void
 rs_emit_delta_header(rs_job_t *job)
 {
-    rs_trace("emit DELTA magic");
-    rs_squirt_n4(job, RS_DELTA_MAGIC);
+    rs_trace("emit DELTA magic %#x", job->magic);
+    rs_squirt_n4(job, job->magic);
 }
 
 
@@ -89,27 +89,22 @@ rs_emit_literal_cmd(rs_job_t *job, int len)
 }
 
 
-/** Write a COPY command for given offset and length.
- *
- * There is a choice of variable-length encodings, depending on the
- * size of representation for the parameters. */
-void
-rs_emit_copy_cmd(rs_job_t *job, rs_long_t where, rs_long_t len)
+/*
+ * Work out the command byte for a COPY or SELFCOPY, given the command
+ * byte of the kind with one-byte parameters.
+ */
+static int
+rs_copy_cmd_byte(int cmd, int where_bytes, int len_bytes)
 {
-    int            cmd;
-    rs_stats_t     *stats = &job->stats;
-    const int where_bytes = rs_int_len(where);
-    const int len_bytes   = rs_int_len(len);
-
     /* Commands ascend (1,1), (1,2), ... (8, 8) */
     if (where_bytes == 8) 
-        cmd = RS_OP_COPY_N8_N1;
+        cmd += 12;
     else if (where_bytes == 4)
-        cmd = RS_OP_COPY_N4_N1;
+        cmd += 8;
     else if (where_bytes == 2)
-        cmd = RS_OP_COPY_N2_N1;
+        cmd += 4;
     else if (where_bytes == 1)
-        cmd = RS_OP_COPY_N1_N1;
+        ;
     else {
         rs_fatal("can't encode copy command with where_bytes=%d",
                  where_bytes);
@@ -127,6 +122,23 @@ rs_emit_copy_cmd(rs_job_t *job, rs_long_t where, rs_long_t len)
         rs_fatal("can't encode copy command with len_bytes=%d",
                  len_bytes);
     }       
+    return cmd;
+}
+
+
+/** Write a COPY command for given offset and length.
+ *
+ * There is a choice of variable-length encodings, depending on the
+ * size of representation for the parameters. */
+void
+rs_emit_copy_cmd(rs_job_t *job, rs_long_t where, rs_long_t len)
+{
+    int            cmd;
+    rs_stats_t     *stats = &job->stats;
+    const int where_bytes = rs_int_len(where);
+    const int len_bytes   = rs_int_len(len);
+
+    cmd = rs_copy_cmd_byte(RS_OP_COPY_N1_N1, where_bytes, len_bytes);
 
     rs_trace("emit COPY_N%d_N%d(where=" PRINTF_FORMAT_U64
              ", len=" PRINTF_FORMAT_U64 "), cmd_byte=%#x",
@@ -143,6 +155,54 @@ rs_emit_copy_cmd(rs_job_t *job, rs_long_t where, rs_long_t len)
 }
 
 
+/** Write a SELFCOPY command, copying \p len bytes from \p where in the
+ * output of the patch so far.  These are counted as copies in the
+ * stats. */
+void
+rs_emit_selfcopy_cmd(rs_job_t *job, rs_long_t where, rs_long_t len)
+{
+    int            cmd;
+    rs_stats_t     *stats = &job->stats;
+    const int where_bytes = rs_int_len(where);
+    const int len_bytes   = rs_int_len(len);
+
+    cmd = rs_copy_cmd_byte(RS_OP_SELFCOPY_N1_N1, where_bytes, len_bytes);
+
+    rs_trace("emit SELFCOPY_N%d_N%d(where=" PRINTF_FORMAT_U64
+             ", len=" PRINTF_FORMAT_U64 "), cmd_byte=%#x",
+             where_bytes, len_bytes, PRINTF_CAST_U64(where), PRINTF_CAST_U64(len), cmd);
+    rs_squirt_byte(job, cmd);
+    rs_squirt_netint(job, where, where_bytes);
+    rs_squirt_netint(job, len, len_bytes);
+
+    stats->copy_cmds++;
+    stats->copy_bytes += len;
+    stats->copy_cmdbytes += 1 + where_bytes + len_bytes;
+}
+
+
+/** Write a WINDOW command, saying that SELFCOPY commands reach back at
+ * most \p window bytes into the output. */
+void
+rs_emit_window_cmd(rs_job_t *job, rs_long_t window)
+{
+    const int param_len = rs_int_len(window);
+    int cmd = RS_OP_WINDOW_N1;
+
+    if (param_len == 2)
+        cmd = RS_OP_WINDOW_N2;
+    else if (param_len == 4)
+        cmd = RS_OP_WINDOW_N4;
+    else if (param_len == 8)
+        cmd = RS_OP_WINDOW_N8;
+
+    rs_trace("emit WINDOW_N%d(window=" PRINTF_FORMAT_U64 "), cmd_byte=%#x",
+             param_len, PRINTF_CAST_U64(window), cmd);
+    rs_squirt_byte(job, cmd);
+    rs_squirt_netint(job, window, param_len);
+}
+
+
 /** Write an END command. */
 void
 rs_emit_end_cmd(rs_job_t *job)
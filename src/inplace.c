@@ -0,0 +1,545 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+/**
+ * \file inplace.c Apply a delta by rewriting the basis file in place.
+ *
+ * The new file is written over the basis from the start, so each COPY
+ * command reads the basis either from ahead of where the output has got
+ * to, where it is still untouched, or from behind it, where it may have
+ * been overwritten already.  Before running the patch, the delta's
+ * commands are scanned for the parts of the basis COPY commands read.
+ * Then while patching, before output is written over any of those parts
+ * that are still to be read, the old data there is saved in a temporary
+ * file, and later reads of it are served from there.
+ *
+ * COPY commands are given to the job's copy_direct_cb, so one whose
+ * source is where its output goes is skipped without reading or writing
+ * anything.  Only the parts of the file that change are written.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "librsync.h"
+#include "trace.h"
+#include "util.h"
+#include "command.h"
+#include "prototab.h"
+#include "job.h"
+#include "buf.h"
+#include "cmdscan.h"
+
+#if defined HAVE_UNISTD_H && defined HAVE_PREAD
+
+/* How much of a COPY is read and written back at a time. */
+#define RS_INPLACE_CHUNK        (1 << 20)
+
+
+/*
+ * Part of the basis read by COPY commands, and the number of the last
+ * of them, counting COPY and SELFCOPY commands from 0 as the patch job's
+ * copy_cmds statistic does.
+ */
+typedef struct rs_inplace_src {
+    rs_long_t           pos, len;
+    rs_long_t           last;
+} rs_inplace_src_t;
+
+
+/* Old basis data at \p pos, kept at \p off in the spill file. */
+typedef struct rs_inplace_saved {
+    rs_long_t           pos, len, off;
+} rs_inplace_saved_t;
+
+
+typedef struct rs_inplace {
+    int                 fd;             /* the basis, being rewritten */
+    rs_long_t           size;           /* how long the basis was */
+    rs_long_t           out;            /* where the output buffer goes */
+
+    rs_inplace_src_t    *src;           /* sorted, not overlapping */
+    size_t              nsrc, src_alloc, next_src;
+
+    FILE                *spill;
+    rs_inplace_saved_t  *saved;         /* sorted */
+    size_t              nsaved, saved_alloc;
+    rs_long_t           spill_len;
+
+    rs_byte_t           *buf;           /* the job's output buffer */
+    size_t              buf_len;
+    rs_byte_t           *copy_buf;      /* for COPY commands */
+    rs_byte_t           *save_buf;      /* for saving old data */
+} rs_inplace_t;
+
+
+/* Make room for one more \p size byte element in the array at \p *p. */
+static rs_result rs_inplace_grow(void **p, size_t *alloc, size_t n,
+                                 size_t size)
+{
+    void                *q;
+    size_t              want;
+
+    if (n < *alloc)
+        return RS_DONE;
+    want = *alloc ? *alloc * 2 : 64;
+    if (!(q = realloc(*p, want * size))) {
+        rs_error("failed to grow in-place patch tables to %lu entries",
+                 (unsigned long) want);
+        return RS_MEM_ERROR;
+    }
+    *p = q;
+    *alloc = want;
+    return RS_DONE;
+}
+
+
+/* Read up to \p len bytes at \p pos; \p *got is less at the end of file. */
+static rs_result rs_inplace_pread(int fd, void *p, size_t len, rs_long_t pos,
+                                  size_t *got)
+{
+    ssize_t             n;
+
+    for (*got = 0; *got < len; *got += n) {
+        n = pread(fd, (rs_byte_t *) p + *got, len - *got, pos + *got);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n < 0) {
+            rs_error("read error on fd%d: %s", fd, strerror(errno));
+            return RS_IO_ERROR;
+        }
+        if (n == 0)
+            break;
+    }
+    return RS_DONE;
+}
+
+
+static rs_result rs_inplace_pwrite(int fd, void const *p, size_t len,
+                                   rs_long_t pos)
+{
+    ssize_t             n;
+    size_t              done;
+
+    for (done = 0; done < len; done += n) {
+        n = pwrite(fd, (rs_byte_t const *) p + done, len - done, pos + done);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0) {
+            rs_error("write error on fd%d: %s", fd, strerror(errno));
+            return RS_IO_ERROR;
+        }
+    }
+    return RS_DONE;
+}
+
+
+static int rs_inplace_src_cmp(void const *a, void const *b)
+{
+    rs_long_t           pa = ((rs_inplace_src_t const *) a)->pos;
+    rs_long_t           pb = ((rs_inplace_src_t const *) b)->pos;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+
+/*
+ * Scan the commands of the delta in \p delta_fd, and make the table of
+ * the parts of the basis COPY commands read.  Anything wrong with the
+ * delta is left for the patch job to report.
+ */
+static rs_result rs_inplace_plan(rs_inplace_t *ip, int delta_fd)
+{
+    rs_cmdscan_t        *sc = rs_cmdscan_new(delta_fd);
+    rs_prototab_ent_t const *cmd;
+    rs_inplace_src_t    *r, *m;
+    rs_long_t           param[2], ncopy = 0;
+    rs_result           result = RS_DONE;
+    int                 magic, ok;
+    size_t              k;
+
+    ok = rs_cmdscan_magic(sc, &magic);
+    while (ok && rs_cmdscan_next(sc, &cmd, param)) {
+        if (cmd->kind == RS_KIND_LITERAL) {
+            rs_cmdscan_skip(sc, param[0]);
+        } else if (cmd->kind == RS_KIND_COPY) {
+            if (param[0] >= 0 && param[1] > 0 && param[0] < ip->size) {
+                result = rs_inplace_grow((void **) &ip->src, &ip->src_alloc,
+                                         ip->nsrc, sizeof *ip->src);
+                if (result != RS_DONE)
+                    break;
+                r = &ip->src[ip->nsrc++];
+                r->pos = param[0];
+                r->len = param[1];
+                if (r->len > ip->size - r->pos)
+                    r->len = ip->size - r->pos;
+                r->last = ncopy;
+            }
+            ncopy++;
+        } else if (cmd->kind == RS_KIND_SELFCOPY) {
+            ncopy++;
+        } else if (cmd->kind != RS_KIND_WINDOW) {
+            break;
+        }
+    }
+    if (rs_cmdscan_failed(sc) && result == RS_DONE) {
+        rs_error("error reading delta from fd%d: %s", delta_fd,
+                 strerror(errno));
+        result = RS_IO_ERROR;
+    }
+    rs_cmdscan_free(sc);
+    if (result != RS_DONE || !ip->nsrc)
+        return result;
+
+    /* merge overlapping parts, keeping the later of their last reads */
+    qsort(ip->src, ip->nsrc, sizeof *ip->src, rs_inplace_src_cmp);
+    for (m = ip->src, k = 1; k < ip->nsrc; k++) {
+        r = &ip->src[k];
+        if (r->pos < m->pos + m->len) {
+            if (r->pos + r->len > m->pos + m->len)
+                m->len = r->pos + r->len - m->pos;
+            if (r->last > m->last)
+                m->last = r->last;
+        } else {
+            *++m = *r;
+        }
+    }
+    ip->nsrc = m - ip->src + 1;
+    rs_trace("delta reads " PRINTF_FORMAT_U64 " parts of the basis in "
+             PRINTF_FORMAT_U64 " COPY commands",
+             PRINTF_CAST_U64(ip->nsrc), PRINTF_CAST_U64(ncopy));
+    return RS_DONE;
+}
+
+
+/*
+ * Before output is written over \p len bytes at \p pos, save the old
+ * data there that COPY commands from the one being run on still read.
+ */
+static rs_result rs_inplace_save(rs_job_t *job, rs_inplace_t *ip,
+                                 rs_long_t pos, rs_long_t len)
+{
+    rs_long_t           cur = job->stats.copy_cmds - 1, s, e;
+    rs_inplace_src_t    *r;
+    rs_inplace_saved_t  *sv;
+    rs_result           result;
+    size_t              i, n, got;
+
+    while (ip->next_src < ip->nsrc
+           && ip->src[ip->next_src].pos + ip->src[ip->next_src].len <= pos)
+        ip->next_src++;
+    for (i = ip->next_src; i < ip->nsrc && ip->src[i].pos < pos + len; i++) {
+        r = &ip->src[i];
+        if (r->last < cur)
+            continue;
+        s = r->pos > pos ? r->pos : pos;
+        e = r->pos + r->len < pos + len ? r->pos + r->len : pos + len;
+
+        if (!ip->spill) {
+            if (!(ip->spill = tmpfile())) {
+                rs_error("can't make a temporary file for the basis: %s",
+                         strerror(errno));
+                return RS_IO_ERROR;
+            }
+            ip->save_buf = rs_alloc(RS_INPLACE_CHUNK, "in-place save buffer");
+        }
+        result = rs_inplace_grow((void **) &ip->saved, &ip->saved_alloc,
+                                 ip->nsaved, sizeof *ip->saved);
+        if (result != RS_DONE)
+            return result;
+        sv = &ip->saved[ip->nsaved++];
+        sv->pos = s;
+        sv->len = 0;
+        sv->off = ip->spill_len;
+        for (; s < e; s += got) {
+            n = e - s < RS_INPLACE_CHUNK ? e - s : RS_INPLACE_CHUNK;
+            if ((result = rs_inplace_pread(ip->fd, ip->save_buf, n, s, &got))
+                != RS_DONE)
+                return result;
+            if (!got)
+                break;
+            if ((result = rs_inplace_pwrite(fileno(ip->spill), ip->save_buf,
+                                            got, ip->spill_len)) != RS_DONE)
+                return result;
+            ip->spill_len += got;
+            sv->len += got;
+        }
+        rs_trace("saved " PRINTF_FORMAT_U64 " bytes of the basis at "
+                 PRINTF_FORMAT_U64, PRINTF_CAST_U64(sv->len),
+                 PRINTF_CAST_U64(sv->pos));
+    }
+    return RS_DONE;
+}
+
+
+/* Write \p len bytes of output at the output position. */
+static rs_result rs_inplace_write(rs_job_t *job, rs_inplace_t *ip,
+                                  void const *p, size_t len)
+{
+    rs_result           result;
+
+    if ((result = rs_inplace_save(job, ip, ip->out, len)) != RS_DONE)
+        return result;
+    if ((result = rs_inplace_pwrite(ip->fd, p, len, ip->out)) != RS_DONE)
+        return result;
+    ip->out += len;
+    job->stats.out_bytes += len;
+    return RS_DONE;
+}
+
+
+/*
+ * Read up to \p len bytes of the old basis at \p pos, from the spill file
+ * where it has been saved and otherwise from the basis itself.
+ */
+static rs_result rs_inplace_read(rs_inplace_t *ip, rs_long_t pos,
+                                 size_t len, rs_byte_t *p, size_t *got)
+{
+    rs_inplace_saved_t  *sv;
+    rs_result           result;
+    size_t              lo, hi, mid, n, part;
+    rs_long_t           at;
+
+    *got = 0;
+    if (pos >= ip->size)
+        return RS_DONE;
+    if ((rs_long_t) len > ip->size - pos)
+        len = ip->size - pos;
+    while (*got < len) {
+        at = pos + *got;
+        n = len - *got;
+        /* the first saved part that ends after at */
+        for (lo = 0, hi = ip->nsaved; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (ip->saved[mid].pos + ip->saved[mid].len <= at)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        sv = lo < ip->nsaved ? &ip->saved[lo] : NULL;
+        if (sv && sv->pos <= at) {
+            if ((rs_long_t) n > sv->pos + sv->len - at)
+                n = sv->pos + sv->len - at;
+            result = rs_inplace_pread(fileno(ip->spill), p + *got, n,
+                                      sv->off + (at - sv->pos), &part);
+        } else {
+            if (sv && (rs_long_t) n > sv->pos - at)
+                n = sv->pos - at;
+            result = rs_inplace_pread(ip->fd, p + *got, n, at, &part);
+        }
+        if (result != RS_DONE)
+            return result;
+        *got += part;
+        if (part < n)
+            break;
+    }
+    return RS_DONE;
+}
+
+
+static rs_result rs_inplace_drain(rs_job_t *job, rs_buffers_t *buf,
+                                  void *arg)
+{
+    rs_inplace_t        *ip = (rs_inplace_t *) arg;
+    rs_result           result;
+
+    if (buf->next_out && buf->next_out > (char *) ip->buf) {
+        result = rs_inplace_write(job, ip, ip->buf,
+                                  buf->next_out - (char *) ip->buf);
+        if (result != RS_DONE)
+            return result;
+    }
+    buf->next_out = (char *) ip->buf;
+    buf->avail_out = ip->buf_len;
+    return RS_DONE;
+}
+
+
+static rs_result rs_inplace_copy_cb(void *arg, rs_long_t pos, size_t *len,
+                                    void **buf)
+{
+    rs_inplace_t        *ip = (rs_inplace_t *) arg;
+    rs_result           result;
+    size_t              got;
+
+    if ((result = rs_inplace_read(ip, pos, *len, *buf, &got)) != RS_DONE)
+        return result;
+    if (!got) {
+        rs_error("unexpected eof in basis at " PRINTF_FORMAT_U64,
+                 PRINTF_CAST_U64(pos));
+        return RS_INPUT_ENDED;
+    }
+    *len = got;
+    return RS_DONE;
+}
+
+
+/*
+ * Copy a COPY command's data ourselves, or skip it if it is already
+ * where it belongs.
+ */
+static rs_result rs_inplace_copy_direct(rs_job_t *job, void *arg,
+                                        rs_long_t pos, rs_long_t *len)
+{
+    rs_inplace_t        *ip = (rs_inplace_t *) arg;
+    rs_result           result;
+    rs_long_t           done;
+    size_t              n, got;
+
+    if ((result = rs_inplace_drain(job, job->stream, ip)) != RS_DONE)
+        return result;
+
+    if (pos == ip->out && *len <= ip->size - pos) {
+        rs_trace("skip COPY of " PRINTF_FORMAT_U64 " bytes already at "
+                 PRINTF_FORMAT_U64, PRINTF_CAST_U64(*len),
+                 PRINTF_CAST_U64(pos));
+        ip->out += *len;
+        return RS_DONE;
+    }
+
+    if (!ip->copy_buf)
+        ip->copy_buf = rs_alloc(RS_INPLACE_CHUNK, "in-place copy buffer");
+    for (done = 0; done < *len; done += got) {
+        n = *len - done < RS_INPLACE_CHUNK ? *len - done : RS_INPLACE_CHUNK;
+        result = rs_inplace_read(ip, pos + done, n, ip->copy_buf, &got);
+        if (result != RS_DONE)
+            return result;
+        if (!got)
+            break;
+        if ((result = rs_inplace_write(job, ip, ip->copy_buf, got))
+            != RS_DONE)
+            return result;
+    }
+    *len = done;
+    return RS_DONE;
+}
+
+
+rs_result
+rs_patch_inplace_fd(int basis_fd, int delta_fd, rs_stats_t *stats)
+{
+    rs_inplace_t        ip;
+    rs_job_t            *job;
+    rs_buffers_t        buf;
+    rs_filemap_t        *delta_fm = NULL;
+    rs_filebuf_t        *delta_fb = NULL;
+    struct stat         st;
+    off_t               start;
+    rs_result           r;
+
+    rs_bzero(&ip, sizeof ip);
+    if (fstat(basis_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        rs_error("in-place patch needs a regular basis file");
+        return RS_PARAM_ERROR;
+    }
+    if ((start = lseek(delta_fd, 0, SEEK_CUR)) < 0) {
+        rs_error("in-place patch needs a delta file it can read twice");
+        return RS_PARAM_ERROR;
+    }
+    ip.fd = basis_fd;
+    ip.size = st.st_size;
+
+    r = rs_inplace_plan(&ip, delta_fd);
+    if (r == RS_DONE && lseek(delta_fd, start, SEEK_SET) < 0) {
+        rs_error("seek failed on fd%d: %s", delta_fd, strerror(errno));
+        r = RS_IO_ERROR;
+    }
+    if (r != RS_DONE) {
+        free(ip.src);
+        return r;
+    }
+
+    job = rs_patch_begin(rs_inplace_copy_cb, &ip);
+    job->copy_direct_cb = rs_inplace_copy_direct;
+    job->copy_direct_arg = &ip;
+    job->copy_direct_min = 1;
+    rs_patch_set_prefetch(job, rs_fd_prefetch_cb, &ip.fd);
+
+    ip.buf_len = rs_outbuflen;
+    ip.buf = rs_alloc(ip.buf_len, "in-place output buffer");
+    if (!(delta_fm = rs_filemap_new_fd(delta_fd)))
+        delta_fb = rs_fdbuf_new(delta_fd, rs_inbuflen);
+    if (delta_fm)
+        r = rs_job_drive(job, &buf, rs_inmapbuf_fill, delta_fm,
+                         rs_inplace_drain, &ip);
+    else
+        r = rs_job_drive(job, &buf, rs_infdbuf_fill, delta_fb,
+                         rs_inplace_drain, &ip);
+
+    if (r == RS_DONE && ip.out < ip.size && ftruncate(basis_fd, ip.out) < 0) {
+        rs_error("can't truncate fd%d: %s", basis_fd, strerror(errno));
+        r = RS_IO_ERROR;
+    }
+    rs_trace("saved " PRINTF_FORMAT_U64 " bytes of the basis while patching",
+             PRINTF_CAST_U64(ip.spill_len));
+
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+    if (delta_fm)
+        rs_filemap_free(delta_fm);
+    if (delta_fb)
+        rs_filebuf_free(delta_fb);
+    if (ip.spill)
+        fclose(ip.spill);
+    free(ip.src);
+    free(ip.saved);
+    free(ip.buf);
+    free(ip.copy_buf);
+    free(ip.save_buf);
+
+    return r;
+}
+
+#else /* HAVE_UNISTD_H && HAVE_PREAD */
+
+rs_result
+rs_patch_inplace_fd(int basis_fd, int delta_fd, rs_stats_t *stats)
+{
+    rs_error("built without positioned file IO");
+    return RS_UNIMPLEMENTED;
+}
+
+#endif /* HAVE_UNISTD_H && HAVE_PREAD */
+
+
+rs_result
+rs_patch_inplace_file(FILE *basis_file, FILE *delta_file, rs_stats_t *stats)
+{
+    /* have the descriptors' positions match the streams' */
+    fflush(basis_file);
+    fflush(delta_file);
+    return rs_patch_inplace_fd(fileno(basis_file), fileno(delta_file), stats);
+}
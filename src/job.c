@@ -55,6 +55,7 @@
 #include "sumset.h"
 #include "job.h"
 #include "trace.h"
+#include "compress.h"
 
 
 static const int rs_job_tag = 20010225;
@@ -91,6 +92,18 @@ rs_result rs_job_free(rs_job_t *job)
 {
     if (job->scoop_buf)
             free(job->scoop_buf);
+    if (job->sig_threads)
+        rs_sig_threads_free(job->sig_threads);
+    if (job->delta_threads)
+        rs_delta_threads_free(job->delta_threads);
+    if (job->compress)
+        rs_compress_free(job->compress);
+    if (job->delta_self)
+        rs_delta_self_free(job->delta_self);
+    if (job->patch_window)
+        rs_patch_window_free(job->patch_window);
+    if (job->copy_batch)
+        rs_patch_batch_free(job->copy_batch);
 
     rs_bzero(job, sizeof *job);
     free(job);
@@ -139,10 +152,11 @@ rs_result rs_job_iter(rs_job_t *job, rs_buffers_t *buffers)
     orig_out = buffers->avail_out;
 
     result = rs_job_work(job, buffers);
+    rs_scoop_release(job);
 
     if (result == RS_BLOCKED  ||  result == RS_DONE)
         if ((orig_in == buffers->avail_in)  &&  (orig_out == buffers->avail_out)
-            && orig_in && orig_out) {
+            && orig_in && orig_out && !job->copy_blocked) {
             rs_log(RS_LOG_ERR, "internal error: job made no progress "
                    "[orig_in=" PRINTF_FORMAT_U64 ", orig_out=" PRINTF_FORMAT_U64 ", final_in=" PRINTF_FORMAT_U64 ", final_out=" PRINTF_FORMAT_U64 "]",
                    PRINTF_CAST_U64(orig_in), PRINTF_CAST_U64(orig_out), PRINTF_CAST_U64(buffers->avail_in),
@@ -21,6 +21,7 @@
 
 #include "mdfour.h"
 #include "rollsum.h"
+#include "checksum.h"
 
 /**
  * \struct rs_job
@@ -55,6 +56,9 @@ struct rs_job {
 
     /** The weak signature digest used by readsums.c */
     rs_weak_sum_t       weak_sig;
+
+    /** Expected length of the signature being loaded, or 0. */
+    rs_long_t           sig_len_hint;
     
     /** The rollsum weak signature accumulator used by delta.c */
     Rollsum             weak_sum;
@@ -78,6 +82,13 @@ struct rs_job {
     size_t      scoop_alloc;           /* the allocation size */
     size_t      scoop_avail;           /* the data size */
     size_t      scoop_pos;             /* the scan position */
+
+    /** If \p scoop_borrowed is set, scoop_next points into the caller's
+     * input buffer rather than scoop_buf, until rs_scoop_release().  If
+     * \p scoop_mirror is set, the scoop from there on is a copy of the
+     * input just before stream->next_in.  */
+    int         scoop_borrowed;
+    rs_byte_t   *scoop_mirror;
         
     /** If USED is >0, then buf contains that much write data to
      * be sent out. */
@@ -85,8 +96,9 @@ struct rs_job {
     int         write_len;
 
     /** If \p copy_len is >0, then that much data should be copied
-     * through from the input. */
+     * through from the input, or from \p copy_buf if that is set. */
     rs_long_t   copy_len;
+    rs_byte_t const *copy_buf;
 
     /** Copy from the basis position. */
     rs_long_t       basis_pos, basis_len;
@@ -95,7 +107,48 @@ struct rs_job {
     rs_copy_cb      *copy_cb;
     void            *copy_arg;
 
+    /** The basis data for a patch that reads it in batches, and whether
+     * the batch callback said the next part of it isn't ready. */
+    struct rs_patch_batch *copy_batch;
+    int             copy_blocked;
+
+    /** If set, a patch calls this for long COPY commands to have the
+     * basis data put straight into the output without going through
+     * the buffer, if they are at least \p copy_direct_min long.  It
+     * works like rs_outfdbuf_copy_fd(). */
+    rs_result       (*copy_direct_cb)(rs_job_t *, void *arg, rs_long_t pos,
+                                      rs_long_t *len);
+    void            *copy_direct_arg;
+    rs_long_t       copy_direct_min;
+
+    /** Callback told about COPY commands a patch will run soon, and how
+     * many commands from the next one on it has been told about. */
+    rs_prefetch_cb  *prefetch_cb;
+    void            *prefetch_arg;
+    int             prefetch_cmds;
+
     int             magic;
+
+    /** Sums of a batch of blocks hashed together by mksum.c, waiting
+     * to be sent out one at a time. */
+    rs_weak_sum_t   sig_weak[RS_MAX_SUM_LANES];
+    rs_strong_sum_t sig_strong[RS_MAX_SUM_LANES];
+    int             sig_batch_len, sig_batch_pos;
+
+    /** State of threaded signature generation, if it was asked for. */
+    struct rs_sig_threads *sig_threads;
+
+    /** State of threaded delta generation, if it was asked for. */
+    struct rs_delta_threads *delta_threads;
+
+    /** Compression of the literal data, if the delta format has it. */
+    struct rs_compress *compress;
+
+    /** Index of the new file for self copies, if they were asked for. */
+    struct rs_delta_self *delta_self;
+
+    /** The last of the output of a patch with self copies. */
+    struct rs_patch_window *patch_window;
 };
 
 
@@ -103,4 +156,10 @@ rs_job_t * rs_job_new(const char *, rs_result (*statefn)(rs_job_t *));
 
 void rs_job_check(rs_job_t *job);
 
+void rs_sig_threads_free(struct rs_sig_threads *);
+void rs_delta_threads_free(struct rs_delta_threads *);
+void rs_delta_self_free(struct rs_delta_self *);
+void rs_patch_window_free(struct rs_patch_window *);
+void rs_patch_batch_free(struct rs_patch_batch *);
+
 int rs_job_input_is_ending(rs_job_t *job);
@@ -76,12 +76,39 @@ typedef enum {
     /**
      * A delta file.
      *
-     * At present, there's only one delta format.
-     *
      * The four-byte literal \c "rs\x026".
      **/
     RS_DELTA_MAGIC          = 0x72730236,
 
+    /**
+     * A delta file whose literal data is compressed with zlib.
+     *
+     * The four-byte literal \c "rs\x02Z".
+     *
+     * \see rs_delta_set_format()
+     **/
+    RS_DELTA_ZLIB_MAGIC     = 0x7273025a,
+
+    /**
+     * A delta file whose literal data is compressed with zlib, primed with
+     * the data of the COPY commands before it, so that literal data that
+     * resembles nearby matched data compresses better.
+     *
+     * The four-byte literal \c "rs\x02z".
+     *
+     * \see rs_delta_set_format()
+     **/
+    RS_DELTA_ZLIB_PRIMED_MAGIC = 0x7273027a,
+
+    /**
+     * A delta file whose literal data is compressed with bzip2.
+     *
+     * The four-byte literal \c "rs\x02B".
+     *
+     * \see rs_delta_set_format()
+     **/
+    RS_DELTA_BZIP2_MAGIC    = 0x72730242,
+
     /**
      * A signature file with MD4 signatures.
      *
@@ -485,14 +512,100 @@ rs_job_t *rs_sig_begin(size_t new_block_len,
                        size_t strong_sum_len,
                        rs_magic_number sig_magic);
 
+/**
+ * \brief Start generating a signature, hashing the blocks on several
+ * threads.
+ *
+ * This is the same as rs_sig_begin(), and the signature is exactly the
+ * same, but the input is gathered into batches which are split between
+ * \p threads threads, including the one calling rs_job_iter().  The
+ * sums are still written out in order.  A batch takes a few megabytes
+ * per thread at most, less if the whole input is small and given to the
+ * job at once, and no more than 64 threads are used.
+ *
+ * If \p threads is less than 2, or the library was built without thread
+ * support, this just calls rs_sig_begin().
+ *
+ * \sa rs_sig_file_threads()
+ */
+rs_job_t *rs_sig_begin_threads(size_t new_block_len,
+                               size_t strong_sum_len,
+                               rs_magic_number sig_magic,
+                               int threads);
+
 /**
  * Prepare to compute a streaming delta.
  *
- * \todo Add a version of this that takes a ::rs_magic_number controlling the
- * delta format.
+ * \sa rs_delta_set_format()
  **/
 rs_job_t *rs_delta_begin(rs_signature_t *);
 
+/**
+ * \brief Choose the format of the delta made by a job.
+ *
+ * Call this after starting the job with one of the rs_delta_begin()
+ * functions, and before the first rs_job_iter().
+ *
+ * \param format ::RS_DELTA_MAGIC for the plain format, or
+ * ::RS_DELTA_ZLIB_MAGIC, ::RS_DELTA_ZLIB_PRIMED_MAGIC or
+ * ::RS_DELTA_BZIP2_MAGIC to compress the literal data.  The patch job recognizes the format by itself.
+ *
+ * \param level The zlib compression level, or the bzip2 block size in
+ * 100kB; 0 for the default.
+ *
+ * \return RS_UNIMPLEMENTED if the library was built without that kind of
+ * compression.
+ */
+rs_result rs_delta_set_format(rs_job_t *, rs_magic_number format, int level);
+
+/** Default window for self copies in rdiff, in bytes. */
+#define RS_DEFAULT_SELF_WINDOW (64 << 20)
+
+/** Largest window for self copies, in bytes, that a patch will accept. */
+#define RS_MAX_SELF_WINDOW (1 << 30)
+
+/**
+ * \brief Let a delta copy data from earlier in the new file.
+ *
+ * Blocks of the new file that repeat an earlier block of it, up to
+ * \p window bytes back, are sent as copies from the output that the patch
+ * has already written, rather than as literal data.  This deduplicates
+ * new files even where the basis has nothing in common with them.
+ *
+ * The patch keeps the last \p window bytes of its output in memory, and
+ * the delta keeps an index of the whole new file, like a signature of it.
+ * The new file is scanned in one thread.  Older versions of librsync can't
+ * apply these deltas.
+ *
+ * Call this after starting the job with one of the rs_delta_begin()
+ * functions, and before the first rs_job_iter().
+ *
+ * \return RS_PARAM_ERROR if \p window is not between 1 and
+ * ::RS_MAX_SELF_WINDOW.
+ */
+rs_result rs_delta_set_self_copy(rs_job_t *, rs_long_t window);
+
+/**
+ * \brief Start computing a delta, scanning the new file on several
+ * threads.
+ *
+ * This is like rs_delta_begin(), but the new file is gathered into
+ * batches, and each batch is split into segments that are scanned at
+ * the same time by \p threads threads, including the one calling
+ * rs_job_iter().  Matches that cross from one segment into the next are
+ * still found.  The delta is valid and usually the same as from
+ * rs_delta_begin(), but may differ a little where segments meet.  A
+ * batch takes a few megabytes per thread at most, less if the whole
+ * input is small and given to the job at once, and no more than 64
+ * threads are used.
+ *
+ * If \p threads is less than 2, or the library was built without thread
+ * support, this just calls rs_delta_begin().
+ *
+ * \sa rs_delta_file_threads()
+ */
+rs_job_t *rs_delta_begin_threads(rs_signature_t *, int threads);
+
 
 /**
  * \brief Read a signature from a file into an ::rs_signature structure
@@ -501,14 +614,33 @@ rs_job_t *rs_delta_begin(rs_signature_t *);
  * Once there, it can be used to generate a delta to a newer version of
  * the file.
  *
- * \note After loading the signatures, you must call
- * \ref rs_build_hash_table() before you can use them.
+ * The blocks are added to the signature's search index as they are read,
+ * so it is ready for rs_delta_begin() as soon as the job is done.
  */
 rs_job_t *rs_loadsig_begin(rs_signature_t **);
 
 
 /**
- * Call this after loading a signature to index it.
+ * \brief Tell a signature loading job how long the signature is.
+ *
+ * \p sig_len is the number of bytes of signature still to be read,
+ * including its header.  The job then allocates room for the blocks in
+ * fewer, larger steps, and ends up with arrays of just the right size.
+ * It is only a hint: if it is wrong the signature is still loaded
+ * correctly, and a hint that is too big can't make the job allocate
+ * much more than the blocks need.
+ *
+ * rs_loadsig_file() and rs_loadsig_fd() do this themselves when the
+ * signature is in a regular file.
+ */
+void rs_loadsig_set_size(rs_job_t *job, rs_long_t sig_len);
+
+
+/**
+ * Index a signature for searching.
+ *
+ * Signatures loaded by rs_loadsig_begin() are already indexed, so this
+ * does nothing for them, but it is still safe to call.
  *
  * Use rs_free_sumset() to release it after use.
  */
@@ -532,6 +664,65 @@ typedef rs_result rs_copy_cb(void *opaque, rs_long_t pos,
                              size_t *len, void **buf);
 
 
+/**
+ * \brief A part of the basis file wanted by a patch, in a batch for a
+ * ::rs_copy_batch_cb.
+ */
+typedef struct rs_copy_extent {
+    rs_long_t   pos;            /**< Position of the data in the basis. */
+    size_t      len;            /**< Length of the data. */
+    void        *buf;           /**< Buffer of \p len bytes for the data.
+                                 * The callback may point this at its own
+                                 * copy instead, which must stay there
+                                 * until the next batch. */
+    int         done;           /**< Set by the callback once the data is
+                                 * there. */
+} rs_copy_extent_t;
+
+
+/**
+ * \brief Callback used to retrieve a batch of parts of the basis file.
+ *
+ * The patch hands over the parts of the basis that its next COPY
+ * commands need, in the order it will use them.  The callback may fetch
+ * them in any order, or all at once, and sets \p done on each extent as
+ * its data arrives.  It is called again whenever the patch needs an
+ * extent that isn't done yet, with the extents from that one on; some of
+ * the later ones may be done already.  Once the patch moves on to a new
+ * batch, the old one is not used again.
+ *
+ * \param extents The extents, of which the first is needed now.
+ *
+ * \param count How many extents there are.
+ *
+ * \return RS_DONE if the first extent is done, RS_BLOCKED if it isn't
+ * ready yet, or an error such as RS_INPUT_ENDED if the basis is too
+ * short.
+ */
+typedef rs_result rs_copy_batch_cb(void *opaque, rs_copy_extent_t *extents,
+                                   int count);
+
+
+/**
+ * \brief Start computing a delta, reading the basis to make the matches
+ * longer.
+ *
+ * This is like rs_delta_begin(), but whenever a block matches, the
+ * match is extended byte by byte over the data on either side of it that
+ * is the same in the basis, which is read through \p copy_cb.  This
+ * makes less literal data around small changes.
+ *
+ * \param copy_cb Callback used to read the basis file; it must be the
+ * file the signature was made from.
+ *
+ * \param copy_arg Opaque environment pointer passed through to the
+ * callback.
+ *
+ * \sa rs_delta_file_basis()
+ */
+rs_job_t *rs_delta_begin_basis(rs_signature_t *, rs_copy_cb *copy_cb,
+                               void *copy_arg);
+
 
 /**
  * \brief Apply a \a delta to a \a basis file to recreate
@@ -559,6 +750,52 @@ typedef rs_result rs_copy_cb(void *opaque, rs_long_t pos,
 rs_job_t *rs_patch_begin(rs_copy_cb *copy_cb, void *copy_arg);
 
 
+/**
+ * \brief Start applying a delta, reading the basis a batch at a time.
+ *
+ * This is like rs_patch_begin(), but the basis is read through \p
+ * copy_batch_cb.  When it reaches a COPY command, the patch looks ahead
+ * in the delta input it already has.  It then asks for up to 64 parts of
+ * the basis, or 1MB of data, at once.  So the application can merge,
+ * reorder or overlap the reads.
+ *
+ * While the callback says the data isn't ready, rs_job_iter() returns
+ * RS_BLOCKED without taking any input or making any output.
+ *
+ * \sa rs_fd_copy_batch_cb()
+ */
+rs_job_t *rs_patch_begin_batch(rs_copy_batch_cb *copy_batch_cb,
+                               void *copy_arg);
+
+
+/**
+ * \brief Callback told which parts of the basis file a patch is going
+ * to copy soon.
+ *
+ * This is only a hint, to start reading the data into cache before the
+ * ::rs_copy_cb asks for it; the callback should not wait for the data.
+ *
+ * \param pos Position of the data in the basis.
+ *
+ * \param len Length of the data.
+ */
+typedef void rs_prefetch_cb(void *opaque, rs_long_t pos, rs_long_t len);
+
+
+/**
+ * Make a patch job look ahead in the delta for COPY commands.
+ *
+ * Whenever the job starts on a command, it parses ahead through the
+ * delta input it has been given so far, and passes the COPY commands it
+ * hasn't already seen to \p prefetch_cb, keeping up to a few dozen
+ * commands or some megabytes of basis data ahead.
+ *
+ * \sa rs_fd_prefetch_cb()
+ */
+void rs_patch_set_prefetch(rs_job_t *job, rs_prefetch_cb *prefetch_cb,
+                           void *prefetch_arg);
+
+
 #ifndef RSYNC_NO_STDIO_INTERFACE
 #include <stdio.h>
 
@@ -569,6 +806,14 @@ rs_job_t *rs_patch_begin(rs_copy_cb *copy_cb, void *copy_arg);
  */
 extern int rs_inbuflen, rs_outbuflen;
 
+/**
+ * If set, which it is by default, regular files given as input to the
+ * whole-file functions are mapped into memory and read in place, rather
+ * than through a buffer of ::rs_inbuflen.  Basis files are read through
+ * the map too.
+ */
+extern int rs_map_input;
+
 
 /**
  * Generate the signature of a basis file, and write it out to
@@ -594,6 +839,16 @@ rs_result rs_sig_file(FILE *old_file, FILE *sig_file,
               rs_magic_number sig_magic,
               rs_stats_t *stats);
 
+/**
+ * Generate the signature of a basis file using several threads.
+ *
+ * \sa rs_sig_begin_threads(), rs_sig_file()
+ */
+rs_result rs_sig_file_threads(FILE *old_file, FILE *sig_file,
+                              size_t block_len, size_t strong_len,
+                              rs_magic_number sig_magic, int threads,
+                              rs_stats_t *stats);
+
 /**
  * Load signatures from a signature file into memory.  Return a
  * pointer to the newly allocated structure in \p sumset.
@@ -615,14 +870,147 @@ rs_result rs_file_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf);
  **/
 rs_result rs_delta_file(rs_signature_t *, FILE *new_file, FILE *delta_file, rs_stats_t *);
 
+/**
+ * Generate a delta, reading the basis file to extend the matches.
+ *
+ * \sa rs_delta_begin_basis(), rs_delta_file()
+ */
+rs_result rs_delta_file_basis(rs_signature_t *, FILE *basis_file,
+                              FILE *new_file, FILE *delta_file,
+                              rs_stats_t *);
+
+/**
+ * Generate a delta using several threads.
+ *
+ * \sa rs_delta_begin_threads(), rs_delta_file()
+ */
+rs_result rs_delta_file_threads(rs_signature_t *, FILE *new_file,
+                                FILE *delta_file, int threads,
+                                rs_stats_t *);
+
 
 /**
  * Apply a patch, relative to a basis, into a new file.
  * \sa \ref api_whole
  */
 rs_result rs_patch_file(FILE *basis_file, FILE *delta_file, FILE *new_file, rs_stats_t *);
+
+/**
+ * Like rs_patch_inplace_fd(), for stdio files.
+ */
+rs_result rs_patch_inplace_file(FILE *basis_file, FILE *delta_file,
+                                rs_stats_t *);
 #endif /* ! RSYNC_NO_STDIO_INTERFACE */
 
+
+/**
+ * Generate the signature of a basis file, like rs_sig_file() but
+ * reading and writing file descriptors.
+ *
+ * These functions use read() and write() rather than stdio.  Regular
+ * input files are mapped into memory if ::rs_map_input is set, as with
+ * the stdio functions.  They return RS_UNIMPLEMENTED on systems without
+ * POSIX file IO.
+ *
+ * \sa \ref api_whole
+ */
+rs_result rs_sig_fd(int old_fd, int sig_fd, size_t block_len,
+                    size_t strong_len, rs_magic_number sig_magic,
+                    rs_stats_t *stats);
+
+/**
+ * Load signatures from a file descriptor, like rs_loadsig_file().
+ */
+rs_result rs_loadsig_fd(int sig_fd, rs_signature_t **sumset,
+                        rs_stats_t *stats);
+
+/**
+ * Generate a delta into a file descriptor, like rs_delta_file().
+ */
+rs_result rs_delta_fd(rs_signature_t *, int new_fd, int delta_fd,
+                      rs_stats_t *);
+
+/**
+ * Apply a patch into a file descriptor, like rs_patch_file().
+ *
+ * The basis is read with pread(), which doesn't move its file position,
+ * so several patch jobs can share one basis descriptor.  The job looks
+ * ahead in the delta to have the basis read ahead of the COPY commands.
+ *
+ * When the basis and the new file are both regular files, long COPY
+ * commands are done with copy_file_range() where the system has it, so
+ * the data doesn't pass through user space and filesystems that can
+ * share extents between files needn't copy it at all.  Otherwise they
+ * are copied through the output buffer as usual.
+ */
+rs_result rs_patch_fd(int basis_fd, int delta_fd, int new_fd,
+                      rs_stats_t *);
+
+/**
+ * Apply a patch into a file descriptor using several threads.
+ *
+ * The delta's commands are read first to work out where each one's
+ * output goes, and then \p threads threads each read the basis and the
+ * literal data and write parts of the new file independently, with
+ * pread() and pwrite().  The new file is the same as rs_patch_fd() would
+ * make.
+ *
+ * This needs the basis, delta and new file to all be regular files, and
+ * a delta without compression or self copies.  Otherwise, or if \p
+ * threads is less than 2 or the library was built without thread
+ * support, this just calls rs_patch_fd().
+ *
+ * \sa rs_patch_fd()
+ */
+rs_result rs_patch_fd_threads(int basis_fd, int delta_fd, int new_fd,
+                              int threads, rs_stats_t *);
+
+/**
+ * Apply a patch by rewriting the basis file, rather than making a new one.
+ *
+ * Output is written over the basis with pwrite() from the start, and
+ * the file is truncated to the new length at the end.  COPY commands
+ * whose data is already where it belongs are skipped, so when most of
+ * the file is unchanged little is read or written.  Before the patch
+ * runs, the delta is scanned for the parts of the basis that COPY
+ * commands read; any of them that are overwritten before they are read
+ * are saved to a temporary file first.
+ *
+ * The basis must be a regular file open for reading and writing, and
+ * the delta must be seekable since it is read twice.  If the patch fails
+ * part way, the basis is left partly rewritten.
+ *
+ * \sa rs_patch_inplace_file()
+ */
+rs_result rs_patch_inplace_fd(int basis_fd, int delta_fd, rs_stats_t *);
+
+/**
+ * ::rs_copy_cb that reads from a file descriptor with pread().
+ *
+ * \p arg points to an int holding the descriptor.  The file position is
+ * not used or changed, so the descriptor can be shared between jobs and
+ * threads.
+ */
+rs_result rs_fd_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf);
+
+/**
+ * ::rs_copy_batch_cb that reads from a file descriptor with pread(),
+ * one extent after another, after asking the kernel to read ahead all of
+ * them.
+ *
+ * \p arg points to an int holding the descriptor.
+ */
+rs_result rs_fd_copy_batch_cb(void *arg, rs_copy_extent_t *extents,
+                              int count);
+
+/**
+ * ::rs_prefetch_cb that asks the kernel to read ahead from a file
+ * descriptor with posix_fadvise(), where that is available.
+ *
+ * \p arg points to an int holding the descriptor.
+ */
+void rs_fd_prefetch_cb(void *arg, rs_long_t pos, rs_long_t len);
+
 #ifdef __cplusplus
 }
 #endif
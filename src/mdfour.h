@@ -35,3 +35,12 @@ struct rs_mdfour {
     int                 tail_len;
     unsigned char       tail[64];
 };
+
+#ifdef HAVE_X86_SIMD
+/* The MD4 sums of several messages of the same length at once; see
+ * mdfour-x86.c. */
+void rs_mdfour_x4_sse2(unsigned char *const out[4], void const *const in[4],
+                       size_t n);
+void rs_mdfour_x8_avx2(unsigned char *const out[8], void const *const in[8],
+                       size_t n);
+#endif
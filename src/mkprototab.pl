@@ -121,6 +121,16 @@ foreach $i (@int_lens) {
   }
 }
 
+foreach $i (@int_lens) {
+  emit_cmd('WINDOW', 0, $i);
+}
+
+foreach $i (@int_lens) {
+  foreach $j (@int_lens) {
+    emit_cmd('SELFCOPY', 0, $i, $j);
+  }
+}
+
 emit_cmd('RESERVED', $cmd_byte, 0, 0) while $cmd_byte <= 255;
 
 
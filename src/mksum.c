@@ -41,6 +41,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #include "librsync.h"
@@ -51,11 +52,57 @@
 #include "netint.h"
 #include "trace.h"
 #include "checksum.h"
+#include "workers.h"
 
 
 /* Possible state functions for signature generation. */
 static rs_result rs_sig_s_header(rs_job_t *);
 static rs_result rs_sig_s_generate(rs_job_t *);
+static rs_result rs_sig_s_send_batch(rs_job_t *);
+static rs_result rs_sig_s_generate_threads(rs_job_t *);
+
+
+/* Roughly how much of the input, and of the sums, to hand to each thread
+ * at a time, and how many tasks to split that into.  Tasks are made big
+ * enough to fill the SIMD lanes, but not so big that a batch takes more
+ * than RS_SIG_THREAD_MAX_BYTES per thread. */
+#define RS_SIG_THREAD_BYTES     (1 << 20)
+#define RS_SIG_THREAD_MAX_BYTES (4 << 20)
+#define RS_SIG_THREAD_TASKS     4
+
+/* Most threads to hash a signature with; more wouldn't be any faster. */
+#define RS_SIG_MAX_THREADS      64
+
+/** \private
+ * A batch of input being hashed by the worker threads, along with its
+ * sums.
+ */
+typedef struct rs_sig_batch {
+    struct rs_sig_threads *threads;
+    rs_byte_t           *buf;
+    size_t              len;            /* bytes of input in buf */
+    int                 nblocks;
+    int                 complete;       /* full, or the input ended */
+    rs_weak_sum_t       *weak;
+    rs_strong_sum_t     *strong;
+} rs_sig_batch_t;
+
+/** \private
+ * State of threaded signature generation.  One batch is filled from the
+ * input while the other is hashed by the workers; then the hashed batch
+ * is sent out in block order while the workers start on the filled one.
+ */
+struct rs_sig_threads {
+    rs_workers_t        *workers;
+    int                 magic;
+    size_t              block_len;
+    int                 nthreads;
+    int                 batch_blocks;   /* most blocks in a batch */
+    int                 task_blocks;    /* blocks per task */
+    rs_sig_batch_t      batch[2];
+    rs_sig_batch_t      *filling, *hashing, *sending;
+    int                 send_pos;
+};
 
 
                                            
@@ -72,11 +119,36 @@ static rs_result rs_sig_s_header(rs_job_t *job)
              job->magic, (int) job->block_len, (int) job->strong_sum_len);
     job->stats.block_len = job->block_len;
     
-    job->statefn = rs_sig_s_generate;
+    if (job->sig_threads)
+        job->statefn = rs_sig_s_generate_threads;
+    else
+        job->statefn = rs_sig_s_generate;
     return RS_RUNNING;
 }
 
 
+/**
+ * Write out the checksums for one block.
+ * \private
+ */
+static void
+rs_sig_send_sum(rs_job_t *job, rs_weak_sum_t weak_sum,
+                unsigned char const *strong_sum)
+{
+    rs_squirt_n4(job, weak_sum);
+    rs_tube_write(job, strong_sum, job->strong_sum_len);
+
+    if (rs_trace_enabled()) {
+        char                strong_sum_hex[RS_MAX_STRONG_SUM_LENGTH * 2 + 1];
+        rs_hexify(strong_sum_hex, strong_sum, job->strong_sum_len);
+        rs_trace("sent weak sum 0x%08x and strong sum %s", weak_sum,
+                 strong_sum_hex);
+    }
+
+    job->stats.sig_blocks++;
+}
+
+
 /**
  * Generate the checksums for a block and write it out.  Called when
  * we already know we have enough data in memory at \p block.
@@ -99,17 +171,59 @@ rs_sig_do_block(rs_job_t *job, const void *block, size_t len)
         return RS_INTERNAL_ERROR;
     }
 
-    rs_squirt_n4(job, weak_sum);
-    rs_tube_write(job, strong_sum, job->strong_sum_len);
+    rs_sig_send_sum(job, weak_sum, strong_sum);
 
-    if (rs_trace_enabled()) {
-        char                strong_sum_hex[RS_MAX_STRONG_SUM_LENGTH * 2 + 1];
-        rs_hexify(strong_sum_hex, strong_sum, job->strong_sum_len);
-        rs_trace("sent weak sum 0x%08x and strong sum %s", weak_sum,
-                 strong_sum_hex);
+    return RS_RUNNING;
+}
+
+
+/**
+ * Generate the checksums for \p n whole blocks at \p buf.  The strong
+ * sums are calculated together, so that they can be hashed side by side,
+ * and are then sent out one at a time by rs_sig_s_send_batch().
+ * \private
+ */
+static rs_result
+rs_sig_do_blocks(rs_job_t *job, const void *buf, int n)
+{
+    unsigned char const *block = (unsigned char const *) buf;
+    size_t              len = job->block_len;
+    int                 i;
+
+    for (i = 0; i < n; i++)
+        job->sig_weak[i] = rs_calc_weak_sum(block + i * len, len);
+
+    if (job->magic == RS_BLAKE2_SIG_MAGIC) {
+        rs_calc_blake2_sums(block, len, n, job->sig_strong);
+    } else if(job->magic == RS_MD4_SIG_MAGIC) {
+        rs_calc_md4_sums(block, len, n, job->sig_strong);
+    } else {
+        rs_error("BUG: invalid job magic %#lx", (unsigned long) job->magic);
+        return RS_INTERNAL_ERROR;
     }
 
-    job->stats.sig_blocks++;
+    job->sig_batch_len = n;
+    job->sig_batch_pos = 0;
+    job->statefn = rs_sig_s_send_batch;
+
+    return RS_RUNNING;
+}
+
+
+/**
+ * State of sending out the sums of a batch of blocks.  Only one is sent
+ * each time, because that is all the tube can hold.
+ * \private
+ */
+static rs_result
+rs_sig_s_send_batch(rs_job_t *job)
+{
+    int                 i = job->sig_batch_pos++;
+
+    rs_sig_send_sum(job, job->sig_weak[i], job->sig_strong[i]);
+
+    if (job->sig_batch_pos == job->sig_batch_len)
+        job->statefn = rs_sig_s_generate;
 
     return RS_RUNNING;
 }
@@ -125,6 +239,21 @@ rs_sig_s_generate(rs_job_t *job)
     rs_result           result;
     size_t              len;
     void                *block;
+    size_t              n;
+
+    /* if several whole blocks are already here, hash them together */
+    if (job->block_len > 0) {
+        n = rs_scoop_total_avail(job) / job->block_len;
+        if (n > RS_MAX_SUM_LANES)
+            n = RS_MAX_SUM_LANES;
+        if (n > 1) {
+            result = rs_scoop_read(job, n * job->block_len, &block);
+            if (result != RS_DONE)
+                return result;
+            rs_trace("got %d blocks of %d bytes", (int) n, job->block_len);
+            return rs_sig_do_blocks(job, block, (int) n);
+        }
+    }
         
     /* must get a whole block, otherwise try again */
     len = job->block_len;
@@ -147,6 +276,192 @@ rs_sig_s_generate(rs_job_t *job)
 }
 
 
+/**
+ * Hash task \p i of a batch: a run of blocks, all of them whole except
+ * perhaps the very last one of the input.  Runs on a worker thread.
+ * \private
+ */
+static void
+rs_sig_hash_task(void *arg, int i)
+{
+    rs_sig_batch_t      *batch = (rs_sig_batch_t *) arg;
+    struct rs_sig_threads *t = batch->threads;
+    size_t              block_len = t->block_len;
+    int                 first = i * t->task_blocks;
+    int                 n = batch->nblocks - first;
+    int                 nwhole, j;
+    rs_byte_t const     *block = batch->buf + first * block_len;
+
+    if (n > t->task_blocks)
+        n = t->task_blocks;
+    nwhole = n;
+    if (first + n == batch->nblocks && batch->len % block_len)
+        nwhole--;
+
+    for (j = 0; j < n; j++) {
+        size_t len = j < nwhole ? block_len : batch->len % block_len;
+        batch->weak[first + j] = rs_calc_weak_sum(block + j * block_len, len);
+    }
+    if (t->magic == RS_BLAKE2_SIG_MAGIC)
+        rs_calc_blake2_sums(block, block_len, nwhole, &batch->strong[first]);
+    else
+        rs_calc_md4_sums(block, block_len, nwhole, &batch->strong[first]);
+    if (nwhole < n) {
+        block += nwhole * block_len;
+        if (t->magic == RS_BLAKE2_SIG_MAGIC)
+            rs_calc_blake2_sum(block, batch->len % block_len,
+                               &batch->strong[first + nwhole]);
+        else
+            rs_calc_md4_sum(block, batch->len % block_len,
+                            &batch->strong[first + nwhole]);
+    }
+}
+
+
+/**
+ * Make the batches no bigger than they need to be for the \p len bytes
+ * of input that are left, when the whole input is known from the start.
+ * \private
+ */
+static void
+rs_sig_threads_fit(struct rs_sig_threads *t, size_t len)
+{
+    size_t              nblocks = (len + t->block_len - 1) / t->block_len;
+    int                 per_thread;
+
+    if (!nblocks || nblocks >= (size_t) t->batch_blocks)
+        return;
+    t->batch_blocks = (int) nblocks;
+    per_thread = (t->batch_blocks + t->nthreads - 1) / t->nthreads;
+    if (t->task_blocks > per_thread)
+        t->task_blocks = per_thread;
+    rs_trace("input is only %d blocks, so hashing %d blocks per task",
+             t->batch_blocks, t->task_blocks);
+}
+
+
+/**
+ * Allocate the input and sums of a batch, when it is first filled, so
+ * that a small input doesn't allocate batches it never uses.
+ * \private
+ */
+static void
+rs_sig_batch_alloc(struct rs_sig_threads *t, rs_sig_batch_t *batch)
+{
+    batch->buf = rs_alloc(t->batch_blocks * t->block_len,
+                          "signature batch");
+    batch->weak = rs_alloc(t->batch_blocks * sizeof(rs_weak_sum_t),
+                           "signature batch weak sums");
+    batch->strong = rs_alloc(t->batch_blocks * sizeof(rs_strong_sum_t),
+                             "signature batch strong sums");
+}
+
+
+/**
+ * State of threaded signature generation.  Each call does one step:
+ * sends a sum from the hashed batch, hands a complete batch to the
+ * workers, or copies more input into the batch being filled.
+ * \private
+ */
+static rs_result
+rs_sig_s_generate_threads(rs_job_t *job)
+{
+    struct rs_sig_threads *t = job->sig_threads;
+    rs_sig_batch_t      *batch;
+    rs_result           result;
+    size_t              len;
+    void                *p;
+
+    if ((batch = t->sending)) {
+        int i = t->send_pos++;
+
+        rs_sig_send_sum(job, batch->weak[i], batch->strong[i]);
+        if (t->send_pos == batch->nblocks) {
+            batch->len = batch->nblocks = batch->complete = 0;
+            t->sending = NULL;
+        }
+        return RS_RUNNING;
+    }
+
+    if (!t->filling) {
+        /* the input has ended; send what the workers have left */
+        if (!t->hashing)
+            return RS_DONE;
+        rs_workers_wait(t->workers);
+        t->sending = t->hashing;
+        t->hashing = NULL;
+        t->send_pos = 0;
+        return RS_RUNNING;
+    }
+
+    batch = t->filling;
+    if (batch->complete) {
+        /* wait for the previous batch, then start on this one */
+        if (t->hashing) {
+            rs_workers_wait(t->workers);
+            t->sending = t->hashing;
+            t->send_pos = 0;
+        }
+        t->hashing = NULL;
+        if (batch->len) {
+            batch->nblocks = (batch->len + t->block_len - 1) / t->block_len;
+            rs_trace("hashing %d blocks on worker threads", batch->nblocks);
+            rs_workers_start(t->workers, rs_sig_hash_task, batch,
+                             (batch->nblocks + t->task_blocks - 1) / t->task_blocks);
+            t->hashing = batch;
+        }
+        if (batch->len == (size_t) t->batch_blocks * t->block_len)
+            t->filling = batch == &t->batch[0] ? &t->batch[1] : &t->batch[0];
+        else
+            t->filling = NULL;          /* that was the end of the input */
+        return RS_RUNNING;
+    }
+
+    /* take whatever input is available, up to a full batch, but use up
+     * anything in the scoop first so that it doesn't grow */
+    len = job->scoop_avail ? job->scoop_avail : rs_scoop_total_avail(job);
+    if (!len) {
+        result = rs_scoop_readahead(job, 1, &p);
+        if (result == RS_INPUT_ENDED)
+            batch->complete = 1;
+        return result == RS_INPUT_ENDED ? RS_RUNNING : result;
+    }
+    if (!batch->buf) {
+        if (batch == &t->batch[0] && job->stream->eof_in)
+            rs_sig_threads_fit(t, rs_scoop_total_avail(job));
+        rs_sig_batch_alloc(t, batch);
+    }
+    if (len > (size_t) t->batch_blocks * t->block_len - batch->len)
+        len = (size_t) t->batch_blocks * t->block_len - batch->len;
+    result = rs_scoop_read(job, len, &p);
+    if (result != RS_DONE)
+        return result;
+    memcpy(batch->buf + batch->len, p, len);
+    batch->len += len;
+    if (batch->len == (size_t) t->batch_blocks * t->block_len)
+        batch->complete = 1;
+    return RS_RUNNING;
+}
+
+
+/**
+ * Free the state of threaded signature generation, after waiting for the
+ * workers to finish whatever they were doing.
+ */
+void rs_sig_threads_free(struct rs_sig_threads *t)
+{
+    int i;
+
+    rs_workers_free(t->workers);
+    for (i = 0; i < 2; i++) {
+        free(t->batch[i].buf);
+        free(t->batch[i].weak);
+        free(t->batch[i].strong);
+    }
+    free(t);
+}
+
+
 rs_job_t * rs_sig_begin(size_t new_block_len, size_t strong_sum_len,
                         rs_magic_number sig_magic)
 {
@@ -183,5 +498,50 @@ rs_job_t * rs_sig_begin(size_t new_block_len, size_t strong_sum_len,
     return job;
 }
 
+
+rs_job_t * rs_sig_begin_threads(size_t new_block_len, size_t strong_sum_len,
+                                rs_magic_number sig_magic, int threads)
+{
+    rs_job_t *job;
+    rs_workers_t *workers;
+    struct rs_sig_threads *t;
+    size_t per_block;
+    int i;
+
+    job = rs_sig_begin(new_block_len, strong_sum_len, sig_magic);
+    if (!job || !new_block_len || threads < 2)
+        return job;
+    if (threads > RS_SIG_MAX_THREADS)
+        threads = RS_SIG_MAX_THREADS;
+    rs_pick_sum_kernels();
+    if (!(workers = rs_workers_new(threads)))
+        return job;
+
+    t = rs_alloc_struct(struct rs_sig_threads);
+    t->workers = workers;
+    t->magic = job->magic;
+    t->block_len = new_block_len;
+    t->nthreads = threads;
+    per_block = new_block_len + sizeof(rs_weak_sum_t) + sizeof(rs_strong_sum_t);
+    t->task_blocks = RS_SIG_THREAD_BYTES / RS_SIG_THREAD_TASKS / per_block;
+    if (t->task_blocks < RS_MAX_SUM_LANES)
+        t->task_blocks = RS_MAX_SUM_LANES;
+    if (t->task_blocks * RS_SIG_THREAD_TASKS * per_block
+        > RS_SIG_THREAD_MAX_BYTES)
+        t->task_blocks = RS_SIG_THREAD_MAX_BYTES / RS_SIG_THREAD_TASKS
+            / per_block;
+    if (t->task_blocks < 1)
+        t->task_blocks = 1;
+    t->batch_blocks = t->task_blocks * RS_SIG_THREAD_TASKS * threads;
+    for (i = 0; i < 2; i++)
+        t->batch[i].threads = t;
+    t->filling = &t->batch[0];
+    job->sig_threads = t;
+    rs_trace("generating signature with %d threads, %d blocks per batch",
+             threads, t->batch_blocks);
+
+    return job;
+}
+
 /* vim: expandtab shiftwidth=4
  */
@@ -0,0 +1,341 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+/**
+ * \file parpatch.c Apply a delta between files using several threads.
+ *
+ * In a plain delta, with no compression or self copies, every command's
+ * output length is in the command, so one pass over the commands gives
+ * where each one's output goes in the new file.  The new file is then
+ * cut into pieces, and the workers each fill pieces in with pread() from
+ * the basis or the delta's literal data and pwrite() to the new file.
+ *
+ * Deltas that can't be done this way, and descriptors that aren't
+ * regular files, are patched by an ordinary job with rs_patch_fd(),
+ * which also reports whatever is wrong with a bad delta.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "librsync.h"
+#include "trace.h"
+#include "util.h"
+#include "command.h"
+#include "prototab.h"
+#include "cmdscan.h"
+#include "workers.h"
+
+#if defined HAVE_UNISTD_H && defined HAVE_PREAD
+
+/* The most of the new file each task writes, and how much it reads at a
+ * time, which is also the least it writes. */
+#define RS_PARPATCH_PIECE       (4 << 20)
+#define RS_PARPATCH_CHUNK       (1 << 20)
+
+
+/*
+ * A command's output at \p out in the new file, from \p from in the
+ * basis for a COPY or in the delta for a LITERAL.
+ */
+typedef struct rs_parpatch_cmd {
+    rs_long_t           out, from, len;
+    int                 copy;
+} rs_parpatch_cmd_t;
+
+
+typedef struct rs_parpatch {
+    int                 basis_fd, delta_fd, new_fd;
+    rs_long_t           new_pos;        /* where the new file starts */
+    rs_long_t           delta_end;      /* just after the END command */
+    rs_long_t           total;          /* length of the new file */
+    rs_long_t           piece;          /* written by each task */
+
+    rs_parpatch_cmd_t   *cmds;
+    size_t              ncmds, cmds_alloc;
+
+    rs_result           *results;       /* of each task */
+    volatile int        failed;         /* so the rest can give up */
+    rs_stats_t          stats;
+} rs_parpatch_t;
+
+
+static int rs_parpatch_is_regular(int fd)
+{
+    struct stat         st;
+
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+
+/* Add a command putting out \p len bytes, and count it in the stats. */
+static int rs_parpatch_add(rs_parpatch_t *pp, rs_prototab_ent_t const *cmd,
+                           int copy, rs_long_t from, rs_long_t len)
+{
+    rs_parpatch_cmd_t   *c;
+    size_t              want;
+
+    if (copy) {
+        pp->stats.copy_cmds++;
+        pp->stats.copy_bytes += len;
+        pp->stats.copy_cmdbytes += 1 + cmd->len_1 + cmd->len_2;
+    } else {
+        pp->stats.lit_cmds++;
+        pp->stats.lit_bytes += len;
+        pp->stats.lit_cmdbytes += 1 + cmd->len_1;
+    }
+    if (!len)
+        return 1;
+    if (pp->ncmds == pp->cmds_alloc) {
+        want = pp->cmds_alloc ? pp->cmds_alloc * 2 : 1024;
+        if (!(c = realloc(pp->cmds, want * sizeof *c)))
+            return 0;
+        pp->cmds = c;
+        pp->cmds_alloc = want;
+    }
+    c = &pp->cmds[pp->ncmds++];
+    c->out = pp->total;
+    c->from = from;
+    c->len = len;
+    c->copy = copy;
+    pp->total += len;
+    return 1;
+}
+
+
+/*
+ * Scan the delta and make the table of commands.  Returns 0 if the delta
+ * isn't one that can be patched this way, or has anything wrong with it.
+ */
+static int rs_parpatch_index(rs_parpatch_t *pp)
+{
+    rs_cmdscan_t        *sc = rs_cmdscan_new(pp->delta_fd);
+    rs_prototab_ent_t const *cmd;
+    rs_long_t           param[2], start = rs_cmdscan_tell(sc);
+    int                 magic, ok;
+
+    ok = rs_cmdscan_magic(sc, &magic) && magic == RS_DELTA_MAGIC;
+    while (ok && (ok = rs_cmdscan_next(sc, &cmd, param))) {
+        if (cmd->kind == RS_KIND_END) {
+            pp->delta_end = rs_cmdscan_tell(sc);
+            break;
+        } else if (cmd->kind == RS_KIND_LITERAL && param[0] >= 0) {
+            ok = rs_parpatch_add(pp, cmd, 0, rs_cmdscan_tell(sc), param[0]);
+            rs_cmdscan_skip(sc, param[0]);
+        } else if (cmd->kind == RS_KIND_COPY && param[0] >= 0
+                   && param[1] >= 0) {
+            ok = rs_parpatch_add(pp, cmd, 1, param[0], param[1]);
+        } else {
+            ok = 0;
+        }
+    }
+    ok = ok && !rs_cmdscan_failed(sc);
+    pp->stats.in_bytes = pp->delta_end - start;
+    rs_cmdscan_free(sc);
+    rs_trace("%s: %lu commands putting out " PRINTF_FORMAT_U64 " bytes",
+             ok ? "indexed delta" : "can't patch delta in parallel",
+             (unsigned long) pp->ncmds, PRINTF_CAST_U64(pp->total));
+    return ok;
+}
+
+
+/* Copy \p len bytes at \p from in \p fd to \p out in the new file. */
+static rs_result rs_parpatch_copy(rs_parpatch_t *pp, rs_byte_t *buf, int fd,
+                                  rs_long_t from, rs_long_t out,
+                                  rs_long_t len)
+{
+    ssize_t             n, w;
+    size_t              want, done;
+
+    while (len > 0) {
+        want = len < RS_PARPATCH_CHUNK ? len : RS_PARPATCH_CHUNK;
+        do
+            n = pread(fd, buf, want, from);
+        while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            rs_error("read error on fd%d: %s", fd, strerror(errno));
+            return RS_IO_ERROR;
+        } else if (n == 0) {
+            rs_error("unexpected eof on fd%d", fd);
+            return RS_INPUT_ENDED;
+        }
+        for (done = 0; done < (size_t) n; done += w) {
+            w = pwrite(pp->new_fd, buf + done, n - done,
+                       pp->new_pos + out + done);
+            if (w < 0 && errno == EINTR) {
+                w = 0;
+                continue;
+            }
+            if (w <= 0) {
+                rs_error("write error on fd%d: %s", pp->new_fd,
+                         strerror(errno));
+                return RS_IO_ERROR;
+            }
+        }
+        from += n;
+        out += n;
+        len -= n;
+    }
+    return RS_DONE;
+}
+
+
+/* Task \p i writes the new file from \p i pieces in. */
+static void rs_parpatch_task(void *arg, int i)
+{
+    rs_parpatch_t       *pp = (rs_parpatch_t *) arg;
+    rs_parpatch_cmd_t   *c;
+    rs_long_t           start = i * pp->piece, end = start + pp->piece;
+    rs_long_t           s, e;
+    rs_result           result = RS_DONE;
+    rs_byte_t           *buf;
+    size_t              lo, hi, mid, k;
+
+    if (pp->failed) {
+        pp->results[i] = RS_DONE;
+        return;
+    }
+    if (end > pp->total)
+        end = pp->total;
+    /* the command the piece starts in */
+    for (lo = 0, hi = pp->ncmds; lo < hi; ) {
+        mid = (lo + hi) / 2;
+        if (pp->cmds[mid].out + pp->cmds[mid].len <= start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (k = lo; k < pp->ncmds && pp->cmds[k].out < end; k++)
+        if (pp->cmds[k].copy)
+            rs_fd_prefetch_cb(&pp->basis_fd, pp->cmds[k].from,
+                              pp->cmds[k].len);
+
+    buf = rs_alloc(RS_PARPATCH_CHUNK, "parallel patch buffer");
+    for (k = lo; result == RS_DONE && k < pp->ncmds
+             && pp->cmds[k].out < end; k++) {
+        c = &pp->cmds[k];
+        s = c->out > start ? c->out : start;
+        e = c->out + c->len < end ? c->out + c->len : end;
+        result = rs_parpatch_copy(pp, buf,
+                                  c->copy ? pp->basis_fd : pp->delta_fd,
+                                  c->from + (s - c->out), s, e - s);
+    }
+    free(buf);
+    if (result != RS_DONE)
+        pp->failed = 1;
+    pp->results[i] = result;
+}
+
+
+rs_result
+rs_patch_fd_threads(int basis_fd, int delta_fd, int new_fd, int threads,
+                    rs_stats_t *stats)
+{
+    rs_parpatch_t       pp;
+    rs_workers_t        *workers = NULL;
+    rs_result           r = RS_DONE;
+    rs_long_t           delta_pos = -1, pieces = 0;
+    int                 i;
+
+    rs_bzero(&pp, sizeof pp);
+    pp.basis_fd = basis_fd;
+    pp.delta_fd = delta_fd;
+    pp.new_fd = new_fd;
+    pp.stats.op = "patch";
+    pp.stats.start = time(NULL);
+
+    if (threads > 1 && rs_parpatch_is_regular(basis_fd)
+        && rs_parpatch_is_regular(delta_fd) && rs_parpatch_is_regular(new_fd)
+        && (pp.new_pos = lseek(new_fd, 0, SEEK_CUR)) >= 0
+        && (delta_pos = lseek(delta_fd, 0, SEEK_CUR)) >= 0
+        && rs_parpatch_index(&pp)) {
+        /* several pieces for each thread, to even out the work */
+        pp.piece = pp.total / threads / 8;
+        if (pp.piece > RS_PARPATCH_PIECE)
+            pp.piece = RS_PARPATCH_PIECE;
+        else if (pp.piece < RS_PARPATCH_CHUNK)
+            pp.piece = RS_PARPATCH_CHUNK;
+        pieces = (pp.total + pp.piece - 1) / pp.piece;
+        if (pieces <= 1 || pieces > 0x7fffffff
+            || !(workers = rs_workers_new(threads)))
+            pieces = 0;
+    }
+
+    if (!pieces) {
+        free(pp.cmds);
+        if (delta_pos >= 0 && lseek(delta_fd, delta_pos, SEEK_SET) < 0) {
+            rs_error("seek failed on fd%d: %s", delta_fd, strerror(errno));
+            return RS_IO_ERROR;
+        }
+        return rs_patch_fd(basis_fd, delta_fd, new_fd, stats);
+    }
+
+    rs_trace("patching " PRINTF_FORMAT_U64 " pieces with %d threads",
+             PRINTF_CAST_U64(pieces), threads);
+    pp.results = rs_alloc(pieces * sizeof *pp.results, "patch task results");
+    rs_workers_start(workers, rs_parpatch_task, &pp, (int) pieces);
+    rs_workers_wait(workers);
+    rs_workers_free(workers);
+
+    for (i = 0; i < pieces && r == RS_DONE; i++)
+        r = pp.results[i];
+    if (r == RS_DONE) {
+        /* leave the files where a job reading and writing them through
+         * would have */
+        pp.stats.out_bytes = pp.total;
+        if (lseek(new_fd, pp.new_pos + pp.total, SEEK_SET) < 0
+            || lseek(delta_fd, pp.delta_end, SEEK_SET) < 0) {
+            rs_error("seek failed: %s", strerror(errno));
+            r = RS_IO_ERROR;
+        }
+    } else {
+        rs_error("patch job failed: %s", rs_strerror(r));
+    }
+    pp.stats.end = time(NULL);
+    if (stats)
+        memcpy(stats, &pp.stats, sizeof *stats);
+
+    free(pp.results);
+    free(pp.cmds);
+    return r;
+}
+
+#else /* HAVE_UNISTD_H && HAVE_PREAD */
+
+rs_result
+rs_patch_fd_threads(int basis_fd, int delta_fd, int new_fd, int threads,
+                    rs_stats_t *stats)
+{
+    return rs_patch_fd(basis_fd, delta_fd, new_fd, stats);
+}
+
+#endif /* HAVE_UNISTD_H && HAVE_PREAD */
@@ -41,6 +41,7 @@
 #include "prototab.h"
 #include "stream.h"
 #include "job.h"
+#include "compress.h"
 
 
 
@@ -48,8 +49,171 @@ static rs_result rs_patch_s_cmdbyte(rs_job_t *);
 static rs_result rs_patch_s_params(rs_job_t *);
 static rs_result rs_patch_s_run(rs_job_t *);
 static rs_result rs_patch_s_literal(rs_job_t *);
+static rs_result rs_patch_s_literal_data(rs_job_t *);
 static rs_result rs_patch_s_copy(rs_job_t *);
 static rs_result rs_patch_s_copying(rs_job_t *);
+static rs_result rs_patch_s_batchcopying(rs_job_t *);
+static rs_result rs_patch_s_window(rs_job_t *);
+static rs_result rs_patch_s_selfcopy(rs_job_t *);
+static rs_result rs_patch_s_selfcopying(rs_job_t *);
+
+/* How far a patch looks ahead for COPY commands to prefetch: at most this
+ * many commands, or this much basis data. */
+#define RS_PATCH_PREFETCH_CMDS  64
+#define RS_PATCH_PREFETCH_BYTES (16 << 20)
+
+/* The most a batch of basis data asked for at once can have. */
+#define RS_PATCH_BATCH_EXTENTS  64
+#define RS_PATCH_BATCH_BYTES    (1 << 20)
+
+/* The shortest COPY worth giving to copy_direct_cb, by default. */
+#define RS_PATCH_DIRECT_MIN     (1 << 16)
+
+
+/**
+ * The last part of the output, kept for SELFCOPY commands to copy from.
+ * \private
+ */
+struct rs_patch_window {
+    rs_byte_t           *buf;
+    rs_long_t           size;
+    rs_long_t           pos;            /* output so far */
+};
+
+
+/* Note \p len more bytes of output at \p p in the window. */
+static void rs_patch_window_add(struct rs_patch_window *w,
+                                void const *data, size_t len)
+{
+    rs_byte_t const *p = (rs_byte_t const *) data;
+    size_t off, n;
+
+    if ((rs_long_t) len > w->size) {
+        p += len - w->size;
+        w->pos += len - w->size;
+        len = w->size;
+    }
+    while (len) {
+        off = w->pos % w->size;
+        n = w->size - off;
+        if (n > len)
+            n = len;
+        memcpy(w->buf + off, p, n);
+        w->pos += n;
+        p += n;
+        len -= n;
+    }
+}
+
+
+void rs_patch_window_free(struct rs_patch_window *w)
+{
+    free(w->buf);
+    free(w);
+}
+
+
+/**
+ * The basis data for the next COPY commands, read by a
+ * ::rs_copy_batch_cb.  \p off is how much of ext[next] has been put out.
+ * \private
+ */
+struct rs_patch_batch {
+    rs_copy_batch_cb    *cb;
+    void                *arg;
+    rs_copy_extent_t    ext[RS_PATCH_BATCH_EXTENTS];
+    int                 count, next;
+    size_t              off, used;
+    rs_byte_t           *buf;
+};
+
+
+void rs_patch_batch_free(struct rs_patch_batch *b)
+{
+    free(b->buf);
+    free(b);
+}
+
+
+/*
+ * Byte \p i of the input not yet read by the job, or -1 if it hasn't
+ * arrived yet.
+ */
+static int rs_patch_peek(rs_job_t *job, rs_long_t i)
+{
+    if (i < (rs_long_t) job->scoop_avail)
+        return job->scoop_next[i];
+    i -= job->scoop_avail;
+    if (i < (rs_long_t) job->stream->avail_in)
+        return (rs_byte_t) job->stream->next_in[i];
+    return -1;
+}
+
+
+/*
+ * Parse the command at \p *off bytes ahead in the input, and move \p
+ * *off past it and any literal data it has.  Returns 0 if the command
+ * hasn't all arrived yet.
+ */
+static int rs_patch_peek_cmd(rs_job_t *job, rs_long_t *off,
+                             rs_prototab_ent_t const **cmd,
+                             rs_long_t param[2])
+{
+    rs_long_t       o = *off;
+    int             i, j, c, len;
+
+    if ((c = rs_patch_peek(job, o)) < 0)
+        return 0;
+    *cmd = &rs_prototab[c];
+    if (rs_patch_peek(job, o + (*cmd)->len_1 + (*cmd)->len_2) < 0)
+        return 0;
+    param[0] = (*cmd)->immediate;
+    param[1] = 0;
+    for (i = 0, o++; i < 2; i++) {
+        if (!(len = i ? (*cmd)->len_2 : (*cmd)->len_1))
+            continue;
+        for (param[i] = 0, j = 0; j < len; j++)
+            param[i] = param[i] << 8 | rs_patch_peek(job, o++);
+    }
+    if ((*cmd)->kind == RS_KIND_LITERAL)
+        o += param[0];
+    *off = o;
+    return 1;
+}
+
+
+/*
+ * Parse ahead through the commands in the input that has arrived,
+ * starting with the next one, and pass the COPY commands to the prefetch
+ * callback.  The first prefetch_cmds of them were passed on last time.
+ */
+static void rs_patch_prefetch(rs_job_t *job)
+{
+    rs_prototab_ent_t const *cmd;
+    rs_long_t       off = 0, ahead = 0, param[2];
+    int             n;
+
+    for (n = 0; n < RS_PATCH_PREFETCH_CMDS && ahead < RS_PATCH_PREFETCH_BYTES;
+         n++) {
+        if (!rs_patch_peek_cmd(job, &off, &cmd, param))
+            break;
+        if (cmd->kind == RS_KIND_COPY) {
+            if (n >= job->prefetch_cmds && param[1] > 0)
+                job->prefetch_cb(job->prefetch_arg, param[0], param[1]);
+            ahead += param[1];
+        } else if (cmd->kind != RS_KIND_LITERAL
+                   && cmd->kind != RS_KIND_SELFCOPY
+                   && cmd->kind != RS_KIND_WINDOW) {
+            /* the end, or garbage that the job will complain about */
+            n++;
+            break;
+        }
+    }
+    if (n > job->prefetch_cmds) {
+        rs_trace("looked ahead over %d commands", n);
+    }
+    job->prefetch_cmds = n;
+}
 
 
 /**
@@ -61,8 +225,15 @@ static rs_result rs_patch_s_cmdbyte(rs_job_t *job)
 {
     rs_result result;
 
+    /* see what else is coming when half the commands looked ahead at
+     * last time are done */
+    if (job->prefetch_cb && job->prefetch_cmds < RS_PATCH_PREFETCH_CMDS / 2)
+        rs_patch_prefetch(job);
+
     if ((result = rs_suck_byte(job, &job->op)) != RS_DONE)
         return result;
+    if (job->prefetch_cmds)
+        job->prefetch_cmds--;
 
     job->cmd = &rs_prototab[job->op];
 
@@ -94,7 +265,10 @@ static rs_result rs_patch_s_params(rs_job_t *job)
     assert(len);
 
     result = rs_scoop_readahead(job, len, &p);
-    if (result != RS_DONE)
+    if (result == RS_BLOCKED && rs_job_input_is_ending(job)) {
+        rs_error("delta ends in the middle of a command");
+        return RS_INPUT_ENDED;
+    } else if (result != RS_DONE)
         return result;
 
     /* we now must have LEN bytes buffered */
@@ -134,6 +308,14 @@ static rs_result rs_patch_s_run(rs_job_t *job)
         job->statefn = rs_patch_s_copy;
         return RS_RUNNING;
 
+    case RS_KIND_WINDOW:
+        job->statefn = rs_patch_s_window;
+        return RS_RUNNING;
+
+    case RS_KIND_SELFCOPY:
+        job->statefn = rs_patch_s_selfcopy;
+        return RS_RUNNING;
+
     default:
         rs_error("bogus command 0x%02x", job->op);
         return RS_CORRUPT;
@@ -159,6 +341,11 @@ static rs_result rs_patch_s_literal(rs_job_t *job)
     job->stats.lit_bytes    += len;
     job->stats.lit_cmdbytes += 1 + job->cmd->len_1;
 
+    if (job->compress || job->patch_window) {
+        job->statefn = rs_patch_s_literal_data;
+        return RS_RUNNING;
+    }
+
     rs_tube_copy(job, len);
 
     job->statefn = rs_patch_s_cmdbyte;
@@ -166,11 +353,90 @@ static rs_result rs_patch_s_literal(rs_job_t *job)
 }
 
 
+/**
+ * Called while putting out the data of a LITERAL command here rather than
+ * with the tube, because it is compressed or has to be kept in the
+ * window.  \p param1 counts down the data still to be read.
+ */
+static rs_result rs_patch_s_literal_data(rs_job_t *job)
+{
+    rs_buffers_t    *buffs = job->stream;
+    void            *in;
+    size_t          in_len, out_len, room;
+    rs_result       result;
+
+    /* take the compressed data from the scoop if anything is left there,
+     * otherwise straight from the input */
+    if (job->scoop_avail) {
+        in = job->scoop_next;
+        in_len = job->scoop_avail;
+    } else {
+        in = buffs->next_in;
+        in_len = buffs->avail_in;
+    }
+    if ((rs_long_t) in_len > job->param1)
+        in_len = job->param1;
+
+    if (!job->compress && !job->param1) {
+        job->statefn = rs_patch_s_cmdbyte;
+        return RS_RUNNING;
+    }
+    if (!(room = out_len = buffs->avail_out))
+        return RS_BLOCKED;
+    if (job->compress) {
+        result = rs_decompress_literal(job->compress, in, &in_len,
+                                       buffs->next_out, &out_len);
+        if (result != RS_DONE)
+            return result;
+    } else {
+        if (out_len > in_len)
+            out_len = in_len;
+        in_len = out_len;
+        memcpy(buffs->next_out, in, out_len);
+    }
+
+    rs_scoop_advance(job, in_len);
+    job->param1 -= in_len;
+    if (job->patch_window)
+        rs_patch_window_add(job->patch_window, buffs->next_out, out_len);
+    buffs->next_out += out_len;
+    buffs->avail_out -= out_len;
+
+    if (!job->param1 && (out_len < room || !job->compress)) {
+        /* all the data of this command is out */
+        job->statefn = rs_patch_s_cmdbyte;
+    } else if (!in_len && !out_len) {
+        if (job->param1 && rs_scoop_total_avail(job)) {
+            rs_error("compressed literal data made no progress");
+            return RS_CORRUPT;
+        } else if (rs_job_input_is_ending(job)) {
+            rs_error("reached end of file in literal data");
+            return RS_INPUT_ENDED;
+        }
+        return RS_BLOCKED;
+    }
+    return RS_RUNNING;
+}
+
+
+
+/*
+ * Whether a COPY of \p len bytes should be put straight into the output
+ * by copy_direct_cb.  Not when the output is also needed to decompress
+ * literals or for SELFCOPY commands, since it never passes through us.
+ */
+static int rs_patch_direct_ok(rs_job_t *job, rs_long_t len)
+{
+    return job->copy_direct_cb && len >= job->copy_direct_min
+        && !job->compress && !job->patch_window;
+}
+
 
 static rs_result rs_patch_s_copy(rs_job_t *job)
 {
     rs_long_t  where, len;
     rs_stats_t      *stats;
+    rs_result       result;
 
     where = job->param1;
     len = job->param2;
@@ -196,7 +462,26 @@ static rs_result rs_patch_s_copy(rs_job_t *job)
     stats->copy_bytes += len;
     stats->copy_cmdbytes += 1 + job->cmd->len_1 + job->cmd->len_2;
 
-    job->statefn = rs_patch_s_copying;
+    if (rs_patch_direct_ok(job, len)) {
+        result = job->copy_direct_cb(job, job->copy_direct_arg, where, &len);
+        if (result == RS_UNIMPLEMENTED)
+            job->copy_direct_cb = NULL;
+        else if (result != RS_DONE)
+            return result;
+        job->basis_pos += len;
+        job->basis_len -= len;
+        if (!job->basis_len) {
+            job->statefn = rs_patch_s_cmdbyte;
+            return RS_RUNNING;
+        }
+        /* The batch left this COPY out, so start a new one with the
+         * rest of it. */
+        if (job->copy_batch)
+            job->copy_batch->next = job->copy_batch->count;
+    }
+
+    job->statefn = job->copy_batch ? rs_patch_s_batchcopying
+        : rs_patch_s_copying;
     return RS_RUNNING;
 }
 
@@ -241,6 +526,11 @@ static rs_result rs_patch_s_copying(rs_job_t *job)
     if (ptr != buffs->next_out)
         memcpy(buffs->next_out, ptr, len);
 
+    if (job->compress)
+        rs_compress_history(job->compress, buffs->next_out, len);
+    if (job->patch_window)
+        rs_patch_window_add(job->patch_window, buffs->next_out, len);
+
     buffs->next_out += len;
     buffs->avail_out -= len;
 
@@ -256,6 +546,220 @@ static rs_result rs_patch_s_copying(rs_job_t *job)
 }
 
 
+/* Add up to \p len bytes at \p pos to the batch; returns 0 if it's full. */
+static int rs_patch_batch_add(struct rs_patch_batch *b, rs_long_t pos,
+                              rs_long_t len)
+{
+    rs_copy_extent_t *e;
+
+    if (b->count == RS_PATCH_BATCH_EXTENTS || b->used == RS_PATCH_BATCH_BYTES
+        || pos < 0 || len <= 0)
+        return 0;
+    if (len > (rs_long_t) (RS_PATCH_BATCH_BYTES - b->used))
+        len = RS_PATCH_BATCH_BYTES - b->used;
+    e = &b->ext[b->count++];
+    e->pos = pos;
+    e->len = (size_t) len;
+    e->buf = b->buf + b->used;
+    e->done = 0;
+    b->used += e->len;
+    return 1;
+}
+
+
+/*
+ * Start a new batch with the rest of the COPY being run, followed by the
+ * COPY commands after it that have arrived in the input.
+ */
+static void rs_patch_batch_fill(rs_job_t *job)
+{
+    struct rs_patch_batch *b = job->copy_batch;
+    rs_prototab_ent_t const *cmd;
+    rs_long_t       off = 0, param[2];
+
+    b->count = b->next = 0;
+    b->off = b->used = 0;
+    rs_patch_batch_add(b, job->basis_pos, job->basis_len);
+    while (rs_patch_peek_cmd(job, &off, &cmd, param)) {
+        if (cmd->kind == RS_KIND_COPY) {
+            if (rs_patch_direct_ok(job, param[1]))
+                continue;
+            if (!rs_patch_batch_add(b, param[0], param[1]))
+                break;
+        } else if (cmd->kind != RS_KIND_LITERAL
+                   && cmd->kind != RS_KIND_SELFCOPY
+                   && cmd->kind != RS_KIND_WINDOW) {
+            break;
+        }
+    }
+    rs_trace("asking for a batch of %d extents, " PRINTF_FORMAT_U64 " bytes",
+             b->count, PRINTF_CAST_U64(b->used));
+}
+
+
+/**
+ * Called when we're executing a COPY command and reading the basis a
+ * batch at a time.
+ */
+static rs_result rs_patch_s_batchcopying(rs_job_t *job)
+{
+    struct rs_patch_batch *b = job->copy_batch;
+    rs_buffers_t    *buffs = job->stream;
+    rs_copy_extent_t *e;
+    rs_result       result;
+    size_t          len;
+
+    if (!job->basis_len) {
+        job->statefn = rs_patch_s_cmdbyte;
+        return RS_RUNNING;
+    }
+    if (!buffs->avail_out)
+        return RS_BLOCKED;
+
+    if (b->next == b->count)
+        rs_patch_batch_fill(job);
+    e = &b->ext[b->next];
+    if (e->pos + (rs_long_t) b->off != job->basis_pos) {
+        rs_error("batch of basis data is out of step with the delta");
+        return RS_INTERNAL_ERROR;
+    }
+    if (!e->done) {
+        result = b->cb(b->arg, e, b->count - b->next);
+        if (result == RS_DONE && !e->done)
+            result = RS_BLOCKED;
+        job->copy_blocked = result == RS_BLOCKED;
+        if (result != RS_DONE)
+            return result;
+    }
+
+    len = e->len - b->off;
+    if (len > buffs->avail_out)
+        len = buffs->avail_out;
+    memcpy(buffs->next_out, (rs_byte_t *) e->buf + b->off, len);
+
+    if (job->compress)
+        rs_compress_history(job->compress, buffs->next_out, len);
+    if (job->patch_window)
+        rs_patch_window_add(job->patch_window, buffs->next_out, len);
+
+    buffs->next_out += len;
+    buffs->avail_out -= len;
+    job->basis_pos += len;
+    job->basis_len -= len;
+    if ((b->off += len) == e->len) {
+        b->next++;
+        b->off = 0;
+    }
+
+    if (!job->basis_len)
+        job->statefn = rs_patch_s_cmdbyte;
+    return RS_RUNNING;
+}
+
+
+/**
+ * Called for a WINDOW command, which comes before any data in deltas
+ * that have SELFCOPY commands.
+ */
+static rs_result rs_patch_s_window(rs_job_t *job)
+{
+    rs_long_t  window = job->param1;
+
+    rs_trace("WINDOW(window=" PRINTF_FORMAT_U64 ")", PRINTF_CAST_U64(window));
+
+    if (job->patch_window || job->stats.lit_cmds || job->stats.copy_cmds) {
+        rs_error("WINDOW command after the start of the delta");
+        return RS_CORRUPT;
+    }
+    if (window <= 0 || window > RS_MAX_SELF_WINDOW) {
+        rs_error("invalid window=" PRINTF_FORMAT_U64 " on WINDOW command",
+                 PRINTF_CAST_U64(window));
+        return RS_CORRUPT;
+    }
+
+    job->patch_window = rs_alloc_struct(struct rs_patch_window);
+    job->patch_window->buf = rs_alloc(window, "patch window");
+    job->patch_window->size = window;
+
+    job->statefn = rs_patch_s_cmdbyte;
+    return RS_RUNNING;
+}
+
+
+/**
+ * Called for a SELFCOPY command, which copies from the output so far.
+ */
+static rs_result rs_patch_s_selfcopy(rs_job_t *job)
+{
+    rs_long_t   where = job->param1, len = job->param2;
+    struct rs_patch_window *w = job->patch_window;
+
+    rs_trace("SELFCOPY(where=" PRINTF_FORMAT_U64 ", len=" PRINTF_FORMAT_U64 ")",
+             PRINTF_CAST_U64(where), PRINTF_CAST_U64(len));
+
+    if (!w) {
+        rs_error("SELFCOPY command without a WINDOW");
+        return RS_CORRUPT;
+    }
+    if (len < 0 || where < 0 || where >= w->pos || w->pos - where > w->size) {
+        rs_error("invalid where=" PRINTF_FORMAT_U64 ", len=" PRINTF_FORMAT_U64
+                 " on SELFCOPY command at output " PRINTF_FORMAT_U64,
+                 PRINTF_CAST_U64(where), PRINTF_CAST_U64(len),
+                 PRINTF_CAST_U64(w->pos));
+        return RS_CORRUPT;
+    }
+
+    job->basis_pos = where;
+    job->basis_len = len;
+
+    job->stats.copy_cmds++;
+    job->stats.copy_bytes += len;
+    job->stats.copy_cmdbytes += 1 + job->cmd->len_1 + job->cmd->len_2;
+
+    job->statefn = rs_patch_s_selfcopying;
+    return RS_RUNNING;
+}
+
+
+/**
+ * Called while copying the data of a SELFCOPY out of the window.  The
+ * copy may overlap the data it writes, so it goes no further at a time
+ * than where the output was when it started.
+ */
+static rs_result rs_patch_s_selfcopying(rs_job_t *job)
+{
+    rs_buffers_t    *buffs = job->stream;
+    struct rs_patch_window *w = job->patch_window;
+    rs_long_t       len = job->basis_len;
+    size_t          off;
+
+    if (!len) {
+        job->statefn = rs_patch_s_cmdbyte;
+        return RS_RUNNING;
+    }
+    if (len > (rs_long_t) buffs->avail_out)
+        len = buffs->avail_out;
+    if (len > w->pos - job->basis_pos)
+        len = w->pos - job->basis_pos;
+    off = job->basis_pos % w->size;
+    if (len > w->size - (rs_long_t) off)
+        len = w->size - off;
+    if (!len)
+        return RS_BLOCKED;
+
+    memcpy(buffs->next_out, w->buf + off, len);
+    rs_patch_window_add(w, buffs->next_out, len);
+    if (job->compress)
+        rs_compress_history(job->compress, buffs->next_out, len);
+    buffs->next_out += len;
+    buffs->avail_out -= len;
+
+    job->basis_pos += len;
+    job->basis_len -= len;
+    return RS_RUNNING;
+}
+
+
 /**
  * Called while we're trying to read the header of the patch.
  */
@@ -265,10 +769,19 @@ static rs_result rs_patch_s_header(rs_job_t *job)
     rs_result result;
 
 
-    if ((result = rs_suck_n4(job, &v)) != RS_DONE)
+    result = rs_suck_n4(job, &v);
+    if (result == RS_BLOCKED && rs_job_input_is_ending(job)) {
+        rs_error("delta ends in the middle of its header");
+        return RS_INPUT_ENDED;
+    } else if (result != RS_DONE)
         return result;
 
-    if (v != RS_DELTA_MAGIC) {
+    if (v == RS_DELTA_ZLIB_MAGIC || v == RS_DELTA_ZLIB_PRIMED_MAGIC
+        || v == RS_DELTA_BZIP2_MAGIC) {
+        rs_trace("got compressed patch magic %#x", v);
+        if ((result = rs_compress_new(v, 0, 1, &job->compress)) != RS_DONE)
+            return result;
+    } else if (v != RS_DELTA_MAGIC) {
         rs_log(RS_LOG_ERR,
                "got magic number %#x rather than expected value %#x",
                v, RS_DELTA_MAGIC);
@@ -290,8 +803,33 @@ rs_patch_begin(rs_copy_cb *copy_cb, void *copy_arg)
 
     job->copy_cb = copy_cb;
     job->copy_arg = copy_arg;
+    job->copy_direct_min = RS_PATCH_DIRECT_MIN;
 
     rs_mdfour_begin(&job->output_md4);
 
     return job;
 }
+
+
+void rs_patch_set_prefetch(rs_job_t *job, rs_prefetch_cb *prefetch_cb,
+                           void *prefetch_arg)
+{
+    job->prefetch_cb = prefetch_cb;
+    job->prefetch_arg = prefetch_arg;
+    job->prefetch_cmds = 0;
+}
+
+
+rs_job_t *
+rs_patch_begin_batch(rs_copy_batch_cb *copy_batch_cb, void *copy_arg)
+{
+    rs_job_t *job = rs_patch_begin(NULL, NULL);
+    struct rs_patch_batch *b = rs_alloc_struct(struct rs_patch_batch);
+
+    b->cb = copy_batch_cb;
+    b->arg = copy_arg;
+    b->buf = rs_alloc(RS_PATCH_BATCH_BYTES, "basis batch buffer");
+    job->copy_batch = b;
+
+    return job;
+}
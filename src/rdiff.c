@@ -29,10 +29,6 @@
 /*
  * rdiff.c -- Command-line network-delta tool.
  *
- * TODO: Add a -z option to gzip/gunzip patches.  This would be
- * somewhat useful, but more importantly a good test of the streaming
- * API.  Also add -I for bzip2.
- *
  * If built with debug support and we have mcheck, then turn it on.
  * (Optionally?)
  *
@@ -66,6 +62,8 @@
 #include "util.h"
 #include "trace.h"
 #include "isprefix.h"
+#include "whole.h"
+#include "buf.h"
 
 
 #define PROGRAM "rdiff"
@@ -75,8 +73,15 @@ static size_t strong_len = 0;
 
 static int show_stats = 0;
 
+static int threads = 1;
+static char *delta_basis = NULL;
+static int self_copy = 0;
+static int self_window = 0;
+static int inplace = 0;
+
 static int bzip2_level = 0;
 static int gzip_level  = 0;
+static int gzip_primed = 0;
 
 
 enum {
@@ -89,7 +94,7 @@ char *rs_hash_name;
 const struct poptOption opts[] = {
     { "verbose",     'v', POPT_ARG_NONE, 0,             'v' },
     { "version",     'V', POPT_ARG_NONE, 0,             'V' },
-    { "input-size",  'I', POPT_ARG_INT,  &rs_inbuflen },
+    { "input-size",  'I', POPT_ARG_INT,  &rs_inbuflen,  'I' },
     { "output-size", 'O', POPT_ARG_INT,  &rs_outbuflen },
     { "hash",        'H', POPT_ARG_STRING, &rs_hash_name },
     { "help",        '?', POPT_ARG_NONE, 0,             'h' },
@@ -100,7 +105,13 @@ const struct poptOption opts[] = {
     { "stats",        0,  POPT_ARG_NONE, &show_stats },
     { "gzip",        'z', POPT_ARG_NONE, 0,             OPT_GZIP },
     { "bzip2",       'i', POPT_ARG_NONE, 0,             OPT_BZIP2 },
+    { "primed",       0,  POPT_ARG_NONE, &gzip_primed },
     { "paranoia",     0,  POPT_ARG_NONE, &rs_roll_paranoia },
+    { "threads",      0,  POPT_ARG_INT,  &threads },
+    { "basis",        0,  POPT_ARG_STRING, &delta_basis },
+    { "self-copy",    0,  POPT_ARG_NONE, &self_copy },
+    { "self-window",  0,  POPT_ARG_INT,  &self_window },
+    { "inplace",      0,  POPT_ARG_NONE, &inplace },
     { 0 }
 };
 
@@ -134,22 +145,30 @@ static void help(void) {
     printf("Usage: rdiff [OPTIONS] signature [BASIS [SIGNATURE]]\n"
            "             [OPTIONS] delta SIGNATURE [NEWFILE [DELTA]]\n"
            "             [OPTIONS] patch BASIS [DELTA [NEWFILE]]\n"
+           "             [OPTIONS] patch --inplace BASIS [DELTA]\n"
            "\n"
            "Options:\n"
            "  -v, --verbose             Trace internal processing\n"
            "  -V, --version             Show program version\n"
            "  -?, --help                Show this help message\n"
            "  -s, --statistics          Show performance statistics\n"
+           "      --threads=N           Use N threads for signature, delta and patch\n"
            "Signature generation options:\n"
            "  -H, --hash=ALG            Hash algorithm: blake2 (default), md4\n"
            "Delta-encoding options:\n"
            "  -b, --block-size=BYTES    Signature block size\n"
            "  -S, --sum-size=BYTES      Set signature strength\n"
            "      --paranoia            Verify all rolling checksums\n"
+           "      --basis=FILE          Read the basis to extend matches\n"
+           "      --self-copy           Copy repeated data from earlier output\n"
+           "      --self-window=BYTES   How far back self copies reach\n"
+           "Patch options:\n"
+           "      --inplace             Rewrite BASIS rather than making NEWFILE\n"
            "IO options:\n"
-           "  -I, --input-size=BYTES    Input buffer size\n"
+           "  -I, --input-size=BYTES    Input buffer size, not mapping files\n"
            "  -O, --output-size=BYTES   Output buffer size\n"
            "  -z, --gzip[=LEVEL]        gzip-compress deltas\n"
+           "      --primed              Prime gzip with the matched data\n"
            "  -i, --bzip2[=LEVEL]       bzip2-compress deltas\n"
            );
 }
@@ -159,16 +178,13 @@ static void rdiff_show_version(void)
 {
     char const *bzlib = "", *zlib = "", *trace = "";
 
-#if 0
-    /* Compression isn't implemented so don't mention it. */
-#ifdef HAVE_LIBZ
+#ifdef HAVE_ZLIB_H
     zlib = ", gzip";
 #endif
 
-#ifdef HAVE_LIBBZ2
+#ifdef HAVE_BZLIB_H
     bzlib = ", bzip2";
 #endif
-#endif
 
 #ifndef DO_RS_TRACE
     trace = ", trace disabled";
@@ -209,6 +225,11 @@ static void rdiff_options(poptContext opcon)
             rs_trace_set_level(RS_LOG_DEBUG);
             break;
 
+        case 'I':
+            /* read input through a buffer of that size, not a map */
+            rs_map_input = 0;
+            break;
+
         case OPT_GZIP:
         case OPT_BZIP2:
             if ((a = poptGetOptArg(opcon))) {
@@ -223,8 +244,7 @@ static void rdiff_options(poptContext opcon)
                 else
                     bzip2_level = 9;      /* demand the best */
             }
-            rs_error("sorry, compression is not really implemented yet");
-            exit(RS_UNIMPLEMENTED);
+            break;
 
         default:
             bad_option(opcon, c);
@@ -263,8 +283,8 @@ static rs_result rdiff_sig(poptContext opcon)
         return RS_PARAM_ERROR;
     }
 
-    result = rs_sig_file(basis_file, sig_file, block_len, strong_len,
-                         sig_magic, &stats);
+    result = rs_sig_file_threads(basis_file, sig_file, block_len, strong_len,
+                                 sig_magic, threads, &stats);
 
     rs_file_close(sig_file);
     rs_file_close(basis_file);
@@ -280,11 +300,13 @@ static rs_result rdiff_sig(poptContext opcon)
 
 static rs_result rdiff_delta(poptContext opcon)
 {
-    FILE            *sig_file, *new_file, *delta_file;
+    FILE            *sig_file, *new_file, *delta_file, *basis_file = NULL;
+    rs_filemap_t    *basis_fm = NULL;
     char const      *sig_name;
     rs_result       result;
     rs_signature_t  *sumset;
     rs_stats_t      stats;
+    rs_job_t        *job;
 
     if (!(sig_name = poptGetArg(opcon))) {
         rdiff_usage("Usage for delta: "
@@ -305,11 +327,37 @@ static rs_result rdiff_delta(poptContext opcon)
     if (show_stats)
         rs_log_stats(&stats);
 
-    if ((result = rs_build_hash_table(sumset)) != RS_DONE)
-        return result;
-
-    result = rs_delta_file(sumset, new_file, delta_file, &stats);
+    if (delta_basis) {
+        basis_file = rs_file_open(delta_basis, "rb");
+        if ((basis_fm = rs_filemap_new(basis_file)))
+            job = rs_delta_begin_basis(sumset, rs_filemap_copy_cb, basis_fm);
+        else
+            job = rs_delta_begin_basis(sumset, rs_file_copy_cb, basis_file);
+    } else {
+        job = rs_delta_begin_threads(sumset, threads);
+    }
 
+    if (gzip_primed)
+        result = rs_delta_set_format(job, RS_DELTA_ZLIB_PRIMED_MAGIC,
+                                     gzip_level);
+    else if (gzip_level)
+        result = rs_delta_set_format(job, RS_DELTA_ZLIB_MAGIC, gzip_level);
+    else if (bzip2_level)
+        result = rs_delta_set_format(job, RS_DELTA_BZIP2_MAGIC, bzip2_level);
+
+    if (result == RS_DONE && (self_copy || self_window))
+        result = rs_delta_set_self_copy(job, self_window ? self_window
+                                        : RS_DEFAULT_SELF_WINDOW);
+
+    if (result == RS_DONE)
+        result = rs_whole_run(job, new_file, delta_file);
+    memcpy(&stats, rs_job_statistics(job), sizeof stats);
+    rs_job_free(job);
+
+    if (basis_fm)
+        rs_filemap_free(basis_fm);
+    if (basis_file)
+        rs_file_close(basis_file);
     rs_free_sumset(sumset);
 
     rs_file_close(delta_file);
@@ -324,6 +372,34 @@ static rs_result rdiff_delta(poptContext opcon)
 
 
 
+static rs_result rdiff_patch_inplace(poptContext opcon, char const *basis_name)
+{
+    /*  patch --inplace BASIS [DELTA] */
+    FILE               *basis_file, *delta_file;
+    rs_stats_t          stats;
+    rs_result           result;
+
+    if (!strcmp(basis_name, "-")) {
+        rdiff_usage("rdiff: patch --inplace needs a BASIS file");
+        return RS_SYNTAX_ERROR;
+    }
+    basis_file = rs_file_open(basis_name, "r+b");
+    delta_file = rs_file_open(poptGetArg(opcon), "rb");
+
+    rdiff_no_more_args(opcon);
+
+    result = rs_patch_inplace_file(basis_file, delta_file, &stats);
+
+    rs_file_close(delta_file);
+    rs_file_close(basis_file);
+
+    if (show_stats)
+        rs_log_stats(&stats);
+
+    return result;
+}
+
+
 static rs_result rdiff_patch(poptContext opcon)
 {
     /*  patch BASIS [DELTA [NEWFILE]] */
@@ -337,6 +413,8 @@ static rs_result rdiff_patch(poptContext opcon)
                     "rdiff [OPTIONS] patch BASIS [DELTA [NEW]]");
         return RS_SYNTAX_ERROR;
     }
+    if (inplace)
+        return rdiff_patch_inplace(opcon, basis_name);
 
     basis_file = rs_file_open(basis_name, "rb");
     delta_file = rs_file_open(poptGetArg(opcon), "rb");
@@ -344,7 +422,12 @@ static rs_result rdiff_patch(poptContext opcon)
 
     rdiff_no_more_args(opcon);
 
+#ifdef HAVE_UNISTD_H
+    result = rs_patch_fd_threads(fileno(basis_file), fileno(delta_file),
+                                 fileno(new_file), threads, &stats);
+#else
     result = rs_patch_file(basis_file, delta_file, new_file, &stats);
+#endif
 
     rs_file_close(new_file);
     rs_file_close(delta_file);
@@ -30,6 +30,7 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -40,43 +41,90 @@
 #include "netint.h"
 #include "util.h"
 #include "stream.h"
+#include "rollsum.h"
+#include "search.h"
 
 
 static rs_result rs_loadsig_s_weak(rs_job_t *job);
 static rs_result rs_loadsig_s_strong(rs_job_t *job);
 
+/*
+ * The most blocks that a size hint can make the job allocate before any
+ * have been read.  Past that the arrays double as they fill, but never
+ * beyond the hint while the signature hasn't reached it, so a wrong hint
+ * costs at most twice the memory of the blocks actually read.
+ */
+#define RS_LOADSIG_HINT_MAX (1 << 16)
+
+
+/*
+ * How many blocks the size hint says there are, or 0 if there is no
+ * hint or it can't be the length of a signature with this header: three
+ * words, then a weak sum and a strong sum for each block.
+ */
+static int rs_loadsig_hint_blocks(rs_job_t *job)
+{
+    rs_long_t           len = job->sig_len_hint - 12;
+    rs_long_t           rec = 4 + job->strong_sum_len;
+
+    if (len <= 0 || len % rec || len / rec > INT_MAX)
+        return 0;
+    return (int) (len / rec);
+}
+
+
+/*
+ * Make room for another block in the signature.
+ */
+static rs_result rs_loadsig_grow(rs_job_t *job)
+{
+    rs_signature_t      *sig = job->signature;
+    int                 hint = rs_loadsig_hint_blocks(job);
+    int                 size;
+
+    if (sig->size > INT_MAX / 2) {
+        rs_error("too many blocks in signature");
+        return RS_MEM_ERROR;
+    }
+    if (sig->size)
+        size = 2 * sig->size;
+    else if (hint)
+        size = hint < RS_LOADSIG_HINT_MAX ? hint : RS_LOADSIG_HINT_MAX;
+    else
+        size = 1024;
+    if (hint > sig->count && size > hint)
+        size = hint;
+    return rs_sumset_reserve(sig, size);
+}
+
 
 
 /**
- * Add a just-read-in checksum pair to the signature block.
+ * Add a just-read-in checksum pair to the signature block.  The blocks
+ * are added to the search index a few at a time as they come in, so
+ * that the signature is ready to use as soon as it has all been read.
  */
 static rs_result rs_loadsig_add_sum(rs_job_t *job, rs_strong_sum_t *strong)
 {
-    size_t              new_size;
     rs_signature_t      *sig = job->signature;
-    rs_block_sig_t      *asignature;
 
+    if (sig->count == sig->size && rs_loadsig_grow(job) != RS_DONE)
+        return RS_MEM_ERROR;
     sig->count++;
-    new_size = sig->count * sizeof(rs_block_sig_t);
 
-    sig->block_sigs = realloc(sig->block_sigs, new_size);
-    
-    if (sig->block_sigs == NULL) {
+    sig->weak_sums[sig->count - 1] = job->weak_sig;
+    memcpy(rs_sig_strong_sum(sig, sig->count - 1), strong,
+           sig->strong_sum_len);
+    if (sig->count - sig->indexed >= RS_SEARCH_AHEAD
+        && rs_search_add_blocks(sig, 0) != RS_DONE)
         return RS_MEM_ERROR;
-    }
-    asignature = &(sig->block_sigs[sig->count - 1]);
-
-    asignature->weak_sum = job->weak_sig;
-    asignature->i = sig->count;
-
-    memcpy(asignature->strong_sum, strong, sig->strong_sum_len);
 
     if (rs_trace_enabled()) {
         char                hexbuf[RS_MAX_STRONG_SUM_LENGTH * 2 + 2];
         rs_hexify(hexbuf, strong, sig->strong_sum_len);
 
-        rs_trace("read in checksum: weak=%#x, strong=%s", asignature->weak_sum,
-                 hexbuf);
+        rs_trace("read in checksum: weak=%#x, strong=%s",
+                 sig->weak_sums[sig->count - 1], hexbuf);
     }
 
     job->stats.sig_blocks++;
@@ -94,7 +142,8 @@ static rs_result rs_loadsig_s_weak(rs_job_t *job)
     if (result == RS_DONE)
         ;
     else if (result == RS_INPUT_ENDED) /* ending here is OK */
-        return RS_DONE;
+        /* Index the last few blocks. */
+        return rs_build_hash_table(job->signature);
     else
         return result;
 
@@ -206,3 +255,9 @@ rs_job_t *rs_loadsig_begin(rs_signature_t **signature)
 
     return job;
 }
+
+
+void rs_loadsig_set_size(rs_job_t *job, rs_long_t sig_len)
+{
+    job->sig_len_hint = sig_len;
+}
@@ -0,0 +1,184 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * rollsum-x86 -- SSE2, SSSE3 and AVX2 versions of RollsumUpdate()
+ *
+ * based on rollsum.c, Copyright (C) 2003 by Donovan Baarda
+ * <abo@minkirri.apana.org.au>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * These give bit-for-bit the same s1 and s2 as RollsumUpdateC(), which
+ * stays the reference.  Over a run of n bytes x[0..n-1], starting from
+ * s1 and s2,
+ *
+ *   s1' = s1 + sum(x[i]) + n*OFFSET
+ *   s2' = s2 + n*s1 + sum((n-i)*x[i]) + OFFSET*n*(n+1)/2
+ *
+ * The vector loop accumulates the two sums over the raw bytes in 32-bit
+ * lanes, processing V bytes at a time:
+ *
+ *   vs1 = sum of the bytes seen so far,
+ *   vps = sum of vs1 before each step, so V*vps weights every earlier
+ *         vector by the number of bytes that came after it,
+ *   vs2 = sum of the bytes in each vector weighted V..1.
+ *
+ * The run is limited to CHUNK bytes so that none of the lanes can
+ * overflow, and then folded into the unsigned long s1 and s2 using the
+ * formulas above, which wrap exactly as the scalar loop does.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_X86_SIMD
+
+#include <immintrin.h>
+
+#include "rollsum.h"
+
+/* Largest run summed in 32-bit lanes: vps can reach about
+ * (CHUNK/V)^2 * 255 * V/2, which must stay below 2^32. */
+#define CHUNK 8192
+
+#define FOLD(n, vs1, vps, vs2, V) {                                     \
+    s2 += (n)*s1 + (V)*(unsigned long)(vps) + (vs2)                     \
+        + ROLLSUM_CHAR_OFFSET*(unsigned long)(n)*((n)+1)/2;             \
+    s1 += (vs1) + ROLLSUM_CHAR_OFFSET*(unsigned long)(n);               \
+}
+
+#define TAIL {                                                          \
+    while (len != 0) {                                                  \
+        s1 += (*buf++ + ROLLSUM_CHAR_OFFSET);                           \
+        s2 += s1;                                                       \
+        len--;                                                          \
+    }                                                                   \
+    sum->s1=s1;                                                         \
+    sum->s2=s2;                                                         \
+}
+
+
+__attribute__((target("sse2")))
+static inline unsigned long hsum_sse2(__m128i v) {
+    unsigned int a[4];
+
+    _mm_storeu_si128((__m128i *) a, v);
+    return (unsigned long) a[0] + a[1] + a[2] + a[3];
+}
+
+
+__attribute__((target("sse2")))
+void RollsumUpdateSSE2(Rollsum *sum,const unsigned char *buf,unsigned int len) {
+    unsigned long s1 = sum->s1;
+    unsigned long s2 = sum->s2;
+    const __m128i zero = _mm_setzero_si128();
+    /* weights for bytes 0..7 and 8..15 once widened to 16 bits */
+    const __m128i wlo = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+    const __m128i whi = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+
+    sum->count+=len;
+    while (len >= 16) {
+        unsigned int n = len < CHUNK ? len & ~15u : CHUNK;
+        unsigned int k;
+        __m128i vs1 = zero, vps = zero, vs2 = zero;
+
+        for (k = n / 16; k; k--) {
+            __m128i v = _mm_loadu_si128((const __m128i *) buf);
+
+            vps = _mm_add_epi32(vps, vs1);
+            vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), wlo));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), whi));
+            buf += 16;
+        }
+        FOLD(n, hsum_sse2(vs1), hsum_sse2(vps), hsum_sse2(vs2), 16);
+        len -= n;
+    }
+    TAIL;
+}
+
+
+__attribute__((target("ssse3")))
+void RollsumUpdateSSSE3(Rollsum *sum,const unsigned char *buf,unsigned int len) {
+    unsigned long s1 = sum->s1;
+    unsigned long s2 = sum->s2;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i w = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+                                    8, 7, 6, 5, 4, 3, 2, 1);
+
+    sum->count+=len;
+    while (len >= 16) {
+        unsigned int n = len < CHUNK ? len & ~15u : CHUNK;
+        unsigned int k;
+        __m128i vs1 = zero, vps = zero, vs2 = zero;
+
+        for (k = n / 16; k; k--) {
+            __m128i v = _mm_loadu_si128((const __m128i *) buf);
+
+            vps = _mm_add_epi32(vps, vs1);
+            vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(v, w), ones));
+            buf += 16;
+        }
+        FOLD(n, hsum_sse2(vs1), hsum_sse2(vps), hsum_sse2(vs2), 16);
+        len -= n;
+    }
+    TAIL;
+}
+
+
+__attribute__((target("avx2")))
+static inline unsigned long hsum_avx2(__m256i v) {
+    unsigned int a[8];
+
+    _mm256_storeu_si256((__m256i *) a, v);
+    return (unsigned long) a[0] + a[1] + a[2] + a[3]
+        + a[4] + a[5] + a[6] + a[7];
+}
+
+
+__attribute__((target("avx2")))
+void RollsumUpdateAVX2(Rollsum *sum,const unsigned char *buf,unsigned int len) {
+    unsigned long s1 = sum->s1;
+    unsigned long s2 = sum->s2;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i w = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                       24, 23, 22, 21, 20, 19, 18, 17,
+                                       16, 15, 14, 13, 12, 11, 10, 9,
+                                       8, 7, 6, 5, 4, 3, 2, 1);
+
+    sum->count+=len;
+    while (len >= 32) {
+        unsigned int n = len < CHUNK ? len & ~31u : CHUNK;
+        unsigned int k;
+        __m256i vs1 = zero, vps = zero, vs2 = zero;
+
+        for (k = n / 32; k; k--) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) buf);
+
+            vps = _mm256_add_epi32(vps, vs1);
+            vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(v, zero));
+            vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(v, w), ones));
+            buf += 32;
+        }
+        FOLD(n, hsum_avx2(vs1), hsum_avx2(vps), hsum_avx2(vs2), 32);
+        len -= n;
+    }
+    TAIL;
+}
+
+#endif /* HAVE_X86_SIMD */
@@ -19,6 +19,8 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
+#include "config.h"
+
 #include "rollsum.h"
 
 #define DO1(buf,i)  {s1 += buf[i]; s2 += s1;}
@@ -28,7 +30,7 @@
 #define DO16(buf)   DO8(buf,0); DO8(buf,8);
 #define OF16(off)  {s1 += 16*off; s2 += 136*off;}
 
-void RollsumUpdate(Rollsum *sum,const unsigned char *buf,unsigned int len) {
+void RollsumUpdateC(Rollsum *sum,const unsigned char *buf,unsigned int len) {
     /* ANSI C says no overflow for unsigned. 
      zlib's adler 32 goes to extra effort to avoid overflow*/
     unsigned long s1 = sum->s1;
@@ -49,3 +51,29 @@ void RollsumUpdate(Rollsum *sum,const unsigned char *buf,unsigned int len) {
     sum->s1=s1;
     sum->s2=s2;
 }
+
+static void RollsumUpdateSelect(Rollsum *sum,const unsigned char *buf,unsigned int len);
+
+static RollsumUpdateFn *RollsumUpdateImpl = RollsumUpdateSelect;
+
+/* Pick the implementation on first use. Several threads might do this at
+ * once, but they will all store the same value. */
+static void RollsumUpdateSelect(Rollsum *sum,const unsigned char *buf,unsigned int len) {
+    RollsumUpdateFn *impl = RollsumUpdateC;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        impl = RollsumUpdateAVX2;
+    else if (__builtin_cpu_supports("ssse3"))
+        impl = RollsumUpdateSSSE3;
+    else if (__builtin_cpu_supports("sse2"))
+        impl = RollsumUpdateSSE2;
+#endif
+    RollsumUpdateImpl = impl;
+    impl(sum, buf, len);
+}
+
+void RollsumUpdate(Rollsum *sum,const unsigned char *buf,unsigned int len) {
+    RollsumUpdateImpl(sum, buf, len);
+}
@@ -36,6 +36,17 @@ typedef struct _Rollsum {
 } Rollsum;
 
 void RollsumUpdate(Rollsum *sum,const unsigned char *buf,unsigned int len);
+
+/* RollsumUpdate() uses the fastest of these that the CPU supports. They
+ * all give exactly the same result as the portable RollsumUpdateC(). */
+typedef void RollsumUpdateFn(Rollsum *sum,const unsigned char *buf,unsigned int len);
+void RollsumUpdateC(Rollsum *sum,const unsigned char *buf,unsigned int len);
+#ifdef HAVE_X86_SIMD
+void RollsumUpdateSSE2(Rollsum *sum,const unsigned char *buf,unsigned int len);
+void RollsumUpdateSSSE3(Rollsum *sum,const unsigned char *buf,unsigned int len);
+void RollsumUpdateAVX2(Rollsum *sum,const unsigned char *buf,unsigned int len);
+#endif
+
 /* The following are implemented as macros.
 void RollsumInit(Rollsum *sum);
 void RollsumRotate(Rollsum *sum,unsigned char out, unsigned char in);
@@ -38,8 +38,11 @@
  * essentially like an internal pipe, which on any given read request
  * may or may not be able to actually supply the data.
  *
- * As a future optimization, we might try to take data directly from the
- * input buffer if there's already enough there.
+ * rs_scoop_readahead() takes data directly from the input buffer if
+ * there's already enough there.  Generating a delta goes further and
+ * borrows the whole input buffer as the scoop with rs_scoop_borrow(), so
+ * that only what is left over when the job returns to the caller has to
+ * be copied, by rs_scoop_release().
  */
 
 /*
@@ -74,10 +77,14 @@
 
 /**
  * Try to accept a from the input buffer to get LEN bytes in the scoop.
+ *
+ * The data already in the scoop is only moved down to the front of the
+ * buffer when there isn't room for the rest behind it.
  */
 void rs_scoop_input(rs_job_t *job, size_t len)
 {
     rs_buffers_t *stream = job->stream;
+    rs_byte_t *old_next = job->scoop_next;
     size_t tocopy;
 
     assert(len > job->scoop_avail);
@@ -85,7 +92,7 @@ void rs_scoop_input(rs_job_t *job, size_t len)
     if (job->scoop_alloc < len) {
         /* need to allocate a new buffer, too */
         rs_byte_t *newbuf;
-        int newsize = 2 * len;
+        size_t newsize = 2 * len;
         newbuf = rs_alloc(newsize, "scoop buffer");
         if (job->scoop_avail)
             memcpy(newbuf, job->scoop_next, job->scoop_avail);
@@ -95,19 +102,24 @@ void rs_scoop_input(rs_job_t *job, size_t len)
         rs_trace("resized scoop buffer to " PRINTF_FORMAT_U64 " bytes from " PRINTF_FORMAT_U64 "",
                  PRINTF_CAST_U64(newsize), PRINTF_CAST_U64(job->scoop_alloc));
         job->scoop_alloc = newsize;
-    } else {
+    } else if (job->scoop_borrowed
+               || job->scoop_next + len > job->scoop_buf + job->scoop_alloc) {
         /* this buffer size is fine, but move the existing
          * data down to the front. */
         memmove(job->scoop_buf, job->scoop_next, job->scoop_avail);
         job->scoop_next = job->scoop_buf;
     }
+    job->scoop_borrowed = 0;
+    if (job->scoop_mirror)
+        job->scoop_mirror = job->scoop_next + (job->scoop_mirror - old_next);
 
     /* take as much input as is available, to give up to LEN bytes
      * in the scoop. */
     tocopy = len - job->scoop_avail;
     if (tocopy > stream->avail_in)
         tocopy = stream->avail_in;
-    assert(tocopy + job->scoop_avail <= job->scoop_alloc);
+    assert(job->scoop_next + job->scoop_avail + tocopy
+           <= job->scoop_buf + job->scoop_alloc);
 
     memcpy(job->scoop_next + job->scoop_avail, stream->next_in, tocopy);
     rs_trace("accepted " PRINTF_FORMAT_U64 " bytes from input to scoop", PRINTF_CAST_U64(tocopy));
@@ -117,6 +129,99 @@ void rs_scoop_input(rs_job_t *job, size_t len)
 }
 
 
+/**
+ * Like rs_scoop_input(), but remember where the input taken into the
+ * scoop starts, so that once everything before it has been used up
+ * rs_scoop_borrow() can go back to the same data in the input buffer.
+ *
+ * This only holds until the job returns to the caller.
+ */
+void rs_scoop_mirror(rs_job_t *job, size_t len)
+{
+    size_t avail = job->scoop_avail;
+
+    rs_scoop_input(job, len);
+    if (!job->scoop_mirror)
+        job->scoop_mirror = job->scoop_next + avail;
+}
+
+
+/**
+ * Use the rest of the input buffer as the scoop, rather than copying it.
+ *
+ * The scoop must be empty, or hold only data taken by rs_scoop_mirror(),
+ * which is still there just before the input cursor.  All the input is
+ * accepted, but the data stays where the caller put it, so
+ * rs_scoop_release() must be called before returning to the caller.
+ */
+void rs_scoop_borrow(rs_job_t *job)
+{
+    rs_buffers_t *stream = job->stream;
+
+    assert(!job->scoop_avail
+           || (job->scoop_mirror && job->scoop_next >= job->scoop_mirror));
+    stream->next_in -= job->scoop_avail;
+    stream->avail_in += job->scoop_avail;
+    rs_trace("borrowed " PRINTF_FORMAT_U64 " bytes of input as the scoop, "
+             PRINTF_FORMAT_U64 " of them already scooped",
+             PRINTF_CAST_U64(stream->avail_in),
+             PRINTF_CAST_U64(job->scoop_avail));
+    job->scoop_next = (rs_byte_t *) stream->next_in;
+    job->scoop_avail = stream->avail_in;
+    job->scoop_borrowed = 1;
+    job->scoop_mirror = NULL;
+    stream->next_in += stream->avail_in;
+    stream->avail_in = 0;
+}
+
+
+/**
+ * Called before returning to the caller, to copy what is still needed of
+ * a borrowed input buffer into the scoop buffer, and to forget about any
+ * mirrored input.
+ *
+ * Only the data still waiting to be copied out by the tube, the scanned
+ * data not yet sent (\p scoop_pos bytes) and one block of lookahead after
+ * it are kept.  The rest has not been looked at yet, so it is given back
+ * to the caller by moving the input cursor back over it, and is scooped
+ * again from the next input buffer.
+ */
+void rs_scoop_release(rs_job_t *job)
+{
+    rs_buffers_t *stream = job->stream;
+    rs_byte_t *data = job->scoop_next;
+    size_t keep;
+
+    job->scoop_mirror = NULL;
+    if (!job->scoop_borrowed)
+        return;
+    job->scoop_borrowed = 0;
+
+    keep = job->scoop_pos + job->block_len;
+    if (job->copy_len && !job->copy_buf)
+        keep += job->copy_len;
+    if (keep < job->scoop_avail) {
+        /* the borrowed scoop always runs up to the input cursor */
+        stream->next_in -= job->scoop_avail - keep;
+        stream->avail_in += job->scoop_avail - keep;
+        rs_trace("gave back " PRINTF_FORMAT_U64 " bytes of borrowed input",
+                 PRINTF_CAST_U64(job->scoop_avail - keep));
+        job->scoop_avail = keep;
+    }
+
+    if (job->scoop_alloc < job->scoop_avail) {
+        free(job->scoop_buf);
+        job->scoop_alloc = 2 * job->scoop_avail;
+        job->scoop_buf = rs_alloc(job->scoop_alloc, "scoop buffer");
+    }
+    job->scoop_next = job->scoop_buf;
+    if (job->scoop_avail)
+        memcpy(job->scoop_next, data, job->scoop_avail);
+    rs_trace("kept " PRINTF_FORMAT_U64 " bytes of borrowed input in the scoop",
+             PRINTF_CAST_U64(job->scoop_avail));
+}
+
+
 /**
  * Advance the input cursor forward \p len bytes.  This is used after
  * doing readahead, when you decide you want to keep it.  \p len must
@@ -26,11 +26,9 @@
  */
 
 /*
- * TODO: The common case is that the next block in both streams
- * match. Can we make that a bit faster at all?  We'd need to perhaps
- * add a link forward between blocks in the sum_struct corresponding
- * to the order they're found in the input; then before doing a search
- * we can just check that pointer.
+ * The common case is that the next block in both streams matches, so
+ * the caller can pass in the block that follows the previous match,
+ * and it is checked before doing any search.
  */
 
 #include "config.h"
@@ -42,119 +40,209 @@
 #include "trace.h"
 #include "util.h"
 #include "sumset.h"
+#include "rollsum.h"
 #include "search.h"
 #include "checksum.h"
 
-#define TABLE_SIZE (1<<16)
-#define NULL_TAG (-1)
+/*
+ * The index is an open-addressed hash table keyed on the full 32-bit
+ * weak sum.  It is made of cache-line sized buckets of
+ * RS_HASH_BUCKET_LEN entries, probed linearly: a block goes into the
+ * first bucket at or after its home bucket that has room.  So a
+ * lookup only needs to go on to the next bucket when this one is
+ * full, and with the table at most half full a miss is nearly always
+ * decided by comparing against the weak sums of a single bucket,
+ * without any data-dependent branches.
+ */
+#define CACHE_LINE 64
 
-#define gettag2(s1,s2) (((s1) + (s2)) & 0xFFFF)
-#define gettag(sum) gettag2((sum)&0xFFFF,(sum)>>16)
+#ifdef __GNUC__
+#  define rs_prefetch(p) __builtin_prefetch(p)
+#else
+#  define rs_prefetch(p) ((void) 0)
+#endif
 
-static void swap(rs_target_t *t1, rs_target_t *t2) {
-    unsigned short ts = t1->t;
-    t1->t = t2->t;
-    t2->t = ts;
 
-    int ti = t1->i;
-    t1->i = t2->i;
-    t2->i = ti;
+/*
+ * Mix all 32 bits of the weak sum into the bucket number.  The low
+ * bits of the rollsum are s1, which is poorly distributed for short
+ * blocks, so they can't be used directly.  This is the finaliser
+ * from MurmurHash3.
+ */
+static inline unsigned int rs_hash_weak(rs_weak_sum_t weak_sum)
+{
+    unsigned int h = weak_sum;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
 }
 
-static int rs_compare_targets(rs_target_t const *t1, rs_target_t const *t2, rs_signature_t * sums) {
-    int v = (int) t1->t - (int) t2->t;
-    if (v != 0)
-        return v;
 
-    rs_weak_sum_t w1 = sums->block_sigs[t1->i].weak_sum;
-    rs_weak_sum_t w2 = sums->block_sigs[t2->i].weak_sum;
-
-    v = (w1 > w2) - (w1 < w2);
-    if (v != 0)
-        return v;
-
-    return memcmp(sums->block_sigs[t1->i].strong_sum,
-            sums->block_sigs[t2->i].strong_sum,
-            sums->strong_sum_len);
+static void rs_calc_strong_sum(rs_signature_t const *sig,
+                               const rs_byte_t *buf, size_t len,
+                               rs_strong_sum_t *sum)
+{
+    if (sig->magic == RS_BLAKE2_SIG_MAGIC) {
+        rs_calc_blake2_sum(buf, len, sum);
+    } else if (sig->magic == RS_MD4_SIG_MAGIC) {
+        rs_calc_md4_sum(buf, len, sum);
+    } else {
+        /* Bad input data is checked in rs_delta_begin, so this
+         * should never be reached. */
+        rs_fatal("Unknown signature algorithm %#x", sig->magic);
+    }
 }
 
-static void heap_sort(rs_signature_t * sums) {
-    unsigned int i, j, n, k, p;
-    for (i = 1; i < sums->count; ++i) {
-        for (j = i; j > 0;) {
-            p = (j - 1) >> 1;
-            if (rs_compare_targets(&sums->targets[j], &sums->targets[p], sums) > 0)
-                swap(&sums->targets[j], &sums->targets[p]);
-            else
-                break;
-            j = p;
-        }
-    }
 
-    for (n = sums->count - 1; n > 0;) {
-        swap(&sums->targets[0], &sums->targets[n]);
-        --n;
-        for (i = 0; ((i << 1) + 1) <= n;) {
-            k = (i << 1) + 1;
-            if ((k + 1 <= n) && (rs_compare_targets(&sums->targets[k], &sums->targets[k + 1], sums) < 0))
-                k = k + 1;
-            if (rs_compare_targets(&sums->targets[k], &sums->targets[i], sums) > 0)
-                swap(&sums->targets[k], &sums->targets[i]);
-            else
-                break;
-            i = k;
+/*
+ * Add block I of the signature to the index.  Blocks whose weak and
+ * strong sums are both identical to one already present are not
+ * added again: either of them will do as the source of a copy, and
+ * leaving them out keeps long runs of repeated blocks (such as zero
+ * pages) from filling up whole stretches of the table.  If LATEST is
+ * set, block I takes the place of the one already present instead.
+ */
+static void rs_hash_add(rs_signature_t *sums, int i, int latest)
+{
+    rs_weak_sum_t weak_sum = sums->weak_sums[i];
+    unsigned int h = rs_hash_weak(weak_sum) & sums->hashtable_mask;
+    rs_hash_bucket_t *bucket;
+    int k;
+
+    for (;;) {
+        bucket = &sums->hashtable[h];
+        for (k = 0; k < RS_HASH_BUCKET_LEN && bucket->i[k]; k++) {
+            if (bucket->weak_sum[k] == weak_sum &&
+                !memcmp(rs_sig_strong_sum(sums, bucket->i[k] - 1),
+                        rs_sig_strong_sum(sums, i), sums->strong_sum_len)) {
+                if (latest)
+                    bucket->i[k] = i + 1;
+                return;
+            }
         }
+        if (k < RS_HASH_BUCKET_LEN)
+            break;
+        h = (h + 1) & sums->hashtable_mask;
     }
+    bucket->weak_sum[k] = weak_sum;
+    bucket->i[k] = i + 1;
 }
 
-rs_result
-rs_build_hash_table(rs_signature_t * sums)
+
+/*
+ * Allocate an empty index with room for COUNT blocks, keeping the
+ * table at most half full.  If there isn't the memory, the old index
+ * is left as it was.
+ */
+static rs_result rs_hash_alloc(rs_signature_t *sums, size_t count)
 {
-    int i;
+    size_t nbuckets = 1;
+    void *alloc;
 
-    sums->tag_table = calloc(TABLE_SIZE, sizeof(sums->tag_table[0]));
-    if (!sums->tag_table)
-        return RS_MEM_ERROR;
+    while (nbuckets * RS_HASH_BUCKET_LEN < 2 * count)
+        nbuckets <<= 1;
 
-    if (sums->count > 0) {
-        sums->targets = calloc(sums->count, sizeof(rs_target_t));
-        if (!sums->targets) {
-            free(sums->tag_table);
-            sums->tag_table = NULL;
-            return RS_MEM_ERROR;
-        }
+    alloc = calloc(nbuckets * sizeof(rs_hash_bucket_t) + CACHE_LINE, 1);
+    if (!alloc)
+        return RS_MEM_ERROR;
+    free(sums->hashtable_alloc);
+    sums->hashtable_alloc = alloc;
+    sums->hashtable = (rs_hash_bucket_t *)
+        (((size_t) sums->hashtable_alloc + CACHE_LINE - 1)
+         & ~(size_t) (CACHE_LINE - 1));
+    sums->hashtable_mask = nbuckets - 1;
+    return RS_DONE;
+}
 
-        for (i = 0; i < sums->count; i++) {
-            sums->targets[i].i = i;
-            sums->targets[i].t = gettag(sums->block_sigs[i].weak_sum);
-        }
 
-        heap_sort(sums);
+/*
+ * Add the blocks of a signature that aren't in its index yet, growing
+ * the index when it gets half full.  It is made big enough for all the
+ * blocks the signature has room for, so a signature loaded with a size
+ * hint is only indexed once.
+ *
+ * The home buckets of up to RS_SEARCH_AHEAD blocks are prefetched
+ * before any of them are added, so that adding a large signature isn't
+ * held up waiting for each bucket in turn.
+ *
+ * If LATEST is set, a block identical to one already present takes its
+ * place, so the index always finds the latest copy; otherwise the first
+ * copy is kept.
+ */
+rs_result
+rs_search_add_blocks(rs_signature_t *sums, int latest)
+{
+    size_t size;
+    int i, n;
+
+    if (!sums->hashtable || 2 * (size_t) sums->count
+        > (sums->hashtable_mask + 1) * RS_HASH_BUCKET_LEN) {
+        size = 2 * (size_t) sums->count;
+        if (size < (size_t) sums->size)
+            size = sums->size;
+        if (rs_hash_alloc(sums, size) != RS_DONE)
+            return RS_MEM_ERROR;
+        sums->indexed = 0;
     }
 
-    for (i = 0; i < TABLE_SIZE; i++) {
-        sums->tag_table[i].l = NULL_TAG;
-        sums->tag_table[i].r = NULL_TAG;
+    while (sums->indexed < sums->count) {
+        n = sums->count - sums->indexed;
+        if (n > RS_SEARCH_AHEAD)
+            n = RS_SEARCH_AHEAD;
+        for (i = sums->indexed; i < sums->indexed + n; i++)
+            rs_prefetch(&sums->hashtable[rs_hash_weak(sums->weak_sums[i])
+                                         & sums->hashtable_mask]);
+        for (i = sums->indexed; i < sums->indexed + n; i++)
+            rs_hash_add(sums, i, latest);
+        sums->indexed += n;
     }
+    return RS_DONE;
+}
 
-    for (i = sums->count - 1; i >= 0; i--) {
-        sums->tag_table[sums->targets[i].t].l = i;
-    }
 
-    for (i = 0; i < sums->count; i++) {
-        sums->tag_table[sums->targets[i].t].r = i;
-    }
+rs_result
+rs_build_hash_table(rs_signature_t * sums)
+{
+    if (rs_search_add_blocks(sums, 0) != RS_DONE)
+        return RS_MEM_ERROR;
 
-    rs_trace("rs_build_hash_table done");
+    rs_trace("rs_build_hash_table done, %lu buckets for %d blocks",
+             (unsigned long) sums->hashtable_mask + 1, sums->count);
     return RS_DONE;
 }
 
 
+/*
+ * Check the strong sum of the block at INBUF against block I of the
+ * signature, calculating it first if that hasn't been done yet.
+ */
+static inline int rs_strong_match(rs_signature_t const *sig, int i,
+                                  const rs_byte_t *inbuf, size_t block_len,
+                                  rs_strong_sum_t *strong_sum,
+                                  int *got_strong)
+{
+    if (!*got_strong) {
+        /* Lazy calculate strong sum after finding weak match. */
+        rs_calc_strong_sum(sig, inbuf, block_len, strong_sum);
+        *got_strong = 1;
+    }
+    return !memcmp(*strong_sum, rs_sig_strong_sum(sig, i),
+                   sig->strong_sum_len);
+}
+
 
 /*
  * See if there is a match for the specified block INBUF..BLOCK_LEN in
  * the checksum set, using precalculated WEAK_SUM.
  *
+ * If HINT is a valid block index, that block is tried first, so a
+ * run of blocks in the same order as the basis costs one comparison
+ * per block rather than a search.
+ *
  * If we don't find a match on the weak checksum, then we just give
  * up.  If we do find a weak match, then we proceed to calculate the
  * strong checksum for the current block, and see if it will match
@@ -165,82 +253,143 @@ rs_search_for_block(rs_weak_sum_t weak_sum,
                     const rs_byte_t *inbuf,
                     size_t block_len,
                     rs_signature_t const *sig, rs_stats_t * stats,
-                    rs_long_t * match_where)
+                    int hint, rs_long_t * match_where)
 {
-    /* Caller must have called rs_build_hash_table() by now */
-    if (!sig->tag_table)
-        rs_fatal("Must have called rs_build_hash_table() by now");
-
     rs_strong_sum_t strong_sum;
     int got_strong = 0;
-    int hash_tag = gettag(weak_sum);
-    rs_tag_table_entry_t *bucket = &(sig->tag_table[hash_tag]);
-    int l = bucket->l; /* left bound of search region */
-    int r = bucket->r + 1; /* right bound of search region */
-    int v = 1; /* direction of next move: -ve left, +ve right */
-
-    if (l == NULL_TAG)
-        return 0;
-
-    while (l < r) {
-        int m = (l + r) >> 1; /* midpoint of search region */
-        int i = sig->targets[m].i;
-        rs_block_sig_t *b = &(sig->block_sigs[i]);
-        v = (weak_sum > b->weak_sum) - (weak_sum < b->weak_sum);
-        // v < 0  - weak_sum <  b->weak_sum
-        // v == 0 - weak_sum == b->weak_sum
-        // v > 0  - weak_sum >  b->weak_sum
-
-        if (v == 0) {
-            if (!got_strong) {
-                /* Lazy calculate strong sum after finding weak match. */
-                if(sig->magic == RS_BLAKE2_SIG_MAGIC) {
-                    rs_calc_blake2_sum(inbuf, block_len, &strong_sum);
-                } else if (sig->magic == RS_MD4_SIG_MAGIC) {
-                    rs_calc_md4_sum(inbuf, block_len, &strong_sum);
-                } else {
-                    /* Bad input data is checked in rs_delta_begin, so this
-                     * should never be reached. */
-                    rs_fatal("Unknown signature algorithm %#x", sig->magic);
-                    return 0;
-                }
-                got_strong = 1;
-            }
-            v = memcmp(strong_sum, b->strong_sum, sig->strong_sum_len);
+    unsigned int h, hits;
+    rs_hash_bucket_t const *bucket;
+    int k, i;
+
+    /* Loading the signature indexes it */
+    if (!sig->hashtable)
+        rs_fatal("Signature hasn't been loaded or indexed");
+
+    if (hint >= 0 && hint < sig->count &&
+        sig->weak_sums[hint] == weak_sum) {
+        if (rs_strong_match(sig, hint, inbuf, block_len,
+                            &strong_sum, &got_strong)) {
+            *match_where = (rs_long_t) hint * sig->block_len;
+            return 1;
+        }
+    }
 
-            if (v == 0) {
-                l = m;
-                r = m;
-                break;
+    h = rs_hash_weak(weak_sum) & sig->hashtable_mask;
+    for (;;) {
+        bucket = &sig->hashtable[h];
+
+        /* Compare against the whole bucket at once; this is simple
+         * enough for the compiler to vectorize. */
+        hits = 0;
+        for (k = 0; k < RS_HASH_BUCKET_LEN; k++)
+            hits |= (unsigned int) (bucket->weak_sum[k] == weak_sum) << k;
+
+        for (k = 0; hits; k++, hits >>= 1) {
+            if (!(hits & 1))
+                continue;
+            if (!(i = bucket->i[k]))
+                /* Empty entries have a zero weak sum. */
+                return 0;
+            if (i - 1 == hint)
+                /* Already tried. */
+                continue;
+            if (rs_strong_match(sig, i - 1, inbuf, block_len,
+                                &strong_sum, &got_strong)) {
+                *match_where = (rs_long_t)(i - 1) * sig->block_len;
+                return 1;
             }
+            stats->false_matches++;
         }
 
-        if (v > 0)
-            l = m + 1;
-        else
-            r = m;
+        if (!bucket->i[RS_HASH_BUCKET_LEN - 1])
+            /* This bucket has room, so nothing overflowed past it. */
+            return 0;
+        h = (h + 1) & sig->hashtable_mask;
     }
+}
 
-    if ((l == r) && (l <= bucket->r)) {
-        int i = sig->targets[l].i;
-        rs_block_sig_t *b = &(sig->block_sigs[i]);
-        if (weak_sum != b->weak_sum)
-            return 0;
-        if (!got_strong) {
-            if(sig->magic == RS_BLAKE2_SIG_MAGIC) {
-                rs_calc_blake2_sum(inbuf, block_len, &strong_sum);
-            } else if (sig->magic == RS_MD4_SIG_MAGIC) {
-                rs_calc_md4_sum(inbuf, block_len, &strong_sum);
-            } else {
-                rs_error("Unknown signature algorithm - this is a BUG");
-                return 0; /* FIXME: Is this the best way to handle this? */
+
+/*
+ * Roll SUM, the weak sum of the BLOCK_LEN bytes at BUF, along through
+ * at most N positions while nothing in the index has the weak sum of the
+ * block at the position reached, and return how many positions it
+ * moved.  The byte BLOCK_LEN after each of the N positions must be in
+ * the buffer.
+ *
+ * This is the delta's loop over a run of new data, which has to be
+ * fast: the sum is kept in local variables, and each position costs a
+ * hash and a compare against one bucket, with no calls.  It stops where
+ * rs_search_for_block() might find something, including when the
+ * bucket is full and the search would go on to the next one, and
+ * leaves that position to it.
+ *
+ * With a big signature the buckets are mostly not in the cache, so
+ * rather than wait for each one in turn, the sums and buckets of the
+ * next RS_SEARCH_AHEAD positions are worked out and prefetched first,
+ * and then checked in order.  When one of them stops the run, the sum
+ * is rolled again from the start of the batch up to that position.
+ */
+size_t
+rs_search_miss_run(rs_signature_t const *sig, Rollsum *sum,
+                   const rs_byte_t *buf, size_t block_len, size_t n)
+{
+    rs_hash_bucket_t const *table = sig->hashtable;
+    unsigned int mask = sig->hashtable_mask, hits;
+    rs_hash_bucket_t const *bucket;
+    rs_weak_sum_t weak_sum[RS_SEARCH_AHEAD];
+    unsigned int h[RS_SEARCH_AHEAD];
+    Rollsum r = *sum, start;
+    size_t i, j, m;
+    int k;
+
+    for (i = 0; i < n; i += m) {
+        m = n - i < RS_SEARCH_AHEAD ? n - i : RS_SEARCH_AHEAD;
+        start = r;
+        for (j = 0; j < m; j++) {
+            weak_sum[j] = RollsumDigest(&r);
+            h[j] = rs_hash_weak(weak_sum[j]) & mask;
+            rs_prefetch(&table[h[j]]);
+            RollsumRotate(&r, buf[i + j], buf[i + j + block_len]);
+        }
+        for (j = 0; j < m; j++) {
+            bucket = &table[h[j]];
+            hits = 0;
+            for (k = 0; k < RS_HASH_BUCKET_LEN; k++)
+                hits |= bucket->weak_sum[k] == weak_sum[j];
+            if (hits || bucket->i[RS_HASH_BUCKET_LEN - 1]) {
+                r = start;
+                for (m = 0; m < j; m++)
+                    RollsumRotate(&r, buf[i + m], buf[i + m + block_len]);
+                *sum = r;
+                return i + j;
             }
-            got_strong = 1;
         }
-        v = memcmp(strong_sum, b->strong_sum, sig->strong_sum_len);
-        int token = b->i;
-        *match_where = (rs_long_t)(token - 1) * sig->block_len;
     }
+    *sum = r;
+    return n;
+}
+
 
-    return !v;
+/*
+ * Check whether the N blocks of the signature starting at block A have
+ * the same weak and strong sums as the N blocks starting at block B,
+ * in which case either run can be used as the source of a copy.
+ *
+ * The blocks nearest the end are compared first, because that is
+ * where the runs are most likely to differ when they are used to join
+ * up a run with the block matched after it.
+ */
+int
+rs_search_runs_equal(rs_signature_t const *sig, int a, int b, int n)
+{
+    if (a < 0 || b < 0 || a + n > sig->count || b + n > sig->count)
+        return 0;
+
+    while (n--) {
+        if (sig->weak_sums[a + n] != sig->weak_sums[b + n] ||
+            memcmp(rs_sig_strong_sum(sig, a + n),
+                   rs_sig_strong_sum(sig, b + n), sig->strong_sum_len))
+            return 0;
+    }
+    return 1;
 }
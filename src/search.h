@@ -20,10 +20,25 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+/*
+ * How many blocks or positions the index is worked on at a time, so
+ * that the hash buckets they need can be prefetched together.
+ */
+#define RS_SEARCH_AHEAD 32
+
 int
 rs_search_for_block(rs_weak_sum_t weak_sum,
                     const rs_byte_t *inbuf,
                     size_t block_len,
                     rs_signature_t const *sums, rs_stats_t * stats,
-                    rs_long_t * match_where);
+                    int hint, rs_long_t * match_where);
+
+rs_result
+rs_search_add_blocks(rs_signature_t *sums, int latest);
 
+size_t
+rs_search_miss_run(rs_signature_t const *sig, Rollsum *sum,
+                   const rs_byte_t *buf, size_t block_len, size_t n);
+
+int
+rs_search_runs_equal(rs_signature_t const *sig, int a, int b, int n);
@@ -32,6 +32,7 @@ int rs_buffers_copy(rs_buffers_t *stream, int len);
 int rs_tube_catchup(rs_job_t *);
 void rs_tube_write(rs_job_t *, void const *buf, size_t len);
 void rs_tube_copy(rs_job_t *, int len);
+void rs_tube_copy_buf(rs_job_t *, void const *buf, size_t len);
 int rs_tube_is_idle(rs_job_t const *);
 void rs_check_tube(rs_job_t *);
 
@@ -43,3 +44,6 @@ rs_result rs_scoop_read(rs_job_t *, size_t len, void **ptr);
 rs_result rs_scoop_read_rest(rs_job_t *, size_t *len, void **ptr);
 size_t rs_scoop_total_avail(rs_job_t *job);
 void rs_scoop_input(rs_job_t *job, size_t len);
+void rs_scoop_mirror(rs_job_t *job, size_t len);
+void rs_scoop_borrow(rs_job_t *job);
+void rs_scoop_release(rs_job_t *job);
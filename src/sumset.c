@@ -35,20 +35,52 @@
 void
 rs_free_sumset(rs_signature_t * psums)
 {
-        if (psums->block_sigs)
-                free(psums->block_sigs);
+        if (psums->weak_sums)
+                free(psums->weak_sums);
 
-        if (psums->tag_table)
-		free(psums->tag_table);
+        if (psums->strong_sums)
+                free(psums->strong_sums);
 
-        if (psums->targets)
-                free(psums->targets);
+        if (psums->hashtable_alloc)
+                free(psums->hashtable_alloc);
 
         rs_bzero(psums, sizeof *psums);
         free(psums);
 }
 
 
+/*
+ * Make room for at least SIZE blocks in SUMS.  Adding the blocks one at
+ * a time should ask for a few times as many as are there, so that the
+ * arrays are only copied a few times in all.
+ */
+rs_result
+rs_sumset_reserve(rs_signature_t *sums, int size)
+{
+        rs_weak_sum_t *weak_sums;
+        rs_byte_t *strong_sums;
+
+        if (size <= sums->size)
+                return RS_DONE;
+
+        weak_sums = realloc(sums->weak_sums, size * sizeof *weak_sums);
+        if (!weak_sums)
+                return RS_MEM_ERROR;
+        sums->weak_sums = weak_sums;
+
+        if (sums->strong_sum_len) {
+                strong_sums = realloc(sums->strong_sums,
+                                      (size_t) size * sums->strong_sum_len);
+                if (!strong_sums)
+                        return RS_MEM_ERROR;
+                sums->strong_sums = strong_sums;
+        }
+
+        sums->size = size;
+        return RS_DONE;
+}
+
+
 void
 rs_sumset_dump(rs_signature_t const *sums)
 {
@@ -63,10 +95,10 @@ rs_sumset_dump(rs_signature_t const *sums)
                 sums->remainder);
 
         for (i = 0; i < sums->count; i++) {
-                rs_hexify(strong_hex, sums->block_sigs[i].strong_sum,
+                rs_hexify(strong_hex, rs_sig_strong_sum(sums, i),
                           sums->strong_sum_len);
                 rs_log(RS_LOG_INFO,
                         "sum %6d: weak=%08x, strong=%s",
-                        i, sums->block_sigs[i].weak_sum, strong_hex);
+                        i, sums->weak_sums[i], strong_hex);
         }
 }
@@ -28,46 +28,54 @@
  */
 
 
+/** Number of entries in one bucket of the search index. */
+#define RS_HASH_BUCKET_LEN 8
+
 /**
- * \brief Description of the match described by a signature.
+ * \brief One bucket of the open-addressed search index.
+ *
+ * A bucket fills exactly one 64-byte cache line.  The weak sums are
+ * kept inline next to the block indexes, so that a probe that misses
+ * never has to look at the block signatures themselves.  Entries are
+ * filled in order, so an empty entry means the rest are empty too.
  */
-typedef struct rs_target {
-    unsigned short  t;
-    int             i;
-} rs_target_t;
-
-typedef struct rs_block_sig rs_block_sig_t;
-
-typedef struct rs_tag_table_entry {
-    int l; // left bound of the hash tag in sorted array of targets
-    int r; // right bound of the hash tag in sorted array of targets
-    // all tags between l and r inclusively are the same
-} rs_tag_table_entry_t ;
+typedef struct rs_hash_bucket {
+    rs_weak_sum_t   weak_sum[RS_HASH_BUCKET_LEN];
+    int             i[RS_HASH_BUCKET_LEN]; /* index of the chunk plus
+                                            * one, or 0 if empty */
+} rs_hash_bucket_t;
 
 /*
  * This structure describes all the sums generated for an instance of
  * a file.  It incorporates some redundancy to make it easier to
  * search.
+ *
+ * The sums of the blocks are kept in two packed arrays, indexed by
+ * block number: the weak sums, and the strong sums, which take exactly
+ * strong_sum_len bytes each rather than a whole rs_strong_sum_t.  With
+ * short strong sums this makes the signature several times smaller in
+ * memory.
  */
 struct rs_signature {
     rs_long_t       flength;	/* total file length */
     int             count;      /* how many chunks */
+    int             size;       /* how many chunks there is room for */
+    int             indexed;    /* how many chunks are in hashtable */
     int             remainder;	/* flength % block_length */
     int             block_len;	/* block_length */
     int             strong_sum_len;
-    rs_block_sig_t  *block_sigs; /* points to info for each chunk */
-    rs_tag_table_entry_t	*tag_table;
-    rs_target_t     *targets;
+    rs_weak_sum_t   *weak_sums; /* weak sum of each chunk */
+    rs_byte_t       *strong_sums; /* strong_sum_len bytes for each chunk */
+    rs_hash_bucket_t *hashtable; /* index of the chunks by weak sum */
+    unsigned int    hashtable_mask; /* number of buckets minus one */
+    void            *hashtable_alloc; /* unaligned allocation of hashtable */
     int             magic;
 };
 
 
-/*
- * All blocks are the same length in the current algorithm except for
- * the last block which may be short.
- */
-struct rs_block_sig {
-    int             i;		/* index of this chunk */
-    rs_weak_sum_t   weak_sum;	/* simple checksum */
-    rs_strong_sum_t strong_sum;	/* checksum  */
-};
+/* The strong sum of block I of SIG. */
+#define rs_sig_strong_sum(sig, i) \
+        ((sig)->strong_sums + (size_t) (i) * (sig)->strong_sum_len)
+
+
+rs_result rs_sumset_reserve(rs_signature_t *sums, int size);
@@ -143,6 +143,37 @@ rs_tube_copy_from_scoop(rs_job_t *job)
 
 
 
+/*
+ * Copy as much as will fit to the output from the caller's buffer
+ * queued by rs_tube_copy_buf(), up to the limit of the outstanding
+ * copy.
+ */
+static void
+rs_tube_copy_from_buf(rs_job_t *job)
+{
+    size_t       this_len;
+    rs_buffers_t *stream = job->stream;
+
+    this_len = job->copy_len;
+    if (this_len > stream->avail_out) {
+        this_len = stream->avail_out;
+    }
+
+    memcpy(stream->next_out, job->copy_buf, this_len);
+
+    stream->next_out += this_len;
+    stream->avail_out -= this_len;
+
+    job->copy_buf += this_len;
+    job->copy_len -= this_len;
+    if (!job->copy_len)
+        job->copy_buf = NULL;
+
+    rs_trace("copied %ld bytes from buffer, %ld remain to be copied",
+             (long) this_len, (long) job->copy_len);
+}
+
+
 /**
  * Catch up on an outstanding copy command.
  *
@@ -157,6 +188,11 @@ static void rs_tube_catchup_copy(rs_job_t *job)
     assert(job->write_len == 0);
     assert(job->copy_len > 0);
 
+    if (job->copy_buf) {
+        rs_tube_copy_from_buf(job);
+        return;
+    }
+
     if (job->scoop_avail  && job->copy_len) {
         /* there's still some data in the scoop, so we should use that. */
         rs_tube_copy_from_scoop(job);
@@ -195,7 +231,7 @@ int rs_tube_catchup(rs_job_t *job)
         rs_tube_catchup_copy(job);
     
     if (job->copy_len) {
-        if (job->stream->eof_in && !job->stream->avail_in && !job->scoop_avail) {
+        if (!job->copy_buf && job->stream->eof_in && !job->stream->avail_in && !job->scoop_avail) {
             rs_log(RS_LOG_ERR,
                    "reached end of file while copying literal data through buffers");
             return RS_INPUT_ENDED;
@@ -240,6 +276,21 @@ void rs_tube_copy(rs_job_t *job, int len)
 
 
 
+/*
+ * Queue up a request to copy \p len bytes from \p buf, rather than
+ * from the input, to the output of the stream.  The buffer must stay
+ * valid until the tube is idle again.
+ */
+void rs_tube_copy_buf(rs_job_t *job, void const *buf, size_t len)
+{
+    assert(job->copy_len == 0);
+
+    job->copy_buf = (rs_byte_t const *) buf;
+    job->copy_len = len;
+}
+
+
+
 /*
  * Push some data into the tube for storage.  The tube's never
  * supposed to get very big, so this will just pop loudly if you do
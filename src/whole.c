@@ -33,6 +33,10 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -55,7 +59,9 @@
  * The job should already be set up, and must be free by the caller
  * after return.
  *
- * Buffers of ::rs_inbuflen and ::rs_outbuflen are allocated for
+ * If the input is a regular file it is mapped into memory and given to
+ * the job all at once, so it is read in place.  Otherwise, and for the
+ * output, buffers of ::rs_inbuflen and ::rs_outbuflen are allocated for
  * temporary storage.
  *
  * \param in_file Source of input bytes, or NULL if the input buffer
@@ -69,16 +75,24 @@ rs_whole_run(rs_job_t *job, FILE *in_file, FILE *out_file)
     rs_buffers_t    buf;
     rs_result       result;
     rs_filebuf_t    *in_fb = NULL, *out_fb = NULL;
+    rs_filemap_t    *in_fm = NULL;
 
-    if (in_file)
+    if (in_file && !(in_fm = rs_filemap_new(in_file)))
         in_fb = rs_filebuf_new(in_file, rs_inbuflen);
 
     if (out_file)
         out_fb = rs_filebuf_new(out_file, rs_outbuflen);
 
-    result = rs_job_drive(job, &buf,
-                          in_fb ? rs_infilebuf_fill : NULL, in_fb,
-                          out_fb ? rs_outfilebuf_drain : NULL, out_fb);
+    if (in_fm)
+        result = rs_job_drive(job, &buf, rs_inmapbuf_fill, in_fm,
+                              out_fb ? rs_outfilebuf_drain : NULL, out_fb);
+    else
+        result = rs_job_drive(job, &buf,
+                              in_fb ? rs_infilebuf_fill : NULL, in_fb,
+                              out_fb ? rs_outfilebuf_drain : NULL, out_fb);
+
+    if (in_fm)
+        rs_filemap_free(in_fm);
 
     if (in_fb)
         rs_filebuf_free(in_fb);
@@ -110,6 +124,40 @@ rs_sig_file(FILE *old_file, FILE *sig_file, size_t new_block_len,
 }
 
 
+rs_result
+rs_sig_file_threads(FILE *old_file, FILE *sig_file, size_t new_block_len,
+                    size_t strong_len, rs_magic_number sig_magic,
+                    int threads, rs_stats_t *stats)
+{
+    rs_job_t        *job;
+    rs_result       r;
+
+    job = rs_sig_begin_threads(new_block_len, strong_len, sig_magic, threads);
+    r = rs_whole_run(job, old_file, sig_file);
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+
+    return r;
+}
+
+
+/*
+ * If FD is a regular file, tell the signature loading JOB how much of it
+ * is left after POS, so the sums can be allocated all at once.
+ */
+static void rs_whole_sig_size(rs_job_t *job, int fd, rs_long_t pos)
+{
+#ifdef HAVE_SYS_STAT_H
+    struct stat     st;
+
+    if (fd >= 0 && pos >= 0 && fstat(fd, &st) == 0
+        && S_ISREG(st.st_mode) && st.st_size > pos)
+        rs_loadsig_set_size(job, st.st_size - pos);
+#endif
+}
+
+
 rs_result
 rs_loadsig_file(FILE *sig_file, rs_signature_t **sumset, rs_stats_t *stats)
 {
@@ -117,6 +165,7 @@ rs_loadsig_file(FILE *sig_file, rs_signature_t **sumset, rs_stats_t *stats)
     rs_result           r;
 
     job = rs_loadsig_begin(sumset);
+    rs_whole_sig_size(job, fileno(sig_file), ftell(sig_file));
     r = rs_whole_run(job, sig_file, NULL);
     if (stats)
         memcpy(stats, &job->stats, sizeof *stats);
@@ -148,13 +197,66 @@ rs_delta_file(rs_signature_t *sig, FILE *new_file, FILE *delta_file,
 
 
 
+rs_result
+rs_delta_file_basis(rs_signature_t *sig, FILE *basis_file, FILE *new_file,
+                    FILE *delta_file, rs_stats_t *stats)
+{
+    rs_job_t            *job;
+    rs_result           r;
+
+    rs_filemap_t        *basis_fm = rs_filemap_new(basis_file);
+
+    if (basis_fm)
+        job = rs_delta_begin_basis(sig, rs_filemap_copy_cb, basis_fm);
+    else
+        job = rs_delta_begin_basis(sig, rs_file_copy_cb, basis_file);
+    r = rs_whole_run(job, new_file, delta_file);
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+    if (basis_fm)
+        rs_filemap_free(basis_fm);
+
+    return r;
+}
+
+
+rs_result
+rs_delta_file_threads(rs_signature_t *sig, FILE *new_file, FILE *delta_file,
+                      int threads, rs_stats_t *stats)
+{
+    rs_job_t            *job;
+    rs_result           r;
+
+    job = rs_delta_begin_threads(sig, threads);
+    r = rs_whole_run(job, new_file, delta_file);
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+
+    return r;
+}
+
+
+
 rs_result rs_patch_file(FILE *basis_file, FILE *delta_file, FILE *new_file,
                         rs_stats_t *stats)
 {
     rs_job_t            *job;
     rs_result           r;
 
-    job = rs_patch_begin(rs_file_copy_cb, basis_file);
+    rs_filemap_t        *basis_fm = rs_filemap_new(basis_file);
+
+    int                 basis_fd = fileno(basis_file);
+
+    /* a mapped basis is copied straight from the map */
+    if (basis_fm) {
+        job = rs_patch_begin(rs_filemap_copy_cb, basis_fm);
+        rs_patch_set_prefetch(job, rs_filemap_prefetch_cb, basis_fm);
+    } else {
+        job = rs_patch_begin(rs_file_copy_cb, basis_file);
+        rs_patch_set_prefetch(job, rs_fd_prefetch_cb, &basis_fd);
+    }
 
     r = rs_whole_run(job, delta_file, new_file);
     
@@ -162,6 +264,187 @@ rs_result rs_patch_file(FILE *basis_file, FILE *delta_file, FILE *new_file,
         memcpy(stats, &job->stats, sizeof *stats);
 
     rs_job_free(job);
+    if (basis_fm)
+        rs_filemap_free(basis_fm);
+
+    return r;
+}
+
+
+#ifdef HAVE_UNISTD_H
+/*
+ * Where a patch run by rs_whole_drive_fd() copies long COPY commands
+ * from, straight into the output file.
+ */
+struct rs_whole_direct {
+    int             basis_fd;
+    rs_filebuf_t    *out_fb;
+};
+
+
+static rs_result rs_whole_copy_direct(rs_job_t *job, void *arg,
+                                      rs_long_t pos, rs_long_t *len)
+{
+    struct rs_whole_direct *d = (struct rs_whole_direct *) arg;
+
+    return rs_outfdbuf_copy_fd(job, job->stream, d->out_fb, d->basis_fd,
+                               pos, len);
+}
+
+
+static int rs_whole_is_regular(int fd)
+{
+    struct stat     st;
+
+    return fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+
+/*
+ * Run a job reading and writing file descriptors.  If \p basis_fd is
+ * not -1 the job is a patch from it, and long COPY commands are copied
+ * by the kernel when both it and the output are regular files.
+ */
+static rs_result
+rs_whole_drive_fd(rs_job_t *job, int in_fd, int out_fd, int basis_fd)
+{
+    rs_buffers_t    buf;
+    rs_result       result;
+    rs_filebuf_t    *in_fb = NULL, *out_fb = NULL;
+    rs_filemap_t    *in_fm = NULL;
+    struct rs_whole_direct direct;
+
+    if (in_fd >= 0 && !(in_fm = rs_filemap_new_fd(in_fd)))
+        in_fb = rs_fdbuf_new(in_fd, rs_inbuflen);
+
+    if (out_fd >= 0)
+        out_fb = rs_fdbuf_new(out_fd, rs_outbuflen);
+
+    if (out_fb && rs_whole_is_regular(basis_fd)
+        && rs_whole_is_regular(out_fd)) {
+        direct.basis_fd = basis_fd;
+        direct.out_fb = out_fb;
+        job->copy_direct_cb = rs_whole_copy_direct;
+        job->copy_direct_arg = &direct;
+    }
+
+    if (in_fm)
+        result = rs_job_drive(job, &buf, rs_inmapbuf_fill, in_fm,
+                              out_fb ? rs_outfdbuf_drain : NULL, out_fb);
+    else
+        result = rs_job_drive(job, &buf,
+                              in_fb ? rs_infdbuf_fill : NULL, in_fb,
+                              out_fb ? rs_outfdbuf_drain : NULL, out_fb);
+    job->copy_direct_cb = NULL;
+
+    if (in_fm)
+        rs_filemap_free(in_fm);
+
+    if (in_fb)
+        rs_filebuf_free(in_fb);
+
+    if (out_fb)
+        rs_filebuf_free(out_fb);
+
+    return result;
+}
+#endif
+
+
+/**
+ * Run a job continuously like rs_whole_run(), but reading and writing
+ * file descriptors.  Either may be -1 if there is no input or output.
+ */
+rs_result
+rs_whole_run_fd(rs_job_t *job, int in_fd, int out_fd)
+{
+#ifdef HAVE_UNISTD_H
+    return rs_whole_drive_fd(job, in_fd, out_fd, -1);
+#else
+    rs_error("built without file descriptor IO");
+    return RS_UNIMPLEMENTED;
+#endif
+}
+
+
+rs_result
+rs_sig_fd(int old_fd, int sig_fd, size_t new_block_len, size_t strong_len,
+          rs_magic_number sig_magic, rs_stats_t *stats)
+{
+    rs_job_t        *job;
+    rs_result       r;
+
+    job = rs_sig_begin(new_block_len, strong_len, sig_magic);
+    r = rs_whole_run_fd(job, old_fd, sig_fd);
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+
+    return r;
+}
+
+
+rs_result
+rs_loadsig_fd(int sig_fd, rs_signature_t **sumset, rs_stats_t *stats)
+{
+    rs_job_t            *job;
+    rs_result           r;
+
+    job = rs_loadsig_begin(sumset);
+#ifdef HAVE_UNISTD_H
+    rs_whole_sig_size(job, sig_fd, lseek(sig_fd, 0, SEEK_CUR));
+#endif
+    r = rs_whole_run_fd(job, sig_fd, -1);
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+
+    return r;
+}
+
+
+rs_result
+rs_delta_fd(rs_signature_t *sig, int new_fd, int delta_fd, rs_stats_t *stats)
+{
+    rs_job_t            *job;
+    rs_result           r;
+
+    job = rs_delta_begin(sig);
+    r = rs_whole_run_fd(job, new_fd, delta_fd);
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+
+    return r;
+}
+
+
+rs_result
+rs_patch_fd(int basis_fd, int delta_fd, int new_fd, rs_stats_t *stats)
+{
+    rs_job_t            *job;
+    rs_result           r;
+    rs_filemap_t        *basis_fm = rs_filemap_new_fd(basis_fd);
+
+    /* a basis that can't be mapped is read with pread a batch at a time,
+     * so the descriptor can be shared with other jobs */
+    if (basis_fm) {
+        job = rs_patch_begin(rs_filemap_copy_cb, basis_fm);
+        rs_patch_set_prefetch(job, rs_filemap_prefetch_cb, basis_fm);
+    } else {
+        job = rs_patch_begin_batch(rs_fd_copy_batch_cb, &basis_fd);
+        rs_patch_set_prefetch(job, rs_fd_prefetch_cb, &basis_fd);
+    }
+#ifdef HAVE_UNISTD_H
+    r = rs_whole_drive_fd(job, delta_fd, new_fd, basis_fd);
+#else
+    r = rs_whole_run_fd(job, delta_fd, new_fd);
+#endif
+    if (stats)
+        memcpy(stats, &job->stats, sizeof *stats);
+    rs_job_free(job);
+    if (basis_fm)
+        rs_filemap_free(basis_fm);
 
     return r;
 }
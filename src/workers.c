@@ -0,0 +1,214 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+/**
+ * \file workers.c Worker threads for jobs that can split their work.
+ *
+ * The job state machines stay single-threaded: a state function hands a
+ * batch of independent tasks to the workers with rs_workers_start(), and
+ * later collects them with rs_workers_wait(), which also runs any tasks
+ * that no worker has picked up yet.  Only one batch of tasks is in
+ * flight at a time.
+ *
+ * Without pthreads, rs_workers_new() returns NULL and the callers do the
+ * work themselves.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "librsync.h"
+#include "trace.h"
+#include "util.h"
+#include "workers.h"
+
+#ifdef HAVE_PTHREAD
+
+struct rs_workers {
+    pthread_mutex_t     lock;
+    pthread_cond_t      work_cond;      /* there are tasks, or shutdown */
+    pthread_cond_t      done_cond;      /* the last task finished */
+
+    rs_task_fn          *fn;
+    void                *arg;
+    int                 ntasks;         /* tasks in this batch */
+    int                 next;           /* next task to hand out */
+    int                 pending;        /* tasks not yet finished */
+    int                 shutdown;
+
+    int                 nthreads;
+    pthread_t           *threads;
+};
+
+
+/*
+ * Take the next task, if any, and run it.  Called and returns with the
+ * lock held.  Returns 0 if there was nothing to do.
+ */
+static int rs_workers_run_one(rs_workers_t *w)
+{
+    int i;
+
+    if (w->next >= w->ntasks)
+        return 0;
+    i = w->next++;
+    pthread_mutex_unlock(&w->lock);
+
+    w->fn(w->arg, i);
+
+    pthread_mutex_lock(&w->lock);
+    if (--w->pending == 0)
+        pthread_cond_signal(&w->done_cond);
+    return 1;
+}
+
+
+static void *rs_workers_main(void *arg)
+{
+    rs_workers_t *w = (rs_workers_t *) arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->shutdown) {
+        if (!rs_workers_run_one(w))
+            pthread_cond_wait(&w->work_cond, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+
+/**
+ * Start a pool for work to be spread over \p threads threads in all.
+ * The thread that calls rs_workers_wait() counts as one of them, so
+ * \p threads - 1 are created.
+ *
+ * \return NULL if \p threads is less than 2 or the threads couldn't be
+ * started; the caller should then do the work itself.
+ */
+rs_workers_t *rs_workers_new(int threads)
+{
+    rs_workers_t *w;
+
+    if (threads < 2)
+        return NULL;
+
+    w = rs_alloc_struct(rs_workers_t);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work_cond, NULL);
+    pthread_cond_init(&w->done_cond, NULL);
+    w->threads = rs_alloc((threads - 1) * sizeof *w->threads, "worker threads");
+
+    for (w->nthreads = 0; w->nthreads < threads - 1; w->nthreads++) {
+        if (pthread_create(&w->threads[w->nthreads], NULL, rs_workers_main, w)) {
+            rs_error("couldn't start worker thread");
+            break;
+        }
+    }
+    if (!w->nthreads) {
+        rs_workers_free(w);
+        return NULL;
+    }
+    rs_trace("started %d worker threads", w->nthreads);
+    return w;
+}
+
+
+/**
+ * Start running \p fn(\p arg, i) for each i from 0 to \p ntasks - 1, in
+ * no particular order.  Any previous batch must have been waited for.
+ */
+void rs_workers_start(rs_workers_t *w, rs_task_fn *fn, void *arg, int ntasks)
+{
+    pthread_mutex_lock(&w->lock);
+    w->fn = fn;
+    w->arg = arg;
+    w->ntasks = ntasks;
+    w->next = 0;
+    w->pending = ntasks;
+    pthread_cond_broadcast(&w->work_cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+
+/**
+ * Wait until all the tasks from rs_workers_start() are finished, running
+ * some of them in this thread meanwhile.
+ */
+void rs_workers_wait(rs_workers_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    while (rs_workers_run_one(w))
+        ;
+    while (w->pending)
+        pthread_cond_wait(&w->done_cond, &w->lock);
+    w->ntasks = w->next = 0;
+    pthread_mutex_unlock(&w->lock);
+}
+
+
+/**
+ * Finish any tasks that were started, and stop the threads.
+ */
+void rs_workers_free(rs_workers_t *w)
+{
+    int i;
+
+    rs_workers_wait(w);
+
+    pthread_mutex_lock(&w->lock);
+    w->shutdown = 1;
+    pthread_cond_broadcast(&w->work_cond);
+    pthread_mutex_unlock(&w->lock);
+    for (i = 0; i < w->nthreads; i++)
+        pthread_join(w->threads[i], NULL);
+
+    pthread_cond_destroy(&w->done_cond);
+    pthread_cond_destroy(&w->work_cond);
+    pthread_mutex_destroy(&w->lock);
+    free(w->threads);
+    free(w);
+}
+
+#else /* HAVE_PTHREAD */
+
+rs_workers_t *rs_workers_new(int threads)
+{
+    if (threads > 1)
+        rs_trace("built without threads, ignoring request for %d", threads);
+    return NULL;
+}
+
+void rs_workers_start(rs_workers_t *w, rs_task_fn *fn, void *arg, int ntasks)
+{
+}
+
+void rs_workers_wait(rs_workers_t *w)
+{
+}
+
+void rs_workers_free(rs_workers_t *w)
+{
+}
+
+#endif /* HAVE_PTHREAD */
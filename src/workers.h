@@ -0,0 +1,39 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ *
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+/** \private
+ * A pool of worker threads that runs a set of numbered tasks.
+ */
+typedef struct rs_workers rs_workers_t;
+
+/** \private
+ * A task run by the workers: \p i is the number of the task.
+ */
+typedef void rs_task_fn(void *arg, int i);
+
+rs_workers_t *rs_workers_new(int threads);
+void rs_workers_start(rs_workers_t *workers, rs_task_fn *fn, void *arg,
+                      int ntasks);
+void rs_workers_wait(rs_workers_t *workers);
+void rs_workers_free(rs_workers_t *workers);
+
+#endif /* _WORKERS_H_ */
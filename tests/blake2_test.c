@@ -0,0 +1,154 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "blake2.h"
+#include "blake2-impl.h"
+
+/*
+ * Known answers from the BLAKE2 reference package: BLAKE2b-512 of the
+ * bytes 0..len-1, keyed with the 64 bytes 0..63.
+ */
+static const struct {
+    int len;
+    const char *hex;
+} keyed_kat[] = {
+    {  0, "10ebb67700b1868efb4417987acf4690ae9d972fb7a590c2f02871799aaa4786"
+            "b5e996e8f0f4eb981fc214b005f42d2ff4233499391653df7aefcbc13fc51568"},
+    {  1, "961f6dd1e4dd30f63901690c512e78e4b45e4742ed197c3c5e45c549fd25f2e4"
+            "187b0bc9fe30492b16b0d0bc4ef9b0f34c7003fac09a5ef1532e69430234cebd"},
+    {  2, "da2cfbe2d8409a0f38026113884f84b50156371ae304c4430173d08a99d9fb1b"
+            "983164a3770706d537f49e0c916d9f32b95cc37a95b99d857436f0232c88a965"},
+    {  3, "33d0825dddf7ada99b0e7e307104ad07ca9cfd9692214f1561356315e784f3e5"
+            "a17e364ae9dbb14cb2036df932b77f4b292761365fb328de7afdc6d8998f5fc1"},
+    { 63, "bd965bf31e87d70327536f2a341cebc4768eca275fa05ef98f7f1b71a0351298"
+            "de006fba73fe6733ed01d75801b4a928e54231b38e38c562b2e33ea1284992fa"},
+    { 64, "65676d800617972fbd87e4b9514e1c67402b7a331096d3bfac22f1abb95374ab"
+            "c942f16e9ab0ead33b87c91968a6e509e119ff07787b3ef483e1dcdccf6e3022"},
+    { 65, "939fa189699c5d2c81ddd1ffc1fa207c970b6a3685bb29ce1d3e99d42f2f7442"
+            "da53e95a72907314f4588399a3ff5b0a92beb3f6be2694f9f86ecf2952d5b41c"},
+    {127, "76d2d819c92bce55fa8e092ab1bf9b9eab237a25267986cacf2b8ee14d214d73"
+            "0dc9a5aa2d7b596e86a1fd8fa0804c77402d2fcd45083688b218b1cdfa0dcbcb"},
+    {128, "72065ee4dd91c2d8509fa1fc28a37c7fc9fa7d5b3f8ad3d0d7a25626b57b1b44"
+            "788d4caf806290425f9890a3a2a35a905ab4b37acfd0da6e4517b2525c9651e4"},
+    {129, "64475dfe7600d7171bea0b394e27c9b00d8e74dd1e416a79473682ad3dfdbb70"
+            "6631558055cfc8a40e07bd015a4540dcdea15883cbbf31412df1de1cd4152b91"},
+    {200, "3095a349d245708c7cf550118703d7302c27b60af5d4e67fc978f8a4e60953c7"
+            "a04f92fcf41aee64321ccb707a895851552b1e37b00bc5e6b72fa5bcef9e3fff"},
+    {255, "142709d62e28fcccd0af97fad0f8465b971e82201dc51070faa0372aa43e9248"
+            "4be1c1e73ba10906d5d1853db6a4106e0a7bf9800d373d6dee2d46d62ef2a461"},
+};
+
+/* Unkeyed BLAKE2b-512 of "abc", from RFC 7693. */
+static const char abc_hex[] =
+    "ba80a53f981c4d0d6a2797b69f12f6e94c212f14685ac4b74b12bb6fdbffa2d1"
+    "7d87c5392aab792dc252d5de4533cc9518d38aa8dbf1925ab92386edd4009923";
+
+
+static void check_hex(const uint8_t *hash, const char *hex)
+{
+    char buf[2 * BLAKE2B_OUTBYTES + 1];
+    int i;
+
+    for (i = 0; i < BLAKE2B_OUTBYTES; i++)
+        sprintf(buf + 2 * i, "%02x", hash[i]);
+    assert(strcmp(buf, hex) == 0);
+}
+
+
+/*
+ * Check the whole hash, using whichever compression function blake2b()
+ * picked, against the known answers.
+ */
+static void check_kat(void)
+{
+    uint8_t key[BLAKE2B_KEYBYTES], in[256], hash[BLAKE2B_OUTBYTES];
+    size_t i;
+
+    printf("checking blake2b against known answers\n");
+    for (i = 0; i < sizeof key; i++)
+        key[i] = (uint8_t) i;
+    for (i = 0; i < sizeof in; i++)
+        in[i] = (uint8_t) i;
+
+    for (i = 0; i < sizeof keyed_kat / sizeof keyed_kat[0]; i++) {
+        assert(blake2b(hash, in, key, BLAKE2B_OUTBYTES, keyed_kat[i].len,
+                       BLAKE2B_KEYBYTES) == 0);
+        check_hex(hash, keyed_kat[i].hex);
+    }
+
+    assert(blake2b(hash, "abc", NULL, BLAKE2B_OUTBYTES, 3, 0) == 0);
+    check_hex(hash, abc_hex);
+}
+
+
+/*
+ * Check that IMPL gives exactly the same state as blake2b_compress_ref()
+ * for random states and blocks, including the final block flags.
+ */
+static void check_impl(const char *name, blake2b_compress_fn *impl)
+{
+    blake2b_state ref, s;
+    uint8_t block[BLAKE2B_BLOCKBYTES];
+    size_t i;
+    int n;
+
+    printf("checking %s\n", name);
+    for (n = 0; n < 10000; n++) {
+        memset(&ref, 0, sizeof ref);
+        for (i = 0; i < 8; i++)
+            ref.h[i] = (uint64_t) rand() << 40 ^ (uint64_t) rand() << 20 ^ rand();
+        ref.t[0] = (uint64_t) rand() * (n & 0xff);
+        ref.t[1] = n & 1 ? 0 : rand();
+        ref.f[0] = n & 2 ? ~0ULL : 0;
+        ref.f[1] = n & 4 ? ~0ULL : 0;
+        for (i = 0; i < sizeof block; i++)
+            block[i] = rand();
+        s = ref;
+
+        blake2b_compress_ref(&ref, block);
+        impl(&s, block);
+        assert(memcmp(ref.h, s.h, sizeof ref.h) == 0);
+    }
+}
+
+
+/*
+ * Test driver for the vectorized BLAKE2b compression functions.
+ */
+int main(int argc, char **argv)
+{
+    srand(1);
+
+    check_kat();
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+        check_impl("blake2b_compress_sse41", blake2b_compress_sse41);
+    if (__builtin_cpu_supports("avx2"))
+        check_impl("blake2b_compress_avx2", blake2b_compress_avx2);
+#endif
+
+    return 0;
+}
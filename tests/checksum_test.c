@@ -0,0 +1,78 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "librsync.h"
+#include "checksum.h"
+
+#define MAX_BLOCKS 20
+/* The blocks start one byte in, so that they aren't aligned. */
+#define BUF_LEN (MAX_BLOCKS * 2100 + 1)
+
+static unsigned char buf[BUF_LEN];
+
+/* Lengths around the padding boundaries of MD4 (64-byte chunks, length
+ * at byte 56) and BLAKE2b (128-byte blocks). */
+static const size_t lens[] = {
+    0, 1, 3, 55, 56, 57, 63, 64, 65, 119, 120, 121, 127, 128, 129,
+    255, 256, 257, 700, 1024, 2047, 2048, 2049, 2100
+};
+
+
+/*
+ * Check that the batched sums are the same as summing each block on its
+ * own, for every number of blocks, so that all the SIMD and leftover
+ * paths are used.
+ */
+int main(int argc, char **argv)
+{
+    rs_strong_sum_t sums[MAX_BLOCKS], ref;
+    size_t l, len;
+    int i, n;
+
+    srand(1);
+    for (i = 0; i < BUF_LEN; i++)
+        buf[i] = rand();
+
+    for (l = 0; l < sizeof lens / sizeof lens[0]; l++) {
+        len = lens[l];
+        for (n = 0; n <= MAX_BLOCKS; n++) {
+            memset(sums, 0, sizeof sums);
+            rs_calc_md4_sums(buf + 1, len, n, sums);
+            for (i = 0; i < n; i++) {
+                rs_calc_md4_sum(buf + 1 + i * len, len, &ref);
+                assert(memcmp(sums[i], ref, 16) == 0);
+            }
+
+            memset(sums, 0, sizeof sums);
+            rs_calc_blake2_sums(buf + 1, len, n, sums);
+            for (i = 0; i < n; i++) {
+                rs_calc_blake2_sum(buf + 1 + i * len, len, &ref);
+                assert(memcmp(sums[i], ref, RS_MAX_STRONG_SUM_LENGTH) == 0);
+            }
+        }
+    }
+
+    return 0;
+}
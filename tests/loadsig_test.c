@@ -0,0 +1,132 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "librsync.h"
+#include "sumset.h"
+#include "testutil.h"
+
+#define BLOCK_LEN 64
+#define STRONG_LEN 8
+#define BLOCKS 3000
+#define DATA_LEN (BLOCKS * BLOCK_LEN)
+#define SIG_LEN (12 + BLOCKS * (4 + STRONG_LEN))
+
+static unsigned char data[DATA_LEN];
+static unsigned char sig_buf[SIG_LEN];
+static unsigned char delta1[DATA_LEN + 1000], delta2[DATA_LEN + 1000];
+
+
+/*
+ * Load the signature with a size hint of HINT bytes, or none if it is
+ * 0, check that all of it was read, and return it.
+ */
+static rs_signature_t *load(rs_long_t hint)
+{
+    rs_signature_t *sig;
+    rs_job_t *job;
+    int i;
+
+    job = rs_loadsig_begin(&sig);
+    if (hint)
+        rs_loadsig_set_size(job, hint);
+    run(job, sig_buf, SIG_LEN, NULL, 0);
+
+    check(sig->count == BLOCKS);
+    check(sig->size >= sig->count);
+    check(sig->block_len == BLOCK_LEN);
+    check(sig->strong_sum_len == STRONG_LEN);
+    for (i = 0; i < BLOCKS; i++) {
+        check(memcmp(rs_sig_strong_sum(sig, i),
+                     sig_buf + 12 + i * (4 + STRONG_LEN) + 4,
+                     STRONG_LEN) == 0);
+    }
+    return sig;
+}
+
+
+/*
+ * Check that a signature is loaded the same whatever size hint it is
+ * given, and that a hint that is too big doesn't allocate much more.
+ * Then check that a loaded signature can be used for a delta straight
+ * away, and that indexing it again with rs_build_hash_table() makes no
+ * difference.
+ */
+int main(int argc, char **argv)
+{
+    rs_signature_t *sig;
+    rs_result result;
+    size_t i, len1, len2;
+
+    srand(1);
+    for (i = 0; i < DATA_LEN; i++)
+        data[i] = rand();
+    i = run(rs_sig_begin(BLOCK_LEN, STRONG_LEN, RS_BLAKE2_SIG_MAGIC),
+            data, DATA_LEN, sig_buf, SIG_LEN);
+    check(i == SIG_LEN);
+
+    /* No hint, or a zero one: the arrays double as they fill. */
+    sig = load(0);
+    check(sig->size < 2 * BLOCKS);
+    rs_free_sumset(sig);
+
+    /* The right hint gives arrays of just the right size. */
+    sig = load(SIG_LEN);
+    check(sig->size == BLOCKS);
+    rs_free_sumset(sig);
+
+    /* Too small: the arrays grow past it. */
+    sig = load(12 + BLOCKS / 3 * (4 + STRONG_LEN));
+    check(sig->size < 2 * BLOCKS);
+    rs_free_sumset(sig);
+
+    /* Far too big: only a limited amount is allocated up front, and
+     * the index is only sized for that. */
+    sig = load(12 + (rs_long_t) 1000000000 * (4 + STRONG_LEN));
+    check(sig->size <= 1 << 16);
+    check((sig->hashtable_mask + 1) * RS_HASH_BUCKET_LEN <= 2 << 16);
+    rs_free_sumset(sig);
+
+    /* Not the length of any signature with this header: ignored. */
+    sig = load(SIG_LEN + 1);
+    check(sig->size < 2 * BLOCKS);
+    rs_free_sumset(sig);
+
+    /* The number of blocks isn't a multiple of the indexing batch, so
+     * the last block is only found, and sent as a copy rather than as
+     * literal data, if it was indexed at the end of the input. */
+    sig = load(0);
+    len1 = run(rs_delta_begin(sig), data + DATA_LEN - BLOCK_LEN, BLOCK_LEN,
+               delta1, sizeof delta1);
+    check(len1 < BLOCK_LEN / 2);
+    result = rs_build_hash_table(sig);
+    check(result == RS_DONE);
+    len2 = run(rs_delta_begin(sig), data + DATA_LEN - BLOCK_LEN, BLOCK_LEN,
+               delta2, sizeof delta2);
+    check(len1 == len2 && memcmp(delta1, delta2, len1) == 0);
+    len1 = run(rs_delta_begin(sig), data, DATA_LEN, delta1, sizeof delta1);
+    check(len1 < 100);
+    rs_free_sumset(sig);
+
+    return 0;
+}
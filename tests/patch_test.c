@@ -0,0 +1,426 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+#include <sys/syscall.h>
+#endif
+
+#include "librsync.h"
+#include "buf.h"
+#include "testutil.h"
+
+#define BLOCK_LEN 256
+#define BASIS_LEN (1000 * BLOCK_LEN)
+#define NEW_LEN (BASIS_LEN + 5000)
+#define DELTA_MAX (NEW_LEN + 1000)
+
+static unsigned char basis[BASIS_LEN], new_data[NEW_LEN];
+static unsigned char delta[DELTA_MAX], out[NEW_LEN + 1];
+static size_t delta_len;
+
+
+/*
+ * Make the basis, and a new file that is the basis with its blocks
+ * moved around and some new data put in, and the delta between them.
+ */
+static void make_files(void)
+{
+    size_t i;
+
+    srand(1);
+    for (i = 0; i < BASIS_LEN; i++)
+        basis[i] = rand();
+    for (i = 0; i < NEW_LEN; i++)
+        new_data[i] = rand();
+    /* Runs of blocks from all over the basis, some of them long enough
+     * to be copied by the kernel, between pieces of new data. */
+    memcpy(new_data + 1000, basis + 500 * BLOCK_LEN, 400 * BLOCK_LEN);
+    memcpy(new_data + 1000 + 401 * BLOCK_LEN, basis + 7, 10 * BLOCK_LEN);
+    memcpy(new_data + 1000 + 412 * BLOCK_LEN, basis, 500 * BLOCK_LEN);
+
+    delta_len = make_delta(basis, BASIS_LEN, BLOCK_LEN, new_data, NEW_LEN,
+                           delta, DELTA_MAX);
+    assert(delta_len < NEW_LEN / 4);
+}
+
+
+/* How batch_cb answers. */
+enum batch_mode { BATCH_BLOCK, BATCH_REVERSE, BATCH_ERROR };
+
+static enum batch_mode batch_mode;
+static int batch_calls, batch_blocked;
+
+
+/*
+ * Batch callback reading the basis from memory.  BATCH_BLOCK says the
+ * data isn't ready the first two times it is asked for each extent.
+ * BATCH_REVERSE fills in one extent a call, from the last one back, some
+ * by pointing at the basis itself.  BATCH_ERROR fails on the second
+ * call.
+ */
+static rs_result batch_cb(void *arg, rs_copy_extent_t *ext, int count)
+{
+    int i;
+
+    assert(count > 0 && !ext[0].done);
+    batch_calls++;
+    batch_blocked = 0;
+
+    switch (batch_mode) {
+    case BATCH_BLOCK:
+        if (batch_calls % 3) {
+            batch_blocked = 1;
+            return RS_BLOCKED;
+        }
+        i = 0;
+        break;
+    case BATCH_REVERSE:
+        for (i = count - 1; ext[i].done; i--)
+            ;
+        break;
+    default:
+        if (batch_calls == 2)
+            return RS_IO_ERROR;
+        i = 0;
+        break;
+    }
+    assert(ext[i].pos >= 0 && ext[i].pos + ext[i].len <= BASIS_LEN);
+    if (i % 2)
+        ext[i].buf = basis + ext[i].pos;
+    else
+        memcpy(ext[i].buf, basis + ext[i].pos, ext[i].len);
+    ext[i].done = 1;
+    batch_blocked = i > 0;
+    return i ? RS_BLOCKED : RS_DONE;
+}
+
+
+/*
+ * Patch through batch_cb in MODE, with room for OUT_CHUNK bytes of
+ * output at a time, and return the result.  While the callback goes on
+ * saying it's blocked, the job must not take any input or make any
+ * output.
+ */
+static rs_result patch_batch(enum batch_mode mode, size_t out_chunk)
+{
+    rs_job_t *job = rs_patch_begin_batch(batch_cb, NULL);
+    rs_buffers_t buf;
+    rs_result result;
+    size_t out_len = 0, avail_in;
+    int calls, was_blocked = 0;
+
+    batch_mode = mode;
+    batch_calls = 0;
+    memset(out, 0, sizeof out);
+    buf.next_in = (char *) delta;
+    buf.avail_in = delta_len;
+    buf.eof_in = 1;
+    do {
+        buf.next_out = (char *) out + out_len;
+        buf.avail_out = sizeof out - out_len < out_chunk ?
+            sizeof out - out_len : out_chunk;
+        avail_in = buf.avail_in;
+        calls = batch_calls;
+        result = rs_job_iter(job, &buf);
+        if (was_blocked && batch_blocked && batch_calls == calls + 1) {
+            check(result == RS_BLOCKED);
+            check(buf.avail_in == avail_in);
+            check((unsigned char *) buf.next_out == out + out_len);
+        }
+        was_blocked = result == RS_BLOCKED && batch_blocked;
+        out_len = (unsigned char *) buf.next_out - out;
+    } while (result == RS_BLOCKED);
+    rs_job_free(job);
+
+    check(memcmp(out, new_data, out_len) == 0);
+    if (result == RS_DONE)
+        check(out_len == NEW_LEN);
+    else
+        check(out_len < NEW_LEN);
+    return result;
+}
+
+
+#ifdef HAVE_UNISTD_H
+/*
+ * Make a temporary file holding LEN bytes of DATA, with its file
+ * position at POS.
+ */
+static FILE *temp_file(void const *data, size_t len, long pos)
+{
+    FILE *f = tmpfile();
+    size_t written;
+    int flushed;
+    off_t seeked;
+
+    check(f);
+    written = fwrite(data, 1, len, f);
+    check(written == len);
+    flushed = fflush(f);
+    check(flushed == 0);
+    seeked = lseek(fileno(f), pos, SEEK_SET);
+    check(seeked == pos);
+    return f;
+}
+
+
+/*
+ * Patch with rs_patch_fd(), and check that the output is right and that
+ * the position of the shared basis descriptor wasn't changed.
+ */
+static void check_patch_fd(void)
+{
+    FILE *basis_f, *delta_f, *new_f;
+    rs_stats_t stats;
+    rs_result result;
+    ssize_t got;
+
+    basis_f = temp_file(basis, BASIS_LEN, 1234);
+    delta_f = temp_file(delta, delta_len, 0);
+    new_f = tmpfile();
+    check(new_f);
+    result = rs_patch_fd(fileno(basis_f), fileno(delta_f), fileno(new_f),
+                         &stats);
+    check(result == RS_DONE);
+    check(lseek(fileno(basis_f), 0, SEEK_CUR) == 1234);
+    check(lseek(fileno(delta_f), 0, SEEK_CUR) == (off_t) delta_len);
+    check(lseek(fileno(new_f), 0, SEEK_CUR) == NEW_LEN);
+    got = pread(fileno(new_f), out, sizeof out, 0);
+    check(got == NEW_LEN);
+    check(memcmp(out, new_data, NEW_LEN) == 0);
+    fclose(basis_f);
+    fclose(delta_f);
+    fclose(new_f);
+}
+
+
+#if defined HAVE_COPY_FILE_RANGE && defined SYS_copy_file_range
+#define FAKE_COPY_FILE_RANGE 1
+
+/* Make copy_file_range() fail with copy_errno after copy_calls calls
+ * have succeeded, and copy at most copy_max bytes a call if it's set. */
+static int copy_calls = -1, copy_errno;
+static size_t copy_max;
+
+
+/*
+ * Stand in for the C library's copy_file_range(), so that the kernel
+ * copying can be made to fail or stop short.
+ */
+ssize_t copy_file_range(int in_fd, loff_t *in_off, int out_fd,
+                        loff_t *out_off, size_t len, unsigned int flags)
+{
+    if (copy_calls == 0) {
+        errno = copy_errno;
+        return -1;
+    }
+    if (copy_calls > 0)
+        copy_calls--;
+    if (copy_max && len > copy_max)
+        len = copy_max;
+    return syscall(SYS_copy_file_range, in_fd, in_off, out_fd, out_off,
+                   len, flags);
+}
+#endif
+
+
+/*
+ * Write "head" into an output buffer on OUT_FD, then copy LEN bytes at
+ * POS in the basis BASIS_FD after it with rs_outfdbuf_copy_fd().  Check
+ * that the output file then holds what was copied after the head, and
+ * that the basis file position is unchanged, and return the result.
+ * LEN is set to how much was copied.
+ */
+static rs_result copy_fd(int basis_fd, int out_fd, rs_long_t pos,
+                         rs_long_t *len)
+{
+    rs_job_t *job = rs_patch_begin(NULL, NULL);
+    rs_filebuf_t *fb = rs_fdbuf_new(out_fd, 100);
+    rs_buffers_t buf;
+    rs_result result;
+    off_t basis_pos = lseek(basis_fd, 0, SEEK_CUR);
+    ssize_t got;
+
+    check(ftruncate(out_fd, 0) == 0);
+    check(lseek(out_fd, 0, SEEK_SET) == 0);
+    memset(&buf, 0, sizeof buf);
+    result = rs_outfdbuf_drain(job, &buf, fb);
+    check(result == RS_DONE);
+    memcpy(buf.next_out, "head", 4);
+    buf.next_out += 4;
+    buf.avail_out -= 4;
+
+    result = rs_outfdbuf_copy_fd(job, &buf, fb, basis_fd, pos, len);
+    check(*len >= 0);
+    check(lseek(basis_fd, 0, SEEK_CUR) == basis_pos);
+    if (result == RS_DONE || *len) {
+        check(rs_job_statistics(job)->out_bytes == 4 + *len);
+        got = pread(out_fd, out, sizeof out, 0);
+        check(got == 4 + *len);
+        check(memcmp(out, "head", 4) == 0);
+        check(memcmp(out + 4, basis + pos, *len) == 0);
+    }
+
+    rs_filebuf_free(fb);
+    rs_job_free(job);
+    return result;
+}
+
+
+/*
+ * Check copying from the basis straight into the output file: all of
+ * it, what there is at the end of the basis, in short pieces, and
+ * falling back to the buffer when the kernel can't do it.
+ */
+static void check_copy_fd(void)
+{
+    FILE *basis_f = temp_file(basis, BASIS_LEN, 77), *out_f = tmpfile();
+    int pipe_fd[2];
+    rs_long_t len;
+    rs_result result;
+
+    check(out_f);
+    len = 5000;
+    result = copy_fd(fileno(basis_f), fileno(out_f), 1000, &len);
+    if (result == RS_UNIMPLEMENTED) {
+        /* Not on this system or filesystem. */
+        check(len == 0);
+        fclose(basis_f);
+        fclose(out_f);
+        return;
+    }
+    check(result == RS_DONE && len == 5000);
+
+    /* The basis ends first. */
+    len = 5000;
+    result = copy_fd(fileno(basis_f), fileno(out_f), BASIS_LEN - 100, &len);
+    check(result == RS_DONE);
+    check(len == 100);
+    len = 5000;
+    result = copy_fd(fileno(basis_f), fileno(out_f), BASIS_LEN, &len);
+    check(result == RS_DONE);
+    check(len == 0);
+
+    /* From a pipe the kernel can't copy, so it's left to the buffer. */
+    check(pipe(pipe_fd) == 0);
+    len = 5000;
+    result = copy_fd(pipe_fd[0], fileno(out_f), 0, &len);
+    check(result == RS_UNIMPLEMENTED);
+    check(len == 0);
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+
+#ifdef FAKE_COPY_FILE_RANGE
+    /* The kernel copying less than asked for each time. */
+    copy_max = 777;
+    len = 100000;
+    result = copy_fd(fileno(basis_f), fileno(out_f), 3, &len);
+    check(result == RS_DONE);
+    check(len == 100000);
+
+    /* Errors meaning the kernel can't copy these files, at the start
+     * and after copying some. */
+    copy_calls = 0;
+    copy_errno = EXDEV;
+    len = 5000;
+    result = copy_fd(fileno(basis_f), fileno(out_f), 1000, &len);
+    check(result == RS_UNIMPLEMENTED);
+    check(len == 0);
+    copy_calls = 3;
+    copy_errno = ENOSYS;
+    len = 5000;
+    result = copy_fd(fileno(basis_f), fileno(out_f), 1000, &len);
+    check(result == RS_UNIMPLEMENTED);
+    check(len == 3 * 777);
+    copy_calls = 1;
+    copy_errno = EINVAL;
+    len = 5000;
+    result = copy_fd(fileno(basis_f), fileno(out_f), 1000, &len);
+    check(result == RS_UNIMPLEMENTED);
+    check(len == 777);
+
+    /* Any other error is an error. */
+    copy_calls = 1;
+    copy_errno = EIO;
+    len = 5000;
+    result = copy_fd(fileno(basis_f), fileno(out_f), 1000, &len);
+    check(result == RS_IO_ERROR);
+    check(len == 777);
+
+    /* A patch goes on through the buffer from wherever the kernel
+     * stopped. */
+    copy_calls = 2;
+    copy_errno = EXDEV;
+    check_patch_fd();
+    copy_calls = -1;
+    copy_max = 0;
+#endif
+
+    fclose(basis_f);
+    fclose(out_f);
+}
+#endif
+
+
+/*
+ * Check patching through the batch callback interface and through file
+ * descriptors against a delta made in memory, and copying from the basis
+ * straight into the output file.
+ */
+int main(int argc, char **argv)
+{
+    rs_result result;
+
+    make_files();
+
+    /* The batch callback blocking partway through a batch, finishing
+     * extents out of order, and failing. */
+    result = patch_batch(BATCH_BLOCK, NEW_LEN);
+    check(result == RS_DONE);
+    result = patch_batch(BATCH_BLOCK, 1000);
+    check(result == RS_DONE);
+    result = patch_batch(BATCH_REVERSE, NEW_LEN);
+    check(result == RS_DONE);
+    check(batch_calls > 2);
+    result = patch_batch(BATCH_REVERSE, 777);
+    check(result == RS_DONE);
+    result = patch_batch(BATCH_ERROR, NEW_LEN);
+    check(result == RS_IO_ERROR);
+    check(batch_calls == 2);
+
+#ifdef HAVE_UNISTD_H
+    /* Both with the basis mapped and read with pread(). */
+    check_patch_fd();
+    rs_map_input = 0;
+    check_patch_fd();
+    rs_map_input = 1;
+    check_copy_fd();
+#endif
+
+    return 0;
+}
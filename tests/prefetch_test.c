@@ -0,0 +1,229 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "librsync.h"
+#include "testutil.h"
+
+#define BLOCK_LEN 64
+#define BLOCKS 400
+#define COPIES 300
+#define BASIS_LEN (BLOCKS * BLOCK_LEN)
+#define NEW_MAX (COPIES * (BLOCK_LEN + 3))
+#define DELTA_MAX (NEW_MAX + 1000)
+
+static unsigned char basis[BASIS_LEN], new_data[NEW_MAX];
+static unsigned char delta[DELTA_MAX], out[NEW_MAX];
+static size_t new_len, delta_len;
+
+/* The COPY commands in the delta, as asked of copy_cb by a patch
+ * without prefetching, once that has been run. */
+static rs_long_t expected[COPIES][2];
+static int n_expected;
+
+/* The basis data asked of copy_cb by the patch being run, how many
+ * COPY commands it has passed to prefetch_cb, which of the expected ones
+ * those were, and the last of them. */
+static rs_long_t copied[COPIES][2];
+static int n_copied, n_fetched, last_fetched, prefetching;
+static char fetched[COPIES];
+
+/* The input buffer given to the patch being run. */
+static char *patch_in;
+static rs_buffers_t patch_buf;
+
+
+/*
+ * Make a new file of different blocks from all over the basis, with a
+ * few bytes of new data between most of them, and the delta to it,
+ * which has a COPY command for each block.
+ */
+static void make_files(void)
+{
+    size_t i;
+    int n;
+
+    srand(1);
+    for (i = 0; i < BASIS_LEN; i++)
+        basis[i] = rand();
+    for (n = 0; n < COPIES; n++) {
+        memcpy(new_data + new_len,
+               basis + (n * 7 % BLOCKS) * BLOCK_LEN, BLOCK_LEN);
+        new_len += BLOCK_LEN;
+        for (i = 0; i < (size_t) n % 4; i++)
+            new_data[new_len++] = rand();
+    }
+
+    delta_len = make_delta(basis, BASIS_LEN, BLOCK_LEN, new_data, new_len,
+                           delta, DELTA_MAX);
+}
+
+
+/*
+ * Prefetch callback that checks it is told about COPY commands in
+ * order, at most once each, and before they are copied.  One can only
+ * be left out if it hadn't all arrived when the patch got to it.
+ */
+static void prefetch_cb(void *arg, rs_long_t pos, rs_long_t len)
+{
+    int i;
+
+    for (i = 0; i < n_expected; i++)
+        if (expected[i][0] == pos && expected[i][1] == len)
+            break;
+    check(i < n_expected);
+    check(i > last_fetched && i >= n_copied);
+    last_fetched = i;
+    fetched[i] = 1;
+    n_fetched++;
+}
+
+
+/*
+ * Copy callback reading the basis from memory.  A COPY can only have
+ * been left out of prefetching if it was still arriving when the patch
+ * got to it, so that the end of its parameters was all it had read of
+ * this input buffer.
+ */
+static rs_result copy_cb(void *arg, rs_long_t pos, size_t *len, void **ptr)
+{
+    static rs_long_t copy_end;
+
+    check(pos >= 0 && pos + *len <= BASIS_LEN);
+    *ptr = basis + pos;
+    /* the rest of a COPY that didn't fit in the output */
+    if (n_copied && n_expected && pos == copy_end
+        && pos < expected[n_copied - 1][0] + expected[n_copied - 1][1]) {
+        copy_end += *len;
+        return RS_DONE;
+    }
+
+    check(n_copied < COPIES);
+    if (prefetching && !fetched[n_copied])
+        check(patch_buf.next_in - patch_in <= 16);
+    copied[n_copied][0] = pos;
+    copied[n_copied][1] = *len;
+    n_copied++;
+    copy_end = pos + *len;
+    return RS_DONE;
+}
+
+
+/*
+ * Patch from the first LEN bytes of the delta, given IN_CHUNK more bytes
+ * at a time after whatever the job left unused, and room for OUT_CHUNK
+ * bytes of output at a time, prefetching if PREFETCH is set.  Each input
+ * buffer is a fresh copy that is scribbled over and freed as soon as the
+ * job returns.  Return the result.
+ */
+static rs_result patch(size_t len, size_t in_chunk, size_t out_chunk,
+                       int prefetch)
+{
+    rs_job_t *job = rs_patch_begin(copy_cb, NULL);
+    rs_result result;
+    size_t in_pos = 0, in_end = 0, in_len, out_len = 0;
+
+    if ((prefetching = prefetch))
+        rs_patch_set_prefetch(job, prefetch_cb, NULL);
+    n_copied = n_fetched = 0;
+    last_fetched = -1;
+    memset(fetched, 0, sizeof fetched);
+    do {
+        in_end = len - in_end < in_chunk ? len : in_end + in_chunk;
+        in_len = in_end - in_pos;
+        patch_in = malloc(in_len + 1);
+        check(patch_in);
+        memcpy(patch_in, delta + in_pos, in_len);
+        patch_buf.next_in = patch_in;
+        patch_buf.avail_in = in_len;
+        patch_buf.eof_in = in_end == len;
+        patch_buf.next_out = (char *) out + out_len;
+        patch_buf.avail_out = sizeof out - out_len < out_chunk ?
+            sizeof out - out_len : out_chunk;
+
+        result = rs_job_iter(job, &patch_buf);
+        out_len = (unsigned char *) patch_buf.next_out - out;
+        check(patch_buf.next_in + patch_buf.avail_in == patch_in + in_len);
+
+        in_pos = in_end - patch_buf.avail_in;
+        memset(patch_in, 0xa5, in_len);
+        free(patch_in);
+    } while (result == RS_BLOCKED);
+    rs_job_free(job);
+
+    if (result == RS_DONE) {
+        check(in_pos == len);
+        check(out_len == new_len);
+        check(memcmp(out, new_data, new_len) == 0);
+        check(!n_expected || n_copied == n_expected);
+    }
+    if (prefetch && in_chunk >= len)
+        check(n_fetched == n_copied);
+    return result;
+}
+
+
+/*
+ * Check that a patch looking ahead through the delta for COPY commands
+ * to prefetch sees each of them once and in time, however the delta is
+ * split into input buffers, and that it doesn't read past the end of a
+ * delta that is cut short, which must fail rather than block for ever.
+ */
+int main(int argc, char **argv)
+{
+    static const size_t chunks[] = { 1, 2, 3, 5, 13, 100, 1000, DELTA_MAX };
+    size_t i, j, cut;
+    rs_result result;
+
+    make_files();
+
+    result = patch(delta_len, DELTA_MAX, NEW_MAX, 0);
+    check(result == RS_DONE);
+    n_expected = n_copied;
+    memcpy(expected, copied, sizeof expected);
+    /* Far more than are looked ahead at in one go. */
+    check(n_expected > 200);
+
+    /* Commands, their parameters and literal data split across input
+     * buffers in every way, with the patch keeping up with the input or
+     * held back by the output so that it looks ahead over commands that
+     * are still arriving. */
+    for (i = 0; i < sizeof chunks / sizeof chunks[0]; i++) {
+        for (j = 0; j < sizeof chunks / sizeof chunks[0]; j++) {
+            result = patch(delta_len, chunks[i], 50 * chunks[j], 1);
+            check(result == RS_DONE);
+        }
+    }
+
+    /* Cut short anywhere, all in one buffer or split up.  This must
+     * fail rather than wait for more input, so the errors are expected. */
+    rs_trace_set_level(RS_LOG_CRIT);
+    for (cut = 0; cut < delta_len; cut++) {
+        result = patch(cut, DELTA_MAX, NEW_MAX, 1);
+        check(result != RS_DONE);
+        result = patch(cut, 7, 100, 1);
+        check(result != RS_DONE);
+    }
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "rollsum.h"
+
+#define BUF_LEN 40000
+
+static unsigned char buf[BUF_LEN];
+
+/*
+ * Check that IMPL gives exactly the same state as RollsumUpdateC() for
+ * many lengths, alignments and starting states.
+ */
+static void check_impl(const char *name, RollsumUpdateFn *impl)
+{
+    unsigned int off, len;
+    Rollsum ref, sum;
+
+    printf("checking %s\n", name);
+    for (off = 0; off < 33; off++) {
+        for (len = 0; off + len <= BUF_LEN; len = len < 100 ? len + 1 : len * 3 + 7) {
+            RollsumInit(&ref);
+            RollsumInit(&sum);
+            RollsumUpdateC(&ref, buf + off, len);
+            impl(&sum, buf + off, len);
+            assert(ref.count == sum.count);
+            assert(ref.s1 == sum.s1);
+            assert(ref.s2 == sum.s2);
+
+            /* and again, carrying on from the state we have */
+            RollsumUpdateC(&ref, buf, BUF_LEN - off);
+            impl(&sum, buf, BUF_LEN - off);
+            assert(ref.count == sum.count);
+            assert(ref.s1 == sum.s1);
+            assert(ref.s2 == sum.s2);
+            assert(RollsumDigest(&ref) == RollsumDigest(&sum));
+        }
+    }
+}
+
+
+/*
+ * Test driver for the vectorized implementations of RollsumUpdate().
+ */
+int main(int argc, char **argv)
+{
+    int i;
+
+    srand(1);
+    for (i = 0; i < BUF_LEN; i++)
+        buf[i] = rand();
+    /* include some runs of the largest value, to catch overflows */
+    for (i = 20000; i < 30000; i++)
+        buf[i] = 0xff;
+
+    check_impl("RollsumUpdate", RollsumUpdate);
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        check_impl("RollsumUpdateSSE2", RollsumUpdateSSE2);
+    if (__builtin_cpu_supports("ssse3"))
+        check_impl("RollsumUpdateSSSE3", RollsumUpdateSSSE3);
+    if (__builtin_cpu_supports("avx2"))
+        check_impl("RollsumUpdateAVX2", RollsumUpdateAVX2);
+#endif
+
+    return 0;
+}
@@ -0,0 +1,253 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "librsync.h"
+#include "job.h"
+#include "buf.h"
+#include "testutil.h"
+
+#define BLOCK_LEN 256
+#define BASIS_LEN (200 * BLOCK_LEN)
+#define NEW_LEN (1 << 20)
+#define DELTA_MAX (NEW_LEN + NEW_LEN / 16)
+#define MAP_COPIES 64
+
+static unsigned char basis[BASIS_LEN], new_data[NEW_LEN];
+static unsigned char delta[DELTA_MAX], out[NEW_LEN];
+static rs_signature_t *sig;
+
+/* The most the scoop has been allocated while making a delta. */
+static size_t max_alloc;
+
+
+/*
+ * Make a delta of the new data, giving it as input IN_CHUNK bytes at a
+ * time after whatever the job left unused, and room for OUT_CHUNK bytes
+ * of output at a time.  Each input buffer is a fresh copy that is
+ * scribbled over and freed as soon as the job returns, so anything the
+ * job kept of it without copying would be noticed.  Return the length
+ * of the delta.
+ */
+static size_t chunked_delta(size_t in_chunk, size_t out_chunk)
+{
+    rs_job_t *job = rs_delta_begin(sig);
+    rs_buffers_t buf;
+    rs_result result;
+    size_t in_pos = 0, in_len, out_len = 0;
+    char *in;
+
+    max_alloc = 0;
+    do {
+        in_len = NEW_LEN - in_pos < in_chunk ? NEW_LEN - in_pos : in_chunk;
+        in = malloc(in_len ? in_len : 1);
+        check(in);
+        memcpy(in, new_data + in_pos, in_len);
+        buf.next_in = in;
+        buf.avail_in = in_len;
+        buf.eof_in = in_pos + in_len == NEW_LEN;
+        buf.next_out = (char *) delta + out_len;
+        buf.avail_out = DELTA_MAX - out_len < out_chunk ?
+            DELTA_MAX - out_len : out_chunk;
+        out_len += buf.avail_out;
+
+        result = rs_job_iter(job, &buf);
+        check(result == RS_DONE || result == RS_BLOCKED);
+        check(!job->scoop_borrowed && !job->scoop_mirror);
+        check(buf.next_in + buf.avail_in == in + in_len);
+        if (job->scoop_alloc > max_alloc)
+            max_alloc = job->scoop_alloc;
+
+        /* The input not used is given again at the front of the next
+         * buffer. */
+        in_pos += in_len - buf.avail_in;
+        out_len -= buf.avail_out;
+        memset(in, 0xa5, in_len);
+        free(in);
+    } while (result == RS_BLOCKED);
+    check(in_pos == NEW_LEN);
+    rs_job_free(job);
+    return out_len;
+}
+
+
+/*
+ * Copy callback reading the basis from memory.
+ */
+static rs_result copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
+{
+    if (pos < 0 || pos >= BASIS_LEN)
+        return RS_INPUT_ENDED;
+    if (*len > (size_t) (BASIS_LEN - pos))
+        *len = BASIS_LEN - pos;
+    *buf = basis + pos;
+    return RS_DONE;
+}
+
+
+/*
+ * Check that the delta of LEN bytes patches the basis to the new data.
+ */
+static void check_delta(size_t len)
+{
+    size_t out_len;
+
+    out_len = run(rs_patch_begin(copy_cb, NULL), delta, len,
+                  out, sizeof out);
+    check(out_len == NEW_LEN);
+    check(memcmp(out, new_data, NEW_LEN) == 0);
+}
+
+
+/*
+ * Input callback that gives the job a mapped file, and notes how much
+ * the scoop has grown to.
+ */
+static rs_result map_fill(rs_job_t *job, rs_buffers_t *buf, void *fm)
+{
+    if (job->scoop_alloc > max_alloc)
+        max_alloc = job->scoop_alloc;
+    return rs_inmapbuf_fill(job, buf, fm);
+}
+
+
+/*
+ * Make a delta of a file of many copies of the new data, mapped and
+ * given to the job all at once as rs_delta_file() does, and check that
+ * it patches back.  Return 0 if the file couldn't be mapped.
+ */
+static int check_mapped_delta(void)
+{
+    FILE *in_f = tmpfile(), *delta_f = tmpfile();
+    FILE *basis_f = tmpfile(), *new_f = tmpfile();
+    rs_filemap_t *fm;
+    rs_filebuf_t *out_fb;
+    rs_buffers_t buf;
+    rs_job_t *job;
+    rs_result result;
+    size_t n;
+    int i;
+
+    check(in_f && delta_f && basis_f && new_f);
+    for (i = 0; i < MAP_COPIES; i++) {
+        n = fwrite(new_data, 1, NEW_LEN, in_f);
+        check(n == NEW_LEN);
+    }
+    check(fflush(in_f) == 0);
+    rewind(in_f);
+    if (!(fm = rs_filemap_new(in_f))) {
+        fclose(in_f);
+        fclose(delta_f);
+        fclose(basis_f);
+        fclose(new_f);
+        return 0;
+    }
+    out_fb = rs_filebuf_new(delta_f, rs_outbuflen);
+
+    max_alloc = 0;
+    job = rs_delta_begin(sig);
+    result = rs_job_drive(job, &buf, map_fill, fm,
+                          rs_outfilebuf_drain, out_fb);
+    check(result == RS_DONE);
+    if (job->scoop_alloc > max_alloc)
+        max_alloc = job->scoop_alloc;
+    rs_job_free(job);
+    rs_filemap_free(fm);
+    rs_filebuf_free(out_fb);
+    fclose(in_f);
+
+    n = fwrite(basis, 1, BASIS_LEN, basis_f);
+    check(n == BASIS_LEN);
+    rewind(basis_f);
+    rewind(delta_f);
+    result = rs_patch_file(basis_f, delta_f, new_f, NULL);
+    check(result == RS_DONE);
+    rewind(new_f);
+    for (i = 0; i < MAP_COPIES; i++) {
+        n = fread(out, 1, NEW_LEN, new_f);
+        check(n == NEW_LEN);
+        check(memcmp(out, new_data, NEW_LEN) == 0);
+    }
+    check(fgetc(new_f) == EOF);
+    fclose(delta_f);
+    fclose(basis_f);
+    fclose(new_f);
+    return 1;
+}
+
+
+/*
+ * Check that a delta job scanning its input where the caller put it
+ * only keeps a bounded amount of it when it returns: when the output is
+ * blocked with most of a big buffer still to scan, when a miss runs
+ * across input buffers, at the end of the input, and when it is given
+ * all of a big mapped file.
+ */
+int main(int argc, char **argv)
+{
+    size_t i, len, bound;
+
+    srand(1);
+    for (i = 0; i < BASIS_LEN; i++)
+        basis[i] = rand();
+    for (i = 0; i < NEW_LEN; i++)
+        new_data[i] = rand();
+    /* Some of the basis, out of line with the block size, among long
+     * runs of new data. */
+    for (i = 0; i < 50; i++)
+        memcpy(new_data + 20000 * i + 333, basis + 4 * BLOCK_LEN * i,
+               3 * BLOCK_LEN);
+    sig = make_sig(basis, BASIS_LEN, BLOCK_LEN);
+
+    /* What may be kept: a miss, one block of lookahead, and slack for
+     * the scoop growing to twice what it has to hold. */
+    bound = 2 * (2 * rs_outbuflen + 2 * BLOCK_LEN);
+
+    /* All the input at once, with the output blocked every few hundred
+     * bytes. */
+    len = chunked_delta(NEW_LEN, 300);
+    check(max_alloc <= bound);
+    check_delta(len);
+
+    /* Input buffers smaller than a block and than a miss, so that
+     * misses, blocks and matches all run across them. */
+    len = chunked_delta(100, 1 << 16);
+    check(max_alloc <= bound);
+    check_delta(len);
+    len = chunked_delta(7000, 5000);
+    check(max_alloc <= bound);
+    check_delta(len);
+
+    /* The end of the input in a buffer on its own, after the output
+     * was blocked by a big buffer before it. */
+    len = chunked_delta(NEW_LEN - 10, 1 << 16);
+    check(max_alloc <= bound);
+    check_delta(len);
+
+    /* A big mapped file, all of it given to the job at once. */
+    if (check_mapped_delta())
+        check(max_alloc <= bound);
+
+    rs_free_sumset(sig);
+    return 0;
+}
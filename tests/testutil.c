@@ -0,0 +1,82 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "librsync.h"
+#include "testutil.h"
+
+
+void check_failed(char const *cond, char const *file, int line)
+{
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, cond);
+    exit(1);
+}
+
+
+size_t run(rs_job_t *job, void const *in, size_t in_len,
+           void *out, size_t out_len)
+{
+    rs_buffers_t buf;
+    rs_result result;
+
+    buf.next_in = (char *) in;
+    buf.avail_in = in_len;
+    buf.eof_in = 1;
+    buf.next_out = (char *) out;
+    buf.avail_out = out_len;
+    do
+        result = rs_job_iter(job, &buf);
+    while (result == RS_BLOCKED && buf.avail_out);
+    check(result == RS_DONE);
+    rs_job_free(job);
+    return out_len - buf.avail_out;
+}
+
+
+rs_signature_t *make_sig(void const *basis, size_t basis_len,
+                         size_t block_len)
+{
+    size_t sig_max = 12 + (basis_len / block_len + 1) * 12, sig_len;
+    void *sig_buf = malloc(sig_max);
+    rs_signature_t *sig;
+
+    check(sig_buf);
+    sig_len = run(rs_sig_begin(block_len, 8, RS_BLAKE2_SIG_MAGIC),
+                  basis, basis_len, sig_buf, sig_max);
+    run(rs_loadsig_begin(&sig), sig_buf, sig_len, NULL, 0);
+    free(sig_buf);
+    return sig;
+}
+
+
+size_t make_delta(void const *basis, size_t basis_len, size_t block_len,
+                  void const *new_data, size_t new_len,
+                  void *delta, size_t delta_max)
+{
+    rs_signature_t *sig = make_sig(basis, basis_len, block_len);
+    size_t delta_len;
+
+    delta_len = run(rs_delta_begin(sig), new_data, new_len,
+                    delta, delta_max);
+    rs_free_sumset(sig);
+    return delta_len;
+}
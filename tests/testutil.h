@@ -0,0 +1,54 @@
+/*= -*- c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * librsync -- the library for network deltas
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+/*
+ * Helpers shared by the tests that drive whole jobs in memory.
+ */
+
+/*
+ * Like assert(), but still checked when NDEBUG is defined, for the
+ * results of calls that the test has to make whatever the build.
+ */
+#define check(cond) \
+    ((cond) ? (void) 0 : check_failed(#cond, __FILE__, __LINE__))
+
+void check_failed(char const *cond, char const *file, int line);
+
+/*
+ * Run JOB over all of IN at once, giving it room for OUT_LEN bytes of
+ * output, and return how many it wrote.
+ */
+size_t run(rs_job_t *job, void const *in, size_t in_len,
+           void *out, size_t out_len);
+
+/*
+ * Return the signature of the BASIS_LEN bytes at BASIS, with blocks of
+ * BLOCK_LEN bytes and 8 byte BLAKE2 sums, loaded and ready for a delta.
+ */
+rs_signature_t *make_sig(void const *basis, size_t basis_len,
+                         size_t block_len);
+
+/*
+ * Make the delta from the basis to NEW_LEN bytes of new data into the
+ * DELTA_MAX bytes at DELTA, through a signature made with make_sig(),
+ * and return its length.
+ */
+size_t make_delta(void const *basis, size_t basis_len, size_t block_len,
+                  void const *new_data, size_t new_len,
+                  void *delta, size_t delta_max);